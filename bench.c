@@ -0,0 +1,495 @@
+/**
+ *
+ * bench.c: parameterised workloads with throughput and latency percentiles
+ *
+ * usage: sfs_bench [-q] [-n] [-m] [-p] [-d disk] [-b block size] [-l latency us] [-w dirty kb] [-j results.json] [-s stats.json] [workload prefix ...]
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "libsfs.h"
+
+#define BENCH_DISK "disk.bench"
+#define BENCH_RAM_DISK "ram:disk.bench"
+#define BENCH_FILE_BYTES (4 * 1024 * 1024) // file size of the sequential and random workloads
+#define BENCH_MAX_OPS 100000
+
+typedef struct
+{
+    char name[32];
+    int ops;
+    long long bytes;
+    double seconds;
+    double p50, p99, p999; // seconds
+} bench_result;
+
+typedef struct
+{
+    const char *name;
+    int (*run)(bench_result *r, int size);
+    int size; // bytes per call, where the workload has one
+} workload;
+
+static double lat[BENCH_MAX_OPS];
+static char *data;
+static int scale = 1; // -q divides the op counts
+static char *disk = BENCH_DISK; // -m benchmarks on a RAM disk
+static int block_size = DEFAULT_BLOCK_SIZE, block_count = DEFAULT_DISK_BLOCKS; // -b sets the geometry
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmpDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* ops and bytes are filled in by the workload, the rest comes from lat[] */
+static void finish(bench_result *r)
+{
+    r->seconds = 0;
+    for (int i = 0; i < r->ops; i++)
+    {
+        r->seconds += lat[i];
+    }
+    qsort(lat, r->ops, sizeof(double), cmpDouble);
+    r->p50 = lat[(int)(0.5 * (r->ops - 1))];
+    r->p99 = lat[(int)(0.99 * (r->ops - 1))];
+    r->p999 = lat[(int)(0.999 * (r->ops - 1))];
+}
+
+static int fresh(void)
+{
+    if (make_fs_geometry(disk, block_size, block_count) || mount_fs(disk))
+    {
+        return -1;
+    }
+    fs_create("bench");
+    return fs_open("bench");
+}
+
+static void done(int fd)
+{
+    fs_close(fd);
+    umount_fs(disk);
+    remove(disk);
+}
+
+/* sequential ops cover the whole file once, small sizes a smaller file */
+static int seqOps(int size)
+{
+    long long total = (size >= BLOCK_SIZE) ? BENCH_FILE_BYTES : (long long)size * 32768;
+    int ops = (int)(total / size) / scale;
+    return (ops < 1) ? 1 : (ops > BENCH_MAX_OPS ? BENCH_MAX_OPS : ops);
+}
+
+static int randOps(int size)
+{
+    int ops = (int)((64LL * 1024 * 1024) / size);
+    ops = ((ops > 2000) ? 2000 : ops) / scale;
+    return (ops < 1) ? 1 : ops;
+}
+
+static int fill(int fd, int bytes)
+{
+    for (int off = 0; off < bytes; off += BLOCK_SIZE)
+    {
+        if (fs_write(fd, data + off, BLOCK_SIZE) != BLOCK_SIZE)
+            return -1;
+    }
+    return 0;
+}
+
+static int seqWrite(bench_result *r, int size)
+{
+    int fd = fresh();
+    if (fd < 0)
+        return -1;
+
+    r->ops = seqOps(size);
+    for (int i = 0; i < r->ops; i++)
+    {
+        double t0 = now();
+        if (fs_write(fd, data + (long long)i * size % BENCH_FILE_BYTES, size) != size)
+            return -1;
+        lat[i] = now() - t0;
+    }
+    r->bytes = (long long)r->ops * size;
+    done(fd);
+    return 0;
+}
+
+static int seqRead(bench_result *r, int size)
+{
+    int fd = fresh();
+    static char buf[1024 * 1024];
+    if (fd < 0)
+        return -1;
+
+    r->ops = seqOps(size);
+    for (int i = 0; i < r->ops; i++)
+    {
+        if (fs_write(fd, data + (long long)i * size % BENCH_FILE_BYTES, size) != size)
+            return -1;
+    }
+    fs_lseek(fd, 0);
+    for (int i = 0; i < r->ops; i++)
+    {
+        double t0 = now();
+        if (fs_read(fd, buf, size) != size)
+            return -1;
+        lat[i] = now() - t0;
+    }
+    r->bytes = (long long)r->ops * size;
+    done(fd);
+    return 0;
+}
+
+/* an op is the lseek plus the transfer */
+static int randIO(bench_result *r, int size, boolean write)
+{
+    int fd = fresh();
+    static char buf[1024 * 1024];
+    if (fd < 0 || fill(fd, BENCH_FILE_BYTES))
+        return -1;
+
+    srand(525);
+    r->ops = randOps(size);
+    for (int i = 0; i < r->ops; i++)
+    {
+        int off = (int)(((long long)rand() * RAND_MAX + rand()) % (BENCH_FILE_BYTES - size + 1));
+        double t0 = now();
+        fs_lseek(fd, off);
+        if ((write ? fs_write(fd, data + off, size) : fs_read(fd, buf, size)) != size)
+            return -1;
+        lat[i] = now() - t0;
+    }
+    r->bytes = (long long)r->ops * size;
+    done(fd);
+    return 0;
+}
+
+static int randRead(bench_result *r, int size)
+{
+    return randIO(r, size, False);
+}
+
+static int randWrite(bench_result *r, int size)
+{
+    return randIO(r, size, True);
+}
+
+/* like test10: 192 blocks, then single byte reads at random blocks */
+static int lseekProbe(bench_result *r, int size)
+{
+    int fd = fresh();
+    char c;
+    if (fd < 0 || fill(fd, 192 * BLOCK_SIZE))
+        return -1;
+
+    srand(525);
+    r->ops = 20000 / scale;
+    for (int i = 0; i < r->ops; i++)
+    {
+        double t0 = now();
+        fs_lseek(fd, (off_t)(rand() % 192) * BLOCK_SIZE + size);
+        if (fs_read(fd, &c, 1) != 1)
+            return -1;
+        lat[i] = now() - t0;
+    }
+    r->bytes = r->ops;
+    done(fd);
+    return 0;
+}
+
+/* an op is create, open, a small write, close and delete */
+static int createDelete(bench_result *r, int size)
+{
+    char name[MAX_FILENAME_LEN];
+    int fd = fresh();
+    if (fd < 0)
+        return -1;
+
+    r->ops = 10000 / scale;
+    for (int i = 0; i < r->ops; i++)
+    {
+        snprintf(name, sizeof(name), "storm%d", i % 16);
+        double t0 = now();
+        if (fs_create(name))
+            return -1;
+        int f = fs_open(name);
+        if (fs_write(f, data, size) != size)
+            return -1;
+        fs_close(f);
+        if (fs_delete(name))
+            return -1;
+        lat[i] = now() - t0;
+    }
+    r->bytes = (long long)r->ops * size;
+    done(fd);
+    return 0;
+}
+
+/* every file of the directory, written round robin and read back */
+static int manyFiles(bench_result *r, int size)
+{
+    static char buf[1024 * 1024];
+    int fds[MAX_FILE_DESCRIPTOR];
+    char name[MAX_FILENAME_LEN];
+    int files = MAX_FILE_DESCRIPTOR;
+    int rounds = 16 / scale + 1;
+    int i, j, n = 0;
+    int fd = fresh();
+    if (fd < 0)
+        return -1;
+    fs_close(fd);
+
+    for (i = 0; i < files; i++)
+    {
+        snprintf(name, sizeof(name), "many%d", i);
+        fs_create(name);
+        fds[i] = fs_open(name);
+    }
+    for (j = 0; j < rounds; j++)
+    {
+        for (i = 0; i < files; i++, n++)
+        {
+            double t0 = now();
+            if (fs_write(fds[i], data + (long long)n * size % BENCH_FILE_BYTES, size) != size)
+                return -1;
+            lat[n] = now() - t0;
+        }
+    }
+    for (i = 0; i < files; i++)
+    {
+        fs_lseek(fds[i], 0);
+    }
+    for (j = 0; j < rounds; j++)
+    {
+        for (i = 0; i < files; i++, n++)
+        {
+            double t0 = now();
+            if (fs_read(fds[i], buf, size) != size)
+                return -1;
+            lat[n] = now() - t0;
+        }
+    }
+    for (i = 0; i < files; i++)
+    {
+        fs_close(fds[i]);
+    }
+    r->ops = n;
+    r->bytes = (long long)n * size;
+    umount_fs(disk);
+    remove(disk);
+    return 0;
+}
+
+/* an op makes a whole file system, image included */
+static int makeFs(bench_result *r, int size)
+{
+    (void)size; // the geometry sets the image size
+    r->ops = 200 / scale;
+    for (int i = 0; i < r->ops; i++)
+    {
+        double t0 = now();
+        if (make_fs_geometry(disk, block_size, block_count))
+            return -1;
+        lat[i] = now() - t0;
+    }
+    r->bytes = (long long)r->ops * block_size * block_count;
+    remove(disk);
+    return 0;
+}
+
+static workload workloads[] = {
+    {"seq_write_1", seqWrite, 1},
+    {"seq_write_64", seqWrite, 64},
+    {"seq_write_4k", seqWrite, 4096},
+    {"seq_write_64k", seqWrite, 65536},
+    {"seq_write_1m", seqWrite, 1048576},
+    {"seq_read_1", seqRead, 1},
+    {"seq_read_64", seqRead, 64},
+    {"seq_read_4k", seqRead, 4096},
+    {"seq_read_64k", seqRead, 65536},
+    {"seq_read_1m", seqRead, 1048576},
+    {"rand_read_1", randRead, 1},
+    {"rand_read_4k", randRead, 4096},
+    {"rand_read_64k", randRead, 65536},
+    {"rand_read_1m", randRead, 1048576},
+    {"rand_write_1", randWrite, 1},
+    {"rand_write_4k", randWrite, 4096},
+    {"rand_write_64k", randWrite, 65536},
+    {"rand_write_1m", randWrite, 1048576},
+    {"lseek_probe", lseekProbe, 100},
+    {"create_delete", createDelete, 100},
+    {"many_files_4k", manyFiles, 4096},
+    {"make_fs", makeFs, 0},
+};
+
+static int selected(const char *name, int argc, char **argv, int first)
+{
+    if (first >= argc)
+        return 1;
+    for (int i = first; i < argc; i++)
+    {
+        if (strncmp(name, argv[i], strlen(argv[i])) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static bench_result results[sizeof(workloads) / sizeof(workloads[0])];
+    const char *json = NULL, *stats = NULL;
+    slow_config slow = {0};
+    writeback_config wb = {0, 0, 30000, 100};
+    char slow_name[64];
+    int i, n = 0, arg = 1;
+
+    while (arg < argc && argv[arg][0] == '-')
+    {
+        if (strcmp(argv[arg], "-q") == 0)
+        {
+            scale = 8;
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-m") == 0)
+        {
+            disk = BENCH_RAM_DISK; // the file system alone, without device noise
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-p") == 0)
+        {
+            disk_preallocate = 1; // images with their blocks allocated, not sparse
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-d") == 0 && arg + 1 < argc)
+        {
+            disk = argv[arg + 1]; // any disk name, e.g. a stripe set
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "-b") == 0 && arg + 1 < argc)
+        {
+            block_size = atoi(argv[arg + 1]); // the image keeps its size in bytes
+            block_count = (int)((long long)DEFAULT_BLOCK_SIZE * DEFAULT_DISK_BLOCKS / block_size);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "-l") == 0 && arg + 1 < argc)
+        {
+            slow.latency_us = atoi(argv[arg + 1]); // a network volume behind the disk
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "-w") == 0 && arg + 1 < argc)
+        {
+            wb.dirty_kb = atoi(argv[arg + 1]); // write-behind, writers held at twice this
+            wb.dirty_max_kb = 2 * wb.dirty_kb;
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "-n") == 0)
+        {
+            stats_enabled = 0; // baseline without the per-call counters
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-s") == 0 && arg + 1 < argc)
+        {
+            stats = argv[arg + 1];
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc)
+        {
+            json = argv[arg + 1];
+            arg += 2;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [-q] [-n] [-m] [-p] [-d disk] [-b block size] [-l latency us] [-w dirty kb] [-j results.json] [-s stats.json] [workload prefix ...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (slow.latency_us > 0)
+    {
+        disk_slow_config(&slow);
+        snprintf(slow_name, sizeof(slow_name), "slow:%s", disk);
+        disk = slow_name;
+    }
+    if (wb.dirty_kb > 0 && disk_writeback(&wb) != 0)
+    {
+        fprintf(stderr, "%s: bad write-behind size %d kb\n", argv[0], wb.dirty_kb);
+        return 1;
+    }
+
+    data = malloc(BENCH_FILE_BYTES + 1024 * 1024);
+    srand(525);
+    for (i = 0; i < BENCH_FILE_BYTES + 1024 * 1024; i++)
+        data[i] = (char)(rand() % 64 + ' ');
+
+    printf("%-16s %8s %12s %10s %10s %10s %10s\n", "workload", "ops", "ops/s", "MB/s", "p50 us", "p99 us", "p999 us");
+    for (i = 0; i < (int)(sizeof(workloads) / sizeof(workloads[0])); i++)
+    {
+        bench_result *r = &results[n];
+        if (!selected(workloads[i].name, argc, argv, arg))
+            continue;
+
+        memset(r, 0, sizeof(bench_result));
+        snprintf(r->name, sizeof(r->name), "%s", workloads[i].name);
+        if (workloads[i].run(r, workloads[i].size))
+        {
+            fprintf(stderr, "%s: workload failed\n", r->name);
+            return 1;
+        }
+        finish(r);
+        printf("%-16s %8d %12.0f %10.2f %10.1f %10.1f %10.1f\n", r->name, r->ops,
+               r->ops / r->seconds, r->bytes / r->seconds / 1e6, r->p50 * 1e6, r->p99 * 1e6, r->p999 * 1e6);
+        n++;
+    }
+
+    if (json != NULL)
+    {
+        FILE *f = fopen(json, "w");
+        if (f == NULL)
+        {
+            perror(json);
+            return 1;
+        }
+        fprintf(f, "{\n  \"block_size\": %d,\n  \"disk_blocks\": %d,\n  \"results\": [\n", BLOCK_SIZE, DISK_BLOCKS);
+        for (i = 0; i < n; i++)
+        {
+            bench_result *r = &results[i];
+            fprintf(f, "    {\"name\": \"%s\", \"ops\": %d, \"bytes\": %lld, \"seconds\": %.6f, "
+                       "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, "
+                       "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}%s\n",
+                    r->name, r->ops, r->bytes, r->seconds, r->ops / r->seconds, r->bytes / r->seconds / 1e6,
+                    r->p50 * 1e6, r->p99 * 1e6, r->p999 * 1e6, (i + 1 < n) ? "," : "");
+        }
+        fprintf(f, "  ]\n}\n");
+        fclose(f);
+    }
+
+    if (stats != NULL)
+    {
+        FILE *f = fopen(stats, "w");
+        if (f == NULL)
+        {
+            perror(stats);
+            return 1;
+        }
+        fs_stats_json(f);
+        fclose(f);
+    }
+
+    free(data);
+    return 0;
+}
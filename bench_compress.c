@@ -0,0 +1,107 @@
+/**
+ *
+ * bench_compress.c: raw vs compressed throughput on the same log workload
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "sfs.h"
+
+#define BENCH_DISK "disk.bench"
+#define BENCH_BYTES (4 * 1024 * 1024) // file size written and read back
+#define BENCH_IO 4096                 // bytes per fs_write / fs_read call
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* log lines: a timestamp, a level and a handful of messages */
+static void fillLog(char *buf, int len)
+{
+    static const char *levels[] = {"INFO", "WARN", "DEBUG"};
+    static const char *msgs[] = {"request served", "cache miss for key",
+                                 "connection reset by peer", "flushed batch"};
+    char line[128];
+    int pos = 0, n = 0;
+
+    srand(525);
+    while (pos < len)
+    {
+        int l = snprintf(line, sizeof(line), "2026-10-19T07:%02d:%02d.%03d %s %s %d\n",
+                         (n / 60000) % 60, (n / 1000) % 60, n % 1000,
+                         levels[rand() % 3], msgs[rand() % 4], rand() % 10000);
+        if (l > len - pos)
+            l = len - pos;
+        memcpy(buf + pos, line, l);
+        pos += l;
+        n += rand() % 7;
+    }
+}
+
+static int run(const char *label, boolean compress, char *data, char *back)
+{
+    int fd, off;
+    double t0, t1, t2;
+
+    make_fs(BENCH_DISK);
+    mount_fs(BENCH_DISK);
+    fs_create("bench");
+    fd = fs_open("bench");
+    if (fs_set_compression(fd, compress))
+        return -1;
+
+    t0 = now();
+    for (off = 0; off < BENCH_BYTES; off += BENCH_IO)
+    {
+        if (fs_write(fd, data + off, BENCH_IO) != BENCH_IO)
+            return -1;
+    }
+    t1 = now();
+    fs_lseek(fd, 0);
+    for (off = 0; off < BENCH_BYTES; off += BENCH_IO)
+    {
+        if (fs_read(fd, back + off, BENCH_IO) != BENCH_IO)
+            return -1;
+    }
+    t2 = now();
+
+    if (memcmp(data, back, BENCH_BYTES))
+        return -1;
+
+    int blocks = dir_pointer[(unsigned char)META[fd].file].num_blocks;
+    printf("%-10s write %8.2f MB/s  read %8.2f MB/s  blocks %5d  (%.2fx)\n", label,
+           BENCH_BYTES / (t1 - t0) / 1e6, BENCH_BYTES / (t2 - t1) / 1e6,
+           blocks, (double)BENCH_BYTES / BLOCK_SIZE / blocks);
+
+    fs_close(fd);
+    umount_fs(BENCH_DISK);
+    remove(BENCH_DISK);
+    return 0;
+}
+
+int main(void)
+{
+    char *data = malloc(BENCH_BYTES);
+    char *back = malloc(BENCH_BYTES);
+
+    fillLog(data, BENCH_BYTES);
+    printf("%d bytes in %d byte calls\n", BENCH_BYTES, BENCH_IO);
+
+    if (run("raw", False, data, back) || run("compressed", True, data, back))
+    {
+        fprintf(stderr, "bench_compress: workload failed\n");
+        return 1;
+    }
+
+    free(data);
+    free(back);
+    return 0;
+}
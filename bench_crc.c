@@ -0,0 +1,105 @@
+/**
+ *
+ * bench_crc.c: cost of the per-block CRC32C checksums at BLOCK_SIZE
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "crc32c.h"
+#include "sfs.h"
+
+#define BENCH_DISK "disk.bench"
+#define BENCH_BYTES (2 * 1024 * 1024) // file size written and read back
+#define CRC_ROUNDS 100000             // blocks checksummed per codec
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void crcRate(const char *label, unsigned int (*fn)(unsigned int, const char *, int), char *block)
+{
+    unsigned int crc = 0;
+    double t0 = now();
+    for (int i = 0; i < CRC_ROUNDS; i++)
+        crc += fn(i, block, BLOCK_SIZE);
+    double t = now() - t0;
+
+    printf("%-12s %8.1f ns/block  %6.2f GB/s  (%08x)\n", label,
+           t / CRC_ROUNDS * 1e9, (double)CRC_ROUNDS * BLOCK_SIZE / t / 1e9, crc);
+}
+
+/* write the file, then read it back with a cold block cache so every block is verified */
+static int fsRate(const char *label, boolean checksums, char *data, char *back, double *rd)
+{
+    int fd, off;
+    double t0, t1, t2;
+
+    crc_enabled = checksums;
+    make_fs(BENCH_DISK);
+    mount_fs(BENCH_DISK);
+    fs_create("bench");
+    fd = fs_open("bench");
+
+    t0 = now();
+    for (off = 0; off < BENCH_BYTES; off += BLOCK_SIZE)
+    {
+        if (fs_write(fd, data + off, BLOCK_SIZE) != BLOCK_SIZE)
+            return -1;
+    }
+    t1 = now();
+    dropCache();
+    fs_lseek(fd, 0);
+    for (off = 0; off < BENCH_BYTES; off += BLOCK_SIZE)
+    {
+        if (fs_read(fd, back + off, BLOCK_SIZE) != BLOCK_SIZE)
+            return -1;
+    }
+    t2 = now();
+
+    if (memcmp(data, back, BENCH_BYTES))
+        return -1;
+
+    *rd = BENCH_BYTES / (t2 - t1) / 1e6;
+    printf("%-12s write %8.2f MB/s  cold read %8.2f MB/s\n", label,
+           BENCH_BYTES / (t1 - t0) / 1e6, *rd);
+
+    fs_close(fd);
+    umount_fs(BENCH_DISK);
+    remove(BENCH_DISK);
+    return 0;
+}
+
+int main(void)
+{
+    char *data = malloc(BENCH_BYTES);
+    char *back = malloc(BENCH_BYTES);
+    double off_rate, on_rate;
+
+    srand(525);
+    for (int i = 0; i < BENCH_BYTES; i++)
+        data[i] = (char)rand();
+
+    printf("BLOCK_SIZE %d, crc32c on %s\n", BLOCK_SIZE, crc32c_hw() ? "CRC instructions" : "slice-by-8");
+    crcRate("crc32c", crc32c, data);
+    crcRate("slice-by-8", crc32c_sw, data);
+
+    if (fsRate("no checksum", False, data, back, &off_rate) ||
+        fsRate("checksum", True, data, back, &on_rate))
+    {
+        fprintf(stderr, "bench_crc: workload failed\n");
+        return 1;
+    }
+    printf("read overhead %.1f%%\n", (off_rate / on_rate - 1) * 100);
+
+    free(data);
+    free(back);
+    return 0;
+}
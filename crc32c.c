@@ -0,0 +1,139 @@
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC_HW_X86
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC_HW_ARM
+#endif
+
+/***************************************************************************/
+#define CRC32C_POLY 0x82F63B78 /* reflected Castagnoli polynomial          */
+/***************************************************************************/
+
+typedef unsigned int (*crc_fn)(unsigned int crc, const unsigned char *p, int len);
+
+static unsigned int table[8][256];
+static int table_ready = 0;
+static crc_fn impl = NULL;
+
+static void initTable(void)
+{
+    int i, j;
+
+    for (i = 0; i < 256; i++)
+    {
+        unsigned int crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+    {
+        for (j = 1; j < 8; j++)
+            table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+    }
+    table_ready = 1;
+}
+
+/* eight table lookups per 8 bytes, no dependency between them */
+static unsigned int crcSlice8(unsigned int crc, const unsigned char *p, int len)
+{
+    if (!table_ready)
+        initTable();
+
+    while (len >= 8)
+    {
+        unsigned int lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(CRC_HW_X86)
+__attribute__((target("sse4.2"))) static unsigned int crcHw(unsigned int crc, const unsigned char *p, int len)
+{
+    unsigned long long c = crc;
+
+    while (len >= 8)
+    {
+        unsigned long long v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (unsigned int)c;
+    while (len-- > 0)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+static int hwAvailable(void)
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(CRC_HW_ARM)
+__attribute__((target("+crc"))) static unsigned int crcHw(unsigned int crc, const unsigned char *p, int len)
+{
+    while (len >= 8)
+    {
+        unsigned long long v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+
+static int hwAvailable(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static crc_fn pick(void)
+{
+#if defined(CRC_HW_X86) || defined(CRC_HW_ARM)
+    if (hwAvailable())
+        return crcHw;
+#endif
+    return crcSlice8;
+}
+
+unsigned int crc32c(unsigned int crc, const char *buf, int len)
+{
+    if (impl == NULL)
+        impl = pick();
+    return ~impl(~crc, (const unsigned char *)buf, len);
+}
+
+unsigned int crc32c_sw(unsigned int crc, const char *buf, int len)
+{
+    return ~crcSlice8(~crc, (const unsigned char *)buf, len);
+}
+
+int crc32c_hw(void)
+{
+    if (impl == NULL)
+        impl = pick();
+    return impl != crcSlice8;
+}
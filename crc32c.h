@@ -0,0 +1,15 @@
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+/***************************************************************************/
+/* CRC32C (Castagnoli) block checksums                                      */
+/***************************************************************************/
+unsigned int crc32c(unsigned int crc, const char *buf, int len);
+/* uses SSE4.2 / ARMv8 CRC instructions when the CPU has them             */
+unsigned int crc32c_sw(unsigned int crc, const char *buf, int len);
+/* portable slice-by-8 fallback                                           */
+int crc32c_hw(void);
+/* 1 if crc32c() runs on the CRC instructions                             */
+/***************************************************************************/
+
+#endif
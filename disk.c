@@ -1,140 +1,587 @@
+#define _GNU_SOURCE /* fallocate */
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "disk.h"
+#include "mirrordisk.h"
+#include "stats.h"
+#include "stripedisk.h"
+#include "writeback.h"
 
 /***************************************************************************/
-static int active = 0; /* is the virtual disk open (active)?              */
-static int handle;     /* file handle to virtual disk                     */
+geometry disk_geometry = {DEFAULT_BLOCK_SIZE, DEFAULT_DISK_BLOCKS};
+int disk_preallocate;
+static const disk_backend *active; /* backend of the open disk, or NULL   */
+static int queue_submit(void);
+static int queued; /* blocks the request queue holds                     */
 /***************************************************************************/
 
-int make_disk(char *name)
+/* file backend */
+
+static int handle; /* file handle to virtual disk                         */
+
+int disk_make_image(const char *path, long long bytes)
 {
-    int f, cnt;
-    char buf[BLOCK_SIZE];
+    int f, rtn = 0;
 
-    if (!name)
+    if ((f = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+
+    /* a truncated file reads back as zeroes without a block written */
+    if (ftruncate(f, (off_t)bytes) == -1)
+        rtn = -1;
+#ifdef __linux__
+    else if (disk_preallocate && fallocate(f, 0, 0, (off_t)bytes) == -1 && errno != EOPNOTSUPP)
+        rtn = -1; // a file system without it keeps the image sparse
+#else
+    else if (disk_preallocate && (errno = posix_fallocate(f, 0, (off_t)bytes)) != 0)
+        rtn = -1;
+#endif
+
+    if (close(f) == -1)
+        rtn = -1;
+    return rtn;
+}
+
+static int file_make(char *name)
+{
+    if (disk_make_image(name, (long long)DISK_BLOCKS * BLOCK_SIZE) == -1)
     {
-        // fprintf(stderr, "make_disk: invalid file name\n");
+        perror("make_disk: cannot create file");
+        return -1;
+    }
+    return 0;
+}
+
+static int file_open(char *name)
+{
+    int f;
+
+    if ((f = open(name, O_RDWR, 0644)) < 0)
+    {
+        perror("open_disk: cannot open file");
+        return -1;
+    }
+
+    handle = f;
+    return handle;
+}
+
+static int file_writev(int block, int count, char *buf)
+{
+    if (pwrite(handle, buf, count * BLOCK_SIZE, (off_t)block * BLOCK_SIZE) < count * BLOCK_SIZE)
+    {
+        perror("block_write: failed to write");
         return -1;
     }
+    return 0;
+}
 
-    if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+static int file_readv(int block, int count, char *buf)
+{
+    if (pread(handle, buf, count * BLOCK_SIZE, (off_t)block * BLOCK_SIZE) < count * BLOCK_SIZE)
     {
-        perror("make_disk: cannot open file");
+        // perror("block_read: failed to read");
         return -1;
     }
+    return 0;
+}
 
-    memset(buf, 0, BLOCK_SIZE);
+static int file_write(int block, char *buf)
+{
+    return file_writev(block, 1, buf);
+}
 
-    for (cnt = 0; cnt < DISK_BLOCKS; ++cnt)
-        write(f, buf, BLOCK_SIZE);
+static int file_read(int block, char *buf)
+{
+    return file_readv(block, 1, buf);
+}
 
-    close(f);
+static int file_flush(void)
+{
+    return fdatasync(handle); // the image never changes size
+}
 
+static int file_close(void)
+{
+    close(handle);
+    handle = 0;
     return 0;
 }
 
-int open_disk(char *name)
+const disk_backend disk_file = {.name = "file", .make = file_make, .open = file_open, .read = file_read,
+                                .write = file_write, .readv = file_readv, .writev = file_writev,
+                                .flush = file_flush, .close = file_close};
+
+/* RAM backend: named disks in anonymous memory, kept until disk_ram_free */
+
+#define RAM_BYTES ((size_t)DISK_BLOCKS * BLOCK_SIZE)
+
+static struct
 {
-    int f;
+    char name[64];
+    char *mem;    /* NULL if the slot is free */
+    size_t bytes; /* RAM_BYTES at the geometry it was made with */
+} ram_disks[RAM_DISKS];
+static char *ram; /* memory of the open RAM disk */
 
-    if (!name)
+static int ram_find(char *name)
+{
+    for (int i = 0; i < RAM_DISKS; i++)
     {
-        // fprintf(stderr, "open_disk: invalid file name\n");
+        if (ram_disks[i].mem && strncmp(ram_disks[i].name, name, sizeof(ram_disks[i].name)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int ram_make(char *name)
+{
+    int i = ram_find(name);
+
+    if (i >= 0 && ram_disks[i].bytes == RAM_BYTES)
+    {
+        /* dropping the pages zeroes them and gives the memory back */
+        madvise(ram_disks[i].mem, RAM_BYTES, MADV_DONTNEED);
+        return 0;
+    }
+    if (i >= 0)
+    {
+        munmap(ram_disks[i].mem, ram_disks[i].bytes); // made again at another size
+        ram_disks[i].mem = NULL;
+    }
+    for (i = 0; i < RAM_DISKS && ram_disks[i].mem; i++)
+        ;
+    if (i == RAM_DISKS)
+    {
+        // fprintf(stderr, "make_disk: too many RAM disks\n");
         return -1;
     }
 
-    if (active)
+    char *mem = mmap(NULL, RAM_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
     {
-        // fprintf(stderr, "open_disk: disk is already open\n");
+        perror("make_disk: cannot map RAM disk");
         return -1;
     }
+    snprintf(ram_disks[i].name, sizeof(ram_disks[i].name), "%s", name);
+    ram_disks[i].mem = mem;
+    ram_disks[i].bytes = RAM_BYTES;
+    return 0;
+}
 
-    if ((f = open(name, O_RDWR, 0644)) < 0)
+static int ram_open(char *name)
+{
+    int i = ram_find(name);
+
+    if (i < 0 || ram_disks[i].bytes < RAM_BYTES)
     {
-        perror("open_disk: cannot open file");
+        // fprintf(stderr, "open_disk: no such RAM disk\n");
         return -1;
     }
+    ram = ram_disks[i].mem;
+    return 0;
+}
 
-    handle = f;
-    active = 1;
+static int ram_readv(int block, int count, char *buf)
+{
+    memcpy(buf, ram + (size_t)block * BLOCK_SIZE, (size_t)count * BLOCK_SIZE);
+    return 0;
+}
 
-    return handle;
+static int ram_writev(int block, int count, char *buf)
+{
+    memcpy(ram + (size_t)block * BLOCK_SIZE, buf, (size_t)count * BLOCK_SIZE);
+    return 0;
 }
 
-int close_disk()
+static int ram_read(int block, char *buf)
 {
-    if (!active)
-    {
-        // fprintf(stderr, "close_disk: no open disk\n");
+    return ram_readv(block, 1, buf);
+}
+
+static int ram_write(int block, char *buf)
+{
+    return ram_writev(block, 1, buf);
+}
+
+static int ram_flush(void)
+{
+    return 0;
+}
+
+static int ram_close(void)
+{
+    ram = NULL;
+    return 0;
+}
+
+const disk_backend disk_ram = {.name = "ram", .make = ram_make, .open = ram_open, .read = ram_read,
+                               .write = ram_write, .readv = ram_readv, .writev = ram_writev,
+                               .flush = ram_flush, .close = ram_close};
+
+int disk_ram_free(char *name)
+{
+    int i;
+
+    if (!name || (i = ram_find(name)) < 0 || (active && ram == ram_disks[i].mem))
         return -1;
-    }
 
-    close(handle);
+    munmap(ram_disks[i].mem, ram_disks[i].bytes);
+    ram_disks[i].mem = NULL;
+    return 0;
+}
+
+/* name prefixes, the first match wins and names without one are files */
+
+static struct
+{
+    const char *prefix;
+    const disk_backend *backend;
+} backends[DISK_BACKENDS] = {{"ram:", &disk_ram}, {"stripe:", &disk_stripe}, {"mirror:", &disk_mirror}};
+
+int disk_register(const char *prefix, const disk_backend *backend)
+{
+    int i;
 
-    active = handle = 0;
+    if (!prefix || !*prefix || !backend)
+        return -1;
 
+    for (i = 0; i < DISK_BACKENDS && backends[i].prefix; i++)
+    {
+        if (strcmp(backends[i].prefix, prefix) == 0)
+            break;
+    }
+    if (i == DISK_BACKENDS)
+        return -1;
+
+    backends[i].prefix = prefix;
+    backends[i].backend = backend;
     return 0;
 }
 
-int block_write(int block, char *buf)
+const disk_backend *disk_backend_for(char **name)
 {
-    if (!active)
+    for (int i = 0; i < DISK_BACKENDS && backends[i].prefix; i++)
+    {
+        size_t n = strlen(backends[i].prefix);
+        if (strncmp(*name, backends[i].prefix, n) == 0)
+        {
+            *name += n;
+            return backends[i].backend;
+        }
+    }
+    return &disk_file;
+}
+
+int disk_set_geometry(int block_size, int blocks)
+{
+    if (block_size == BLOCK_SIZE && blocks == DISK_BLOCKS)
+        return 0;
+    if (active || block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX ||
+        (block_size & (block_size - 1)) != 0 || blocks < 1 || blocks > DISK_BLOCKS_MAX)
+        return -1;
+
+    geometry old = disk_geometry;
+    disk_geometry.block_size = block_size;
+    disk_geometry.blocks = blocks;
+    if (wb_geometry() != 0)
     {
-        // fprintf(stderr, "block_write: disk not active\n");
+        disk_geometry = old; // the write-behind pool cannot hold a block
+        wb_geometry();
         return -1;
     }
+    return 0;
+}
 
-    if ((block < 0) || (block >= DISK_BLOCKS))
+int make_disk(char *name)
+{
+    if (!name)
     {
-        // fprintf(stderr, "block_write: block index out of bounds\n");
+        // fprintf(stderr, "make_disk: invalid file name\n");
         return -1;
     }
 
-    if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0)
+    const disk_backend *backend = disk_backend_for(&name);
+    return backend->make(name);
+}
+
+int open_disk(char *name)
+{
+    int rtn;
+
+    if (!name)
     {
-        perror("block_write: failed to lseek");
+        // fprintf(stderr, "open_disk: invalid file name\n");
         return -1;
     }
 
-    if (write(handle, buf, BLOCK_SIZE) < 0)
+    if (active)
     {
-        perror("block_write: failed to write");
+        // fprintf(stderr, "open_disk: disk is already open\n");
         return -1;
     }
 
-    return 0;
+    const disk_backend *backend = disk_backend_for(&name);
+    if ((rtn = backend->open(name)) < 0)
+        return -1;
+
+    active = backend;
+    return rtn;
 }
 
-int block_read(int block, char *buf)
+int close_disk()
 {
     if (!active)
     {
-        // fprintf(stderr, "block_read: disk not active\n");
+        // fprintf(stderr, "close_disk: no open disk\n");
         return -1;
     }
 
-    if ((block < 0) || (block >= DISK_BLOCKS))
+    int rtn = 0;
+    if (queued > 0)
+        queue_submit(); // nothing may stay behind in memory for a closed disk
+    if (wb_drain() == -1)
     {
-        // fprintf(stderr, "block_read: block index out of bounds\n");
+        wb_forget(); // the device failed them, they cannot wait for it
+        rtn = -1;
+    }
+    active->close();
+    active = NULL;
+
+    return rtn;
+}
+
+int disk_flush(void)
+{
+    if (!active || (queued > 0 && queue_submit() != 0) || wb_drain() == -1)
         return -1;
+    if (!writeback_on)
+        return active->flush();
+
+    wb_io_lock();
+    int rtn = active->flush();
+    wb_io_unlock();
+    return rtn;
+}
+
+const disk_backend *disk_open_backend(void)
+{
+    return active;
+}
+
+int disk_copies(void)
+{
+    if (!active)
+        return 0;
+    return active->copies ? active->copies() : 1;
+}
+
+/* request queue: while plugged, block writes wait in arrival order and go
+   down sorted by block number at the last unplug, adjacent blocks in one
+   transfer; reads look at it first so they see the queued data           */
+
+static int plugged;                        /* nesting depth of disk_plug */
+static int queue[IOQ_MAX];                 /* their numbers, then sorted */
+static short slot_of[DISK_BLOCKS_MAX];     /* -1 unless queued; set up   */
+static char queue_data[IOQ_MAX * BLOCK_SIZE_MAX]; /* on the first plug   */
+static char queue_run[IOQ_RUN_MAX * BLOCK_SIZE_MAX];
+static ioqueue_stats qstats;
+
+/* the layers under the queue: write-behind, then the backend */
+static int device_write(int block, int count, char *buf)
+{
+    if (writeback_on)
+        return wb_write(block, count, buf);
+    return count == 1 ? active->write(block, buf) : active->writev(block, count, buf);
+}
+
+static int device_read(int block, int count, char *buf)
+{
+    if (writeback_on)
+        return wb_read(block, count, buf);
+    return count == 1 ? active->read(block, buf) : active->readv(block, count, buf);
+}
+
+static int queue_submit(void)
+{
+    int rtn = 0;
+
+    /* arrivals are mostly in order already, insertion sort is linear then */
+    for (int i = 1; i < queued; i++)
+    {
+        int b = queue[i], j = i;
+        for (; j > 0 && queue[j - 1] > b; j--)
+            queue[j] = queue[j - 1];
+        queue[j] = b;
     }
 
-    if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0)
+    for (int i = 0; i < queued;)
     {
-        // perror("block_read: failed to lseek");
+        int b = queue[i], n = 1;
+        int in_place = 1; // slots follow each other, no copy needed
+        while (i + n < queued && n < IOQ_RUN_MAX && queue[i + n] == b + n)
+        {
+            in_place &= slot_of[b + n] == slot_of[b] + n;
+            n++;
+        }
+
+        char *buf = queue_data + (size_t)slot_of[b] * BLOCK_SIZE;
+        if (!in_place)
+        {
+            for (int k = 0; k < n; k++)
+                memcpy(queue_run + (size_t)k * BLOCK_SIZE, queue_data + (size_t)slot_of[b + k] * BLOCK_SIZE, BLOCK_SIZE);
+            buf = queue_run;
+        }
+        if (device_write(b, n, buf) != 0)
+            rtn = -1;
+
+        for (int k = 0; k < n; k++)
+            slot_of[b + k] = -1;
+        qstats.submitted += n;
+        qstats.transfers++;
+        i += n;
+    }
+    queued = 0;
+    return rtn;
+}
+
+static int queue_write(int block, int count, char *buf)
+{
+    int rtn = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        int slot = slot_of[block + i];
+        if (slot == -1)
+        {
+            if (queued == IOQ_MAX && queue_submit() != 0)
+                rtn = -1;
+            slot = slot_of[block + i] = queued;
+            queue[queued++] = block + i;
+        }
+        else
+            qstats.absorbed++;
+        memcpy(queue_data + (size_t)slot * BLOCK_SIZE, buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    qstats.queued += count;
+    return rtn;
+}
+
+static int queue_read(int block, int count, char *buf)
+{
+    int hits = 0;
+
+    for (int i = 0; i < count; i++)
+        hits += slot_of[block + i] != -1;
+    if (hits < count && device_read(block, count, buf) != 0)
         return -1;
+
+    for (int i = 0; i < count && hits > 0; i++)
+    {
+        if (slot_of[block + i] != -1)
+            memcpy(buf + (size_t)i * BLOCK_SIZE, queue_data + (size_t)slot_of[block + i] * BLOCK_SIZE, BLOCK_SIZE);
     }
+    qstats.read_hits += hits;
+    return 0;
+}
 
-    if (read(handle, buf, BLOCK_SIZE) < 0)
+void disk_plug(void)
+{
+    static int ready;
+
+    if (!ready)
     {
-        // perror("block_read: failed to read");
+        for (int b = 0; b < DISK_BLOCKS_MAX; b++)
+            slot_of[b] = -1;
+        ready = 1;
+    }
+    plugged++;
+}
+
+int disk_unplug(void)
+{
+    if (plugged == 0 || --plugged > 0 || queued == 0)
+        return 0;
+    return active ? queue_submit() : -1;
+}
+
+int disk_queue_stats(ioqueue_stats *stats)
+{
+    if (!stats)
+        return -1;
+    *stats = qstats;
+    stats->pending = queued;
+    return 0;
+}
+
+/* the transfers, bounds checked, timed and counted per call (see stats.h) */
+
+static int check(int block, int count)
+{
+    if (!active)
+    {
+        // fprintf(stderr, "block_io: disk not active\n");
         return -1;
     }
 
+    if ((block < 0) || (count < 1) || (block + count > DISK_BLOCKS))
+    {
+        // fprintf(stderr, "block_io: block index out of bounds\n");
+        return -1;
+    }
     return 0;
 }
+
+int block_write(int block, char *buf)
+{
+    unsigned long long t = statStart();
+    int rtn = check(block, 1) ? -1 : plugged ? queue_write(block, 1, buf) : device_write(block, 1, buf);
+    statEnd(OP_BLOCK_WRITE, t, rtn, BLOCK_SIZE);
+    return rtn;
+}
+
+int block_read(int block, char *buf)
+{
+    unsigned long long t = statStart();
+    int rtn = check(block, 1) ? -1 : queued ? queue_read(block, 1, buf) : device_read(block, 1, buf);
+    statEnd(OP_BLOCK_READ, t, rtn, BLOCK_SIZE);
+    return rtn;
+}
+
+int blocks_write(int block, int count, char *buf)
+{
+    unsigned long long t = statStart();
+    int rtn = check(block, count) ? -1 : plugged ? queue_write(block, count, buf) : device_write(block, count, buf);
+    statEnd(OP_BLOCKS_WRITE, t, rtn, (long long)count * BLOCK_SIZE);
+    return rtn;
+}
+
+int blocks_read(int block, int count, char *buf)
+{
+    unsigned long long t = statStart();
+    int rtn = check(block, count) ? -1 : queued ? queue_read(block, count, buf) : device_read(block, count, buf);
+    statEnd(OP_BLOCKS_READ, t, rtn, (long long)count * BLOCK_SIZE);
+    return rtn;
+}
+
+int blocks_read_copy(int copy, int block, int count, char *buf)
+{
+    if (check(block, count) || copy < 0 || copy >= disk_copies())
+        return -1;
+
+    /* the copies are compared as they are on the device, with every write
+       the caller made on them */
+    if ((queued > 0 && queue_submit() != 0) || wb_drain() == -1)
+        return -1;
+
+    unsigned long long t = statStart();
+    int rtn = active->read_copy ? active->read_copy(copy, block, count, buf) : active->readv(block, count, buf);
+    statEnd(OP_BLOCKS_READ, t, rtn, (long long)count * BLOCK_SIZE);
+    return rtn;
+}
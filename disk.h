@@ -2,17 +2,101 @@
 #define _DISK_H_
 
 /***************************************************************************/
-#define DISK_BLOCKS 64 /* number of blocks on the disk              */
-#define BLOCK_SIZE 16  /* block size on "disk"                      */
+#define DISK_BLOCKS (disk_geometry.blocks)    /* number of blocks on the disk */
+#define BLOCK_SIZE (disk_geometry.block_size) /* block size on "disk"         */
+#define DEFAULT_DISK_BLOCKS 8192
+#define DEFAULT_BLOCK_SIZE 4096
+#define BLOCK_SIZE_MIN 512      /* block sizes are powers of two in between */
+#define BLOCK_SIZE_MAX 65536
+#define DISK_BLOCKS_MAX (1 << 20)
+#define DISK_BACKENDS 8  /* name prefixes disk_register can add     */
+#define RAM_DISKS 16     /* RAM disks that can exist at one time    */
+#define IOQ_MAX 256      /* block writes a plugged queue holds      */
+#define IOQ_RUN_MAX 64   /* blocks merged into one queued transfer  */
 /***************************************************************************/
+
+typedef struct
+{
+    int block_size;
+    int blocks;
+} geometry;
+
+extern geometry disk_geometry;
+
+int disk_set_geometry(int block_size, int blocks);
+/* geometry of the disks made and opened from now on; -1 while a disk is
+   open or if it is out of range. Block 0 starts at byte 0 at any geometry,
+   so a header read at BLOCK_SIZE_MIN can tell which one an image has     */
+
+/* a block device; block numbers and counts are checked before the calls */
+typedef struct
+{
+    const char *name;
+    int (*make)(char *name);                      /* create an empty device */
+    int (*open)(char *name);
+    int (*read)(int block, char *buf);            /* one block              */
+    int (*write)(int block, char *buf);
+    int (*readv)(int block, int count, char *buf); /* count consecutive blocks */
+    int (*writev)(int block, int count, char *buf);
+    int (*flush)(void);                           /* make writes durable    */
+    int (*close)(void);
+    int (*copies)(void);                          /* copies of each block,  */
+    int (*read_copy)(int copy, int block, int count, char *buf); /* or NULL */
+} disk_backend;
+
+extern const disk_backend disk_file; /* a file of DISK_BLOCKS blocks       */
+extern const disk_backend disk_ram;  /* anonymous memory, "ram:<name>"     */
+
+int disk_register(const char *prefix, const disk_backend *backend);
+/* disk names starting with prefix go to backend, which sees the rest     */
+const disk_backend *disk_backend_for(char **name);
+/* backend of a disk name, with name moved past the prefix               */
+const disk_backend *disk_open_backend(void);
+/* backend of the open disk, NULL if none is open                        */
+int disk_ram_free(char *name);
+/* release the memory of a RAM disk that is not open                      */
+
+extern int disk_preallocate;
+/* set, images are made with their blocks allocated instead of sparse     */
+int disk_make_image(const char *path, long long bytes);
+/* create or truncate a file to bytes in O(1) calls, for the backends; it
+   reads as zeroes, but make_fs writes every block it relies on itself    */
+
 int make_disk(char *name); /* create an empty, virtual disk file        */
 int open_disk(char *name); /* open a virtual disk (file)                */
 int close_disk();          /* close a previously opened disk (file)     */
+int disk_flush(void);      /* push the writes of the open disk down,
+                              write-behind blocks included (writeback.h) */
+int disk_copies(void);     /* copies the open disk keeps of each block  */
+
+/* request queue: between disk_plug and the matching disk_unplug, block
+   writes are held in memory and go down sorted, adjacent blocks merged.
+   A queued write cannot fail; a failed transfer fails the unplug (or the
+   disk_flush, which submits the queue whether plugged or not)            */
+typedef struct
+{
+    int pending;                  /* blocks waiting now                   */
+    unsigned long long queued;    /* block writes the queue took          */
+    unsigned long long absorbed;  /* of them, rewrites of a queued block  */
+    unsigned long long submitted; /* blocks sent down                     */
+    unsigned long long transfers; /* transfers they were merged into      */
+    unsigned long long read_hits; /* blocks reads found in the queue      */
+} ioqueue_stats;
+
+void disk_plug(void);   /* plugs nest, the outermost unplug submits     */
+int disk_unplug(void);
+int disk_queue_stats(ioqueue_stats *stats);
 
 int block_write(int block, char *buf);
 /* write a block of size BLOCK_SIZE to disk  */
 int block_read(int block, char *buf);
 /* read a block of size BLOCK_SIZE from disk */
+int blocks_write(int block, int count, char *buf);
+/* write count consecutive blocks in one transfer */
+int blocks_read(int block, int count, char *buf);
+/* read count consecutive blocks in one transfer */
+int blocks_read_copy(int copy, int block, int count, char *buf);
+/* read the blocks from one copy only, 0 <= copy < disk_copies() */
 /***************************************************************************/
 
-#endif
\ No newline at end of file
+#endif
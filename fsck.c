@@ -0,0 +1,655 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "fsck.h"
+#include "hash.h"
+#include "journal.h"
+#include "sfs.h"
+#include "summary.h"
+
+/***************************************************************************/
+/* What the on-disk structures say about every block is collected first,   */
+/* then worker threads stream the image in block ranges and compare it     */
+/* against the allocation map, the reference counts and the checksums.     */
+/* The transactions a mount would replay are read over the blocks they    */
+/* replace, so the image is checked the way that mount will find it.      */
+/***************************************************************************/
+
+typedef struct
+{
+    int fd;
+    int verbose;
+    fsck_report *report;
+    pthread_mutex_t lock;
+
+    super_block sb;
+    fs_summary summary;               /* stored behind the super block        */
+    char map[MAP_BYTES_MAX];
+    unsigned char refs[MAP_BYTES_MAX];
+    unsigned int crcs[CRC_BYTES_MAX / sizeof(unsigned int)];
+
+    int logged;                         /* images the pending transactions hold */
+    int log_home[JOURNAL_BLOCKS];       /* block each of them replaces          */
+    char log[JOURNAL_BLOCKS * BLOCK_SIZE_MAX];
+    int ordered;                        /* data blocks of the last transaction  */
+    int ordered_block[JOURNAL_ORDERED_MAX];
+    unsigned int ordered_sum[JOURNAL_ORDERED_MAX]; /* their checksums before it */
+
+    char want[DISK_BLOCKS_MAX];           /* tag the map should carry         */
+    int uses[DISK_BLOCKS_MAX];            /* index entries naming a shared block */
+    unsigned char frags[DISK_BLOCKS_MAX]; /* fragment slots taken in a tail block */
+} fsck_state;
+
+typedef struct
+{
+    fsck_state *st;
+    int first; /* blocks [first, last) */
+    int last;
+    int used;
+} fsck_worker;
+
+static void fsckProblem(fsck_state *st, int *counter, const char *fmt, ...)
+{
+    va_list ap;
+
+    pthread_mutex_lock(&st->lock);
+    st->report->errors++;
+    if (counter != NULL)
+    {
+        (*counter)++;
+    }
+    if (st->verbose)
+    {
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+        putchar('\n');
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+static int fsckRead(fsck_state *st, int block, int count, void *buf)
+{
+    ssize_t len = (ssize_t)count * BLOCK_SIZE;
+    if (pread(st->fd, buf, len, (off_t)block * BLOCK_SIZE) != len)
+    {
+        return -1;
+    }
+
+    /* the newest image of a block in the log wins */
+    for (int i = 0; i < st->logged; i++)
+    {
+        if (st->log_home[i] >= block && st->log_home[i] < block + count)
+        {
+            memcpy((char *)buf + (size_t)(st->log_home[i] - block) * BLOCK_SIZE,
+                   st->log + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+        }
+    }
+    return 0;
+}
+
+/* a directory, map, reference or checksum image in the log, whose own
+   checksum is only taken when it goes home */
+static int fsckLoggedMeta(fsck_state *st, int block)
+{
+    super_block *sb = &st->sb;
+
+    if ((block < sb->dir_index || block >= sb->fp_index) && (block < sb->crc_index || block >= sb->snap_index))
+    {
+        return 0;
+    }
+    for (int i = 0; i < st->logged; i++)
+    {
+        if (st->log_home[i] == block)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* a data block of the last transaction that a crash kept from going home
+   still matches the checksum it had before */
+static int fsckOrdered(fsck_state *st, int block, unsigned int sum)
+{
+    for (int k = 0; k < st->ordered; k++)
+    {
+        if (st->ordered_block[k] == block)
+        {
+            return st->ordered_sum[k] == 0 || st->ordered_sum[k] == sum;
+        }
+    }
+    return 0;
+}
+
+static int fsckBlocks(int size)
+{
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/* record that a structure owns block, shared tags may be claimed repeatedly */
+static int fsckClaim(fsck_state *st, int block, char tag, int shared, const char *what)
+{
+    if (block < 0 || block >= DISK_BLOCKS)
+    {
+        fsckProblem(st, NULL, "%s points outside the disk (block %d)", what, block);
+        return -1;
+    }
+    if (tag == MAP_SHARED)
+    {
+        st->uses[block]++;
+    }
+    if (st->want[block] == tag && shared)
+    {
+        return 0;
+    }
+    if (st->want[block] != 0)
+    {
+        fsckProblem(st, &st->report->double_owned, "block %d of %s is owned twice (tags %d and %d)",
+                    block, what, st->want[block], tag);
+        return -1;
+    }
+    st->want[block] = tag;
+    return 0;
+}
+
+static int fsckSuper(fsck_state *st)
+{
+    char buf[BLOCK_SIZE];
+    super_block copy;
+    unsigned int sum = 0;
+    int i;
+
+    if (fsckRead(st, 0, 1, buf) == -1)
+    {
+        fsckProblem(st, NULL, "cannot read the super block");
+        return -1;
+    }
+    memcpy(&st->sb, buf, sizeof(super_block));
+    memcpy(&st->summary, buf + SUMMARY_OFFSET, SUMMARY_BYTES);
+    copy = st->sb;
+    copy.sb_sum = 0;
+    if (crc32c(0, (char *)&copy, sizeof(super_block)) != st->sb.sb_sum)
+    {
+        fsckProblem(st, NULL, "super block checksum does not match");
+        return -1;
+    }
+
+    /* the layout make_fs lays down, everything else is found through it */
+    super_block *sb = &st->sb;
+    if (sb->dir_index <= 0 || sb->data_index <= sb->dir_index ||
+        sb->ref_index != sb->data_index + MAP_BLOCKS || sb->fp_index != sb->ref_index + REF_BLOCKS ||
+        sb->crc_index != sb->fp_index + FP_BLOCKS || sb->snap_index != sb->crc_index + CRC_BLOCKS ||
+        sb->journal_index != sb->snap_index + SNAP_MAX || sb->journal_index + JOURNAL_BLOCKS > DISK_BLOCKS ||
+        sizeof(journal_desc) > (size_t)BLOCK_SIZE)
+    {
+        fsckProblem(st, NULL, "super block layout is inconsistent");
+        return -1;
+    }
+
+    for (i = 0; i < CRC_BLOCKS; i++)
+    {
+        char *table = (char *)st->crcs + i * BLOCK_SIZE;
+        if (fsckRead(st, sb->crc_index + i, 1, table) == -1)
+        {
+            fsckProblem(st, NULL, "cannot read the checksum table");
+            return -1;
+        }
+        sum = crc32c(sum, table, BLOCK_SIZE);
+    }
+    if (sum != sb->crc_sum)
+    {
+        fsckProblem(st, NULL, "checksum table does not match the super block");
+        return -1;
+    }
+
+    /* committed transactions waiting in the log, up to a torn one */
+    journal_desc *desc = (journal_desc *)buf;
+    for (i = 0; i < JOURNAL_BLOCKS; i += 1 + desc->count)
+    {
+        char *images = st->log + (size_t)st->logged * BLOCK_SIZE;
+        if (fsckRead(st, sb->journal_index + i, 1, buf) == -1 || desc->magic != JOURNAL_MAGIC ||
+            desc->seq != sb->journal_seq + st->report->journal_pending || desc->count <= 0 ||
+            desc->count > JOURNAL_COMMIT_MAX || i + 1 + desc->count > JOURNAL_BLOCKS || desc->ordered < 0 ||
+            desc->ordered > JOURNAL_ORDERED || desc->sum != journalDescSum(desc) ||
+            fsckRead(st, sb->journal_index + i + 1, desc->count, images) == -1 ||
+            crc32c(0, images, (size_t)desc->count * BLOCK_SIZE) != desc->data_sum)
+            break;
+        for (int k = 0; k < desc->count; k++)
+        {
+            int home = desc->blocks[k];
+            if (home <= 0 || home >= DISK_BLOCKS || (home >= sb->journal_index && home < sb->journal_index + JOURNAL_BLOCKS))
+            {
+                fsckProblem(st, NULL, "journal transaction %d names block %d", st->report->journal_pending, home);
+                return -1;
+            }
+            st->log_home[st->logged + k] = home;
+        }
+        st->logged += desc->count;
+        st->ordered = desc->ordered;
+        memcpy(st->ordered_block, desc->ordered_block, desc->ordered * sizeof(int));
+        memcpy(st->ordered_sum, desc->ordered_sum, desc->ordered * sizeof(unsigned int));
+        st->report->journal_pending++;
+    }
+
+    /* the super block counts the files only at checkpoints */
+    file_info *dir = (file_info *)buf;
+    if (st->logged > 0 && fsckRead(st, sb->dir_index, 1, buf) == 0)
+    {
+        sb->dir_len = 0;
+        for (i = 0; i < MAX_FILE; i++)
+        {
+            sb->dir_len += dir[i].used == True;
+        }
+    }
+
+    if (fsckRead(st, sb->crc_index, CRC_BLOCKS, st->crcs) == -1 ||
+        fsckRead(st, sb->data_index, MAP_BLOCKS, st->map) == -1 ||
+        fsckRead(st, sb->ref_index, REF_BLOCKS, st->refs) == -1)
+    {
+        fsckProblem(st, NULL, "cannot read the allocation map");
+        return -1;
+    }
+
+    for (i = 0; i < sb->journal_index + JOURNAL_BLOCKS; i++)
+    {
+        st->want[i] = MAP_RESERVED;
+    }
+    return 0;
+}
+
+/* check one directory or snapshot entry, tag is what its own blocks carry */
+static void fsckFile(fsck_state *st, file_info *file, char tag, const char *what)
+{
+    int i, j, count = 0;
+
+    if (file->head != -1 && file->tail != -1)
+    {
+        fsckProblem(st, NULL, "%s has both a head and a tail block", what);
+        return;
+    }
+
+    if (file->tail != -1)
+    {
+        /* packed, fragments of the shared tail block */
+        int need = (file->size + FRAG_SIZE - 1) / FRAG_SIZE;
+        if (file->size > PACK_MAX || file->frag < 0 || file->frag + need > FRAGS_PER_BLOCK)
+        {
+            fsckProblem(st, NULL, "%s has fragments outside its tail block", what);
+            return;
+        }
+        if (fsckClaim(st, file->tail, tag == MAP_SNAP ? MAP_SNAP : MAP_TAIL, 1, what) == -1)
+        {
+            return;
+        }
+        for (i = file->frag; i < file->frag + need; i++)
+        {
+            if (st->frags[file->tail] & (1 << i))
+            {
+                fsckProblem(st, &st->report->double_owned, "%s shares fragment %d of block %d",
+                            what, i, file->tail);
+            }
+            st->frags[file->tail] |= 1 << i;
+        }
+        return;
+    }
+
+    if (file->head == -1)
+    {
+        if (file->size != 0)
+        {
+            fsckProblem(st, &st->report->count_mismatch, "%s has %d bytes and no blocks", what, file->size);
+        }
+        return;
+    }
+
+    if (file->flags & FI_COMPRESS)
+    {
+        cluster_entry index[CLUSTERS_PER_FILE];
+        if (fsckClaim(st, file->head, tag, 0, what) == -1 || fsckRead(st, file->head, 1, index) == -1)
+        {
+            return;
+        }
+        count = 1;
+        for (i = 0; i < CLUSTERS_PER_FILE; i++)
+        {
+            int len = index[i].clen & ~COMP_RAW;
+            if (index[i].block == -1)
+            {
+                continue;
+            }
+            if (len <= 0 || len > CLUSTER_SIZE)
+            {
+                fsckProblem(st, NULL, "%s has a cluster of %d bytes", what, len);
+                continue;
+            }
+            for (j = 0; j < fsckBlocks(len); j++, count++)
+            {
+                fsckClaim(st, index[i].block + j, tag, 0, what);
+            }
+        }
+    }
+    else if (file->flags & FI_MAPPED)
+    {
+        static int index[MAP_INDEX_ENTRIES_MAX];
+        for (i = 0; i < MAP_INDEX_BLOCKS; i++)
+        {
+            fsckClaim(st, file->head + i, tag, 0, what);
+        }
+        if (file->head < 0 || file->head + MAP_INDEX_BLOCKS > DISK_BLOCKS ||
+            fsckRead(st, file->head, MAP_INDEX_BLOCKS, index) == -1)
+        {
+            return;
+        }
+        count = MAP_INDEX_BLOCKS;
+        for (i = 0; i < MAP_INDEX_ENTRIES; i++)
+        {
+            if ((index[i] == -1) != (i >= fsckBlocks(file->size)))
+            {
+                fsckProblem(st, &st->report->count_mismatch, "%s: index entry %d does not match its size",
+                            what, i);
+            }
+            if (index[i] != -1 && fsckClaim(st, index[i], MAP_SHARED, 1, what) == 0)
+            {
+                count++;
+            }
+        }
+    }
+    else
+    {
+        /* chain, the blocks carrying its tag in ascending order from the head */
+        if (tag == MAP_SNAP)
+        {
+            fsckProblem(st, NULL, "%s is a chain file", what);
+            return;
+        }
+        if (file->head < 0 || file->head >= DISK_BLOCKS || st->map[file->head] != tag)
+        {
+            fsckProblem(st, &st->report->lost, "%s: head block %d is not tagged as its own", what, file->head);
+            return;
+        }
+        for (i = file->head; i < DISK_BLOCKS; i++)
+        {
+            if (st->map[i] == tag && fsckClaim(st, i, tag, 0, what) == 0)
+            {
+                count++;
+            }
+        }
+        if (file->size > count * BLOCK_SIZE)
+        {
+            fsckProblem(st, &st->report->count_mismatch, "%s has %d bytes in %d blocks", what, file->size, count);
+        }
+    }
+
+    if (count != file->num_blocks)
+    {
+        fsckProblem(st, &st->report->count_mismatch, "%s holds %d blocks, num_blocks says %d",
+                    what, count, file->num_blocks);
+    }
+}
+
+/* a summary stored for this checkpoint has to match the map and the
+   directory the checkpoint wrote; without one mount builds it */
+static void fsckSummary(fsck_state *st, file_info *dir)
+{
+    fs_summary copy = st->summary;
+    int free_blocks = 0;
+
+    copy.sum = 0;
+    if (copy.magic != SUMMARY_MAGIC || copy.seq != st->sb.journal_seq || st->report->journal_pending > 0 ||
+        crc32c(0, (char *)&copy, SUMMARY_BYTES) != st->summary.sum)
+    {
+        return;
+    }
+
+    for (int g = 0; g < SUM_GROUPS; g++)
+    {
+        sum_group want = {0, 0, 0, 0};
+        int run = 0;
+        for (int b = g * SUM_GROUP; b < (g + 1) * SUM_GROUP && b < DISK_BLOCKS; b++)
+        {
+            run = st->map[b] == 0 ? run + 1 : 0;
+            want.free += st->map[b] == 0;
+            want.longest = run > want.longest ? run : want.longest;
+            want.head = run == b - g * SUM_GROUP + 1 ? run : want.head;
+        }
+        want.tail = run;
+        free_blocks += want.free;
+        if (memcmp(&want, &st->summary.groups[g], sizeof(sum_group)) != 0)
+        {
+            fsckProblem(st, &st->report->bad_summary, "free-space summary of blocks %d-%d is wrong",
+                        g * SUM_GROUP, (g + 1) * SUM_GROUP - 1);
+        }
+    }
+    if (free_blocks != st->summary.free_blocks)
+    {
+        fsckProblem(st, &st->report->bad_summary, "summary has %d free blocks, the map %d",
+                    st->summary.free_blocks, free_blocks);
+    }
+
+    /* every name is in the chain of its bucket, and every chain link is used */
+    int linked = 0;
+    for (int b = 0; b < DIR_HASH; b++)
+    {
+        for (int i = st->summary.dir_hash[b], hops = 0; i != -1 && hops <= MAX_FILE; i = st->summary.dir_next[i], hops++)
+        {
+            if (i < 0 || i >= MAX_FILE || !dir[i].used ||
+                (int)(hash64(dir[i].name, strnlen(dir[i].name, MAX_FILENAME_LEN), 0) % DIR_HASH) != b || hops == MAX_FILE)
+            {
+                fsckProblem(st, &st->report->bad_summary, "name index bucket %d is broken", b);
+                break;
+            }
+            linked++;
+        }
+    }
+    if (linked != st->sb.dir_len)
+    {
+        fsckProblem(st, &st->report->bad_summary, "name index holds %d files, the directory %d",
+                    linked, st->sb.dir_len);
+    }
+}
+
+static void fsckDirectory(fsck_state *st)
+{
+    char buf[BLOCK_SIZE];
+    char what[64];
+    file_info *dir = (file_info *)buf;
+    int i, used = 0;
+
+    if (fsckRead(st, st->sb.dir_index, 1, buf) == -1)
+    {
+        fsckProblem(st, NULL, "cannot read the directory");
+        return;
+    }
+    fsckSummary(st, dir); // before the names are cut short below
+    for (i = 0; i < MAX_FILE; i++)
+    {
+        if (dir[i].used == False)
+        {
+            continue;
+        }
+        used++;
+        dir[i].name[MAX_FILENAME_LEN - 1] = '\0';
+        snprintf(what, sizeof(what), "file %d (%s)", i, dir[i].name);
+        fsckFile(st, &dir[i], (char)(i + 1), what);
+    }
+    if (used != st->sb.dir_len)
+    {
+        fsckProblem(st, &st->report->count_mismatch, "directory holds %d files, dir_len says %d",
+                    used, st->sb.dir_len);
+    }
+    st->report->files = used;
+}
+
+static void fsckSnapshots(fsck_state *st)
+{
+    int buf[BLOCK_SIZE / sizeof(int)];
+    snapshot *snap = (snapshot *)buf;
+    char what[64];
+
+    for (int id = 0; id < SNAP_MAX; id++)
+    {
+        if (fsckRead(st, st->sb.snap_index + id, 1, buf) == -1)
+        {
+            fsckProblem(st, NULL, "cannot read snapshot %d", id);
+            continue;
+        }
+        if (!snap->used)
+        {
+            continue;
+        }
+        st->report->snapshots++;
+        for (int i = 0; i < MAX_FILE; i++)
+        {
+            if (snap->dir[i].used)
+            {
+                snap->dir[i].name[MAX_FILENAME_LEN - 1] = '\0';
+                snprintf(what, sizeof(what), "snapshot %d file %d (%s)", id, i, snap->dir[i].name);
+                fsckFile(st, &snap->dir[i], MAP_SNAP, what);
+            }
+        }
+    }
+}
+
+static void *fsckScan(void *arg)
+{
+    fsck_worker *w = arg;
+    fsck_state *st = w->st;
+    char *buf = malloc((size_t)FSCK_CHUNK * BLOCK_SIZE);
+
+    for (int b = w->first; b < w->last && buf != NULL; b += FSCK_CHUNK)
+    {
+        int n = (w->last - b < FSCK_CHUNK) ? w->last - b : FSCK_CHUNK;
+        if (fsckRead(st, b, n, buf) == -1)
+        {
+            fsckProblem(st, NULL, "cannot read blocks %d-%d", b, b + n - 1);
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            int block = b + i;
+            char tag = st->map[block];
+            char want = st->want[block];
+
+            if (want != 0)
+            {
+                w->used++;
+            }
+            if (tag != want && want == 0)
+            {
+                fsckProblem(st, &st->report->orphans, "block %d is tagged %d but nothing owns it", block, tag);
+            }
+            else if (tag != want)
+            {
+                fsckProblem(st, &st->report->lost, "block %d is owned with tag %d but the map has %d",
+                            block, want, tag);
+            }
+            if (st->refs[block] != st->uses[block])
+            {
+                fsckProblem(st, &st->report->ref_mismatch, "block %d has %d references, its count says %d",
+                            block, st->uses[block], st->refs[block]);
+            }
+            if (st->crcs[block] == 0 || (tag == 0 && want == 0))
+            {
+                continue; // a free block holds nothing to verify
+            }
+            unsigned int sum = crc32c(0, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+            if (sum != st->crcs[block] && !fsckOrdered(st, block, sum) && !fsckLoggedMeta(st, block))
+            {
+                fsckProblem(st, &st->report->bad_checksums, "block %d fails its checksum", block);
+            }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+int fsck_image(char *name, int workers, int verbose, fsck_report *report)
+{
+    pthread_t threads[FSCK_MAX_WORKERS];
+    int started[FSCK_MAX_WORKERS];
+    fsck_worker work[FSCK_MAX_WORKERS];
+    struct stat info;
+    geometry old = disk_geometry;
+    char head[BLOCK_SIZE_MIN];
+    super_block *sb = (super_block *)head;
+    int i;
+
+    memset(report, 0, sizeof(fsck_report));
+    fsck_state *st = calloc(1, sizeof(fsck_state));
+    if (st == NULL)
+    {
+        return -1;
+    }
+
+    /* the image is read at the geometry its super block records */
+    st->fd = open(name, O_RDONLY);
+    if (st->fd < 0 || pread(st->fd, head, sizeof(head), 0) != (ssize_t)sizeof(head) ||
+        disk_set_geometry(sb->block_size, sb->blocks) == -1 || fstat(st->fd, &info) == -1 ||
+        info.st_size < (off_t)DISK_BLOCKS * BLOCK_SIZE)
+    {
+        if (st->fd >= 0)
+            close(st->fd);
+        free(st);
+        disk_set_geometry(old.block_size, old.blocks);
+        return -1;
+    }
+    report->block_size = BLOCK_SIZE;
+    report->blocks = DISK_BLOCKS;
+    st->verbose = verbose;
+    st->report = report;
+    pthread_mutex_init(&st->lock, NULL);
+
+    if (fsckSuper(st) == 0)
+    {
+        fsckDirectory(st);
+        fsckSnapshots(st);
+
+        /* the block scan is split into one contiguous range per worker */
+        if (workers <= 0)
+        {
+            workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if (workers < 1)
+        {
+            workers = 1;
+        }
+        if (workers > FSCK_MAX_WORKERS)
+        {
+            workers = FSCK_MAX_WORKERS;
+        }
+        for (i = 0; i < workers; i++)
+        {
+            work[i].st = st;
+            work[i].first = (int)((long)DISK_BLOCKS * i / workers);
+            work[i].last = (int)((long)DISK_BLOCKS * (i + 1) / workers);
+            work[i].used = 0;
+            started[i] = (pthread_create(&threads[i], NULL, fsckScan, &work[i]) == 0);
+            if (!started[i])
+            {
+                fsckScan(&work[i]); // no thread to spare, scan it here
+            }
+        }
+        for (i = 0; i < workers; i++)
+        {
+            if (started[i])
+            {
+                pthread_join(threads[i], NULL);
+            }
+            report->blocks_used += work[i].used;
+        }
+    }
+
+    pthread_mutex_destroy(&st->lock);
+    close(st->fd);
+    free(st);
+    disk_set_geometry(old.block_size, old.blocks);
+    return report->errors ? 1 : 0;
+}
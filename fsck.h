@@ -0,0 +1,35 @@
+#ifndef _FSCK_H_
+#define _FSCK_H_
+
+/***************************************************************************/
+/* offline image verifier, independent of the file system code             */
+/***************************************************************************/
+#define FSCK_CHUNK 256      /* blocks per sequential read of a worker     */
+#define FSCK_MAX_WORKERS 64 /* threads the block scan is split across     */
+
+typedef struct
+{
+    int block_size;     /* geometry the super block records                */
+    int blocks;
+    int errors;         /* problems of any kind                            */
+    int files;          /* directory entries checked                       */
+    int snapshots;      /* snapshots checked                               */
+    int blocks_used;    /* blocks some structure owns                      */
+    int count_mismatch; /* num_blocks differs from the blocks found        */
+    int double_owned;   /* blocks claimed by two structures                */
+    int orphans;        /* blocks tagged in the map that nothing owns      */
+    int lost;           /* owned blocks the map has as free or mistagged   */
+    int ref_mismatch;   /* reference counts that differ from the indexes   */
+    int bad_checksums;  /* blocks whose data fails their CRC32C            */
+    int journal_pending; /* committed transactions the next mount replays  */
+    int bad_summary;    /* stored summaries that disagree with the map or
+                           the directory                                   */
+} fsck_report;
+
+int fsck_image(char *name, int workers, int verbose, fsck_report *report);
+/* 0 if the image is consistent, 1 if problems were found, -1 if it cannot
+   be read; problems are printed when verbose is set. The blocks are checked
+   as the next mount finds them, with the journal_pending transactions     */
+/***************************************************************************/
+
+#endif
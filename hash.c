@@ -0,0 +1,95 @@
+#include <string.h>
+
+#include "hash.h"
+
+/***************************************************************************/
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+#define PRIME5 2870177450012600261ULL
+/***************************************************************************/
+
+static unsigned long long rotl(unsigned long long v, int r)
+{
+    return (v << r) | (v >> (64 - r));
+}
+
+static unsigned long long load64(const unsigned char *p)
+{
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned long long round64(unsigned long long acc, unsigned long long input)
+{
+    acc += input * PRIME2;
+    return rotl(acc, 31) * PRIME1;
+}
+
+static unsigned long long merge64(unsigned long long acc, unsigned long long val)
+{
+    acc ^= round64(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+unsigned long long hash64(const char *buf, int len, unsigned long long seed)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    const unsigned char *end = p + len;
+    unsigned long long h;
+
+    if (len >= 32)
+    {
+        /* the four lanes do not depend on each other, so the compiler can
+           keep them in one vector register */
+        unsigned long long v[4] = {seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1};
+        int lane;
+
+        for (; p + 32 <= end; p += 32)
+        {
+            for (lane = 0; lane < 4; lane++)
+            {
+                v[lane] = round64(v[lane], load64(p + lane * 8));
+            }
+        }
+
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        for (lane = 0; lane < 4; lane++)
+        {
+            h = merge64(h, v[lane]);
+        }
+    }
+    else
+    {
+        h = seed + PRIME5;
+    }
+    h += (unsigned long long)len;
+
+    for (; p + 8 <= end; p += 8)
+    {
+        h ^= round64(0, load64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end)
+    {
+        unsigned int w;
+        memcpy(&w, p, sizeof(w));
+        h ^= (unsigned long long)w * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h ^= (*p) * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,10 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+/***************************************************************************/
+/* 64 bit block fingerprint (xxHash64), four independent lanes per stripe  */
+/***************************************************************************/
+unsigned long long hash64(const char *buf, int len, unsigned long long seed);
+/***************************************************************************/
+
+#endif
@@ -0,0 +1,631 @@
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32c.h"
+#include "journal.h"
+#include "stats.h"
+#include "summary.h"
+
+/***************************************************************************/
+/* Operations change the metadata in memory; the allocation map lives in   */
+/* MAP while the file system is mounted. A commit compares each metadata   */
+/* block with the image the log last got and writes the ones that changed, */
+/* with a descriptor that carries their home blocks and checksums, in one  */
+/* run at the head of the log, then flushes the disk once. An operation    */
+/* joins the running group; the group commits when it holds JOURNAL_GROUP  */
+/* operations or its first one is JOURNAL_WINDOW_NS old, and a timer       */
+/* thread commits it when no operation comes by then. A checkpoint         */
+/* writes the committed images that changed since the last one home, and a */
+/* super block whose journal_seq skips past the log, so mount replays only */
+/* what came after it. fs_sync and fs_fsync commit the group early, or     */
+/* only flush when no metadata changed, and skip both when nothing did.    */
+/* An index, cluster, snapshot or fingerprint block that the committed map */
+/* already owns is not rewritten in place either: it is held in memory,    */
+/* goes into the next commit with its checksum, and home after it, so a    */
+/* crash finds it in step with the map and the reference counts. A data    */
+/* block the committed map owns waits in memory the same way, but is not   */
+/* logged: the commit carries its new checksum and lists its old one, and  */
+/* it goes home after. A crash leaves it matching one of the two. Before a */
+/* commit the disk is flushed, so the data its checksums cover is down.    */
+/***************************************************************************/
+
+unsigned char MAP[MAP_BYTES_MAX];
+
+static boolean active;
+static int head;                /* next free block of the log            */
+static unsigned int seq;        /* sequence number of the next commit    */
+static int ops;                 /* operations in the running group       */
+static unsigned long long opened; /* clock at the first of them          */
+static char last[JOURNAL_LOGGED_MAX * BLOCK_SIZE_MAX]; /* committed images */
+static boolean stale[JOURNAL_LOGGED_MAX]; /* committed, not home yet      */
+static boolean unsynced[MAX_FILE];  /* files changed since the last flush */
+static boolean unsynced_names;      /* the directory itself was changed   */
+static boolean unsynced_any;
+static char dir[BLOCK_SIZE_MAX];
+static char staged[(1 + JOURNAL_LOGGED_MAX) * BLOCK_SIZE_MAX];
+static int held_block[JOURNAL_HELD]; /* home of each held block           */
+static int nheld;
+static char held[JOURNAL_HELD * BLOCK_SIZE_MAX];
+static int ordered_block[JOURNAL_ORDERED_MAX]; /* home of each data block  */
+static unsigned int ordered_sum[JOURNAL_ORDERED_MAX]; /* read by replay    */
+static int nordered;
+static char ordered[JOURNAL_ORDERED_BYTES];
+static boolean unflushed;           /* data blocks went home after a commit */
+static journal_stats JSTATS;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_opened = PTHREAD_COND_INITIALIZER;
+static boolean timing;              /* the timer thread is running        */
+unsigned long long journal_window = JOURNAL_WINDOW_NS;
+
+#define META_DIR 0
+#define META_MAP 1
+#define META_REF (META_MAP + MAP_BLOCKS)
+#define META_CRC (META_REF + REF_BLOCKS)
+#define LAST(i) (last + (size_t)(i) * BLOCK_SIZE) /* image of metadata block i */
+#define HELD(k) (held + (size_t)(k) * BLOCK_SIZE)
+#define ORDERED(k) (ordered + (size_t)(k) * BLOCK_SIZE)
+
+/* home of metadata block i, in the order the log lists them */
+static int metaBlock(int i)
+{
+    if (i == META_DIR)
+        return SBP->dir_index;
+    if (i < META_REF)
+        return SBP->data_index + i - META_MAP;
+    if (i < META_CRC)
+        return SBP->ref_index + i - META_REF;
+    return SBP->crc_index + i - META_CRC;
+}
+
+static int metaSlot(int block)
+{
+    for (int i = 0; i < JOURNAL_MAX_LOGGED; i++)
+    {
+        if (metaBlock(i) == block)
+            return i;
+    }
+    return -1;
+}
+
+static int heldSlot(int block)
+{
+    for (int k = 0; k < nheld; k++)
+    {
+        if (held_block[k] == block)
+            return k;
+    }
+    return -1;
+}
+
+static int orderedSlot(int block)
+{
+    for (int k = 0; k < nordered; k++)
+    {
+        if (ordered_block[k] == block)
+            return k;
+    }
+    return -1;
+}
+
+/* the checksum of block in the committed table */
+static unsigned int committedSum(int block)
+{
+    const int per_block = BLOCK_SIZE / sizeof(unsigned int);
+    unsigned int sum;
+
+    memcpy(&sum, LAST(META_CRC + block / per_block) + block % per_block * sizeof(unsigned int), sizeof(sum));
+    return sum;
+}
+
+static void commitSum(int block, unsigned int sum)
+{
+    const int per_block = BLOCK_SIZE / sizeof(unsigned int);
+
+    CRCS[block] = sum;
+    memcpy(LAST(META_CRC + block / per_block) + block % per_block * sizeof(unsigned int), &sum, sizeof(sum));
+    stale[META_CRC + block / per_block] = True;
+}
+
+/* the current image of metadata block i */
+static char *metaImage(int i)
+{
+    if (i == META_DIR)
+    {
+        memset(dir, 0, BLOCK_SIZE);
+        memcpy(dir, dir_pointer, sizeof(file_info) * MAX_FILE);
+        return dir;
+    }
+    if (i < META_REF)
+        return (char *)MAP + (i - META_MAP) * BLOCK_SIZE;
+    if (i < META_CRC)
+        return (char *)REFS + (i - META_REF) * BLOCK_SIZE;
+    return (char *)CRCS + (i - META_CRC) * BLOCK_SIZE;
+}
+
+unsigned int journalDescSum(journal_desc *desc)
+{
+    journal_desc copy = *desc;
+    copy.sum = 0;
+    return crc32c(0, (char *)&copy, sizeof(journal_desc));
+}
+
+static boolean descOk(journal_desc *desc, unsigned int want, int pos)
+{
+    return desc->magic == JOURNAL_MAGIC && desc->seq == want && desc->count > 0 &&
+           desc->count <= JOURNAL_COMMIT_MAX && pos + 1 + desc->count <= JOURNAL_BLOCKS &&
+           desc->ordered >= 0 && desc->ordered <= JOURNAL_ORDERED && desc->sum == journalDescSum(desc);
+}
+
+static boolean mapBlock(int block)
+{
+    return block >= SBP->data_index && block < SBP->data_index + MAP_BLOCKS;
+}
+
+boolean journaled(int block)
+{
+    return active && (mapBlock(block) || (nheld > 0 && heldSlot(block) != -1) ||
+                      (nordered > 0 && orderedSlot(block) != -1));
+}
+
+void journalRead(int block, char *buf)
+{
+    if (mapBlock(block))
+        memcpy(buf, MAP + (block - SBP->data_index) * BLOCK_SIZE, BLOCK_SIZE);
+    else if (heldSlot(block) != -1)
+        memcpy(buf, HELD(heldSlot(block)), BLOCK_SIZE);
+    else
+        memcpy(buf, ORDERED(orderedSlot(block)), BLOCK_SIZE);
+}
+
+void journalWrite(int block, char *buf)
+{
+    if (!mapBlock(block))
+    {
+        if (heldSlot(block) != -1)
+            journalHold(block, buf);
+        else
+            journalOrder(block, buf);
+        return;
+    }
+    int first = (block - SBP->data_index) * BLOCK_SIZE;
+    summaryMap(first, (unsigned char *)buf, BLOCK_SIZE);
+    memcpy(MAP + first, buf, BLOCK_SIZE);
+}
+
+int journalHold(int block, char *buf)
+{
+    int k;
+
+    if (!active)
+        return 0;
+    if ((k = orderedSlot(block)) != -1)
+    {
+        /* a data block until now, the log carries it from here */
+        ordered_block[k] = ordered_block[--nordered];
+        memcpy(ORDERED(k), ORDERED(nordered), BLOCK_SIZE);
+    }
+    if ((k = heldSlot(block)) == -1)
+    {
+        if (LAST(META_MAP)[block] == 0)
+            return 0; // a crash leaves it free, whatever it holds
+        if (nheld == JOURNAL_HELD && journalCommit() == -1)
+            return -1; // a commit in the middle of an operation makes room
+        k = nheld++;
+        held_block[k] = block;
+    }
+    memcpy(HELD(k), buf, BLOCK_SIZE);
+    CRCS[block] = crc_enabled ? crc32c(0, buf, BLOCK_SIZE) : 0;
+    return 1;
+}
+
+int journalOrder(int block, char *buf)
+{
+    int k;
+
+    if (!active || !crc_enabled)
+        return 0; // without a checksum any order will do
+    if ((k = orderedSlot(block)) == -1)
+    {
+        if (LAST(META_MAP)[block] == 0)
+            return 0; // a crash leaves it free, whatever it holds
+        if (nordered == JOURNAL_ORDERED && journalCommit() == -1)
+            return -1;
+        k = nordered++;
+        ordered_block[k] = block;
+    }
+    memcpy(ORDERED(k), buf, BLOCK_SIZE);
+    CRCS[block] = crc32c(0, buf, BLOCK_SIZE);
+    return 1;
+}
+
+/* the held blocks are in the log and the checksums of the data blocks are
+   committed, they can go home */
+static int release(void)
+{
+    int rtn = 0;
+
+    disk_plug();
+    for (int k = 0; k < nheld && rtn == 0; k++)
+        rtn = block_write(held_block[k], HELD(k));
+    for (int k = 0; k < nordered && rtn == 0; k++)
+        rtn = block_write(ordered_block[k], ORDERED(k));
+    if (disk_unplug() == -1 || rtn == -1)
+        return -1;
+    JSTATS.blocks_home += nheld + nordered;
+    unflushed = unflushed || nordered > 0;
+    nheld = nordered = 0;
+    return 0;
+}
+
+int journalValid(int copy)
+{
+    char buf[BLOCK_SIZE];
+
+    if (blocks_read_copy(copy, SBP->journal_index, 1, buf) == -1)
+        return 0;
+    return descOk((journal_desc *)buf, SBP->journal_seq, 0);
+}
+
+/* the stale slots of [from, to) go home, adjacent blocks in one write */
+static int writeHome(int from, int to)
+{
+    for (int i = from; i < to; i++)
+    {
+        if (!stale[i])
+            continue;
+        int n = 1;
+        while (i + n < to && stale[i + n] && metaBlock(i + n) == metaBlock(i) + n)
+            n++;
+        if (blocks_write(metaBlock(i), n, LAST(i)) == -1)
+            return -1;
+        for (int k = 0; k < n; k++)
+            stale[i + k] = False;
+        JSTATS.blocks_home += n;
+        i += n - 1;
+    }
+    return 0;
+}
+
+/* the map and directory in memory are the ones going home, so the
+   summaries of them can go with the super block */
+static boolean current(void)
+{
+    return active && memcmp(MAP, LAST(META_MAP), MAP_BLOCKS * BLOCK_SIZE) == 0 &&
+           memcmp(metaImage(META_DIR), LAST(META_DIR), BLOCK_SIZE) == 0;
+}
+
+/* the committed images in last[] that changed go home, then the super
+   block lets go of the log */
+static int checkIn(void)
+{
+    /* the checksums of the blocks going home change with them */
+    for (int i = 0; i < META_CRC; i++)
+    {
+        if (stale[i])
+            commitSum(metaBlock(i), crc_enabled ? crc32c(0, LAST(i), BLOCK_SIZE) : 0);
+    }
+    disk_plug(); // the checksum blocks and the rest go down in one sorted pass
+    int rtn = writeHome(0, META_CRC) == -1 || writeHome(META_CRC, JOURNAL_MAX_LOGGED) == -1 ? -1 : 0;
+    if (disk_unplug() == -1 || rtn == -1)
+        return -1;
+
+    SBP->crc_sum = 0;
+    for (int i = META_CRC; i < JOURNAL_MAX_LOGGED; i++)
+        SBP->crc_sum = crc32c(SBP->crc_sum, LAST(i), BLOCK_SIZE);
+    if (disk_flush() == -1)
+        return -1; // home before the super block that lets go of the log
+    unflushed = False;
+
+    char buf[BLOCK_SIZE];
+    SBP->journal_seq = seq;
+    SBP->sb_sum = superSum(SBP);
+    memset(buf, 0, BLOCK_SIZE);
+    memcpy(buf, SBP, sizeof(super_block));
+    summaryStore(buf, seq, current());
+    if (block_write(0, buf) == -1 || disk_flush() == -1)
+        return -1;
+
+    head = 0;
+    JSTATS.checkpoints++;
+    return 0;
+}
+
+int journalReplay(void)
+{
+    char buf[BLOCK_SIZE];
+    journal_desc *desc = (journal_desc *)buf;
+    int pos = 0, n = 0, after = 0;
+
+    memset(&JSTATS, 0, sizeof(JSTATS));
+    active = False; // a mount starts from the disk
+    memset(stale, 0, sizeof(stale));
+    nheld = nordered = 0;
+    seq = SBP->journal_seq;
+    while (pos < JOURNAL_BLOCKS && block_read(SBP->journal_index + pos, buf) == 0 && descOk(desc, seq, pos))
+    {
+        int count = desc->count, slots[JOURNAL_COMMIT_MAX];
+        if (blocks_read(SBP->journal_index + pos + 1, count, staged) == -1 ||
+            crc32c(0, staged, count * BLOCK_SIZE) != desc->data_sum)
+            break; // torn commit, it never happened
+        for (int k = 0; k < count; k++)
+        {
+            int block = desc->blocks[k];
+            if ((slots[k] = metaSlot(block)) == -1 &&
+                (block <= 0 || block >= DISK_BLOCKS ||
+                 (block >= SBP->journal_index && block < SBP->journal_index + JOURNAL_BLOCKS)))
+                return -1;
+        }
+        for (int k = 0; k < count; k++)
+        {
+            if (slots[k] == -1)
+            {
+                /* a held block, its checksum is in the same transaction */
+                if (block_write(desc->blocks[k], staged + k * BLOCK_SIZE) == -1)
+                    return -1;
+                continue;
+            }
+            memcpy(LAST(slots[k]), staged + k * BLOCK_SIZE, BLOCK_SIZE);
+            stale[slots[k]] = True;
+        }
+
+        /* the data blocks of a commit are flushed before the next one */
+        after = desc->ordered;
+        memcpy(ordered_block, desc->ordered_block, after * sizeof(int));
+        memcpy(ordered_sum, desc->ordered_sum, after * sizeof(unsigned int));
+        pos += 1 + count;
+        seq++;
+        n++;
+    }
+    if (n == 0)
+        return 0;
+
+    /* the super block counts the files, it is only written at checkpoints */
+    if (stale[META_DIR])
+    {
+        file_info *files = (file_info *)LAST(META_DIR);
+        SBP->dir_len = 0;
+        for (int i = 0; i < MAX_FILE; i++)
+            SBP->dir_len += files[i].used == True;
+    }
+
+    /* the checksum images not in the log are the ones on disk */
+    for (int i = META_CRC; i < JOURNAL_MAX_LOGGED; i++)
+    {
+        if (stale[i])
+            memcpy((char *)CRCS + (i - META_CRC) * BLOCK_SIZE, LAST(i), BLOCK_SIZE);
+        else
+            memcpy(LAST(i), (char *)CRCS + (i - META_CRC) * BLOCK_SIZE, BLOCK_SIZE);
+    }
+
+    /* the data blocks of the last commit may not have reached home: one
+       that still holds what it held before takes its old checksum back,
+       one that matches neither is damaged and fails when it is read */
+    for (int k = 0; k < after; k++)
+    {
+        int block = ordered_block[k];
+        if (block <= 0 || block >= DISK_BLOCKS || block_read(block, buf) == -1)
+            continue;
+        unsigned int sum = crc32c(0, buf, BLOCK_SIZE);
+        if (sum != CRCS[block] && (ordered_sum[k] == 0 || sum == ordered_sum[k]))
+            commitSum(block, ordered_sum[k]);
+    }
+    if (checkIn() == -1)
+        return -1;
+    JSTATS.replayed = n;
+    return n;
+}
+
+/* commits a group whose window closed while no call came, waiting with
+   journal_lock released in between                                        */
+static void *journalTimer(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&journal_lock);
+    for (;;)
+    {
+        if (!active || ops == 0)
+        {
+            pthread_cond_wait(&journal_opened, &journal_lock);
+            continue;
+        }
+        unsigned long long now = statClock(), due = opened + journal_window;
+        if (now >= due)
+        {
+            int commits = JSTATS.commits;
+            journalCommit();
+            JSTATS.timed += JSTATS.commits - commits;
+            continue;
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (long)(due - now);
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&journal_opened, &journal_lock, &ts);
+    }
+    return NULL;
+}
+
+void journalLock(void)
+{
+    pthread_mutex_lock(&journal_lock);
+}
+
+void journalUnlock(void)
+{
+    pthread_mutex_unlock(&journal_lock);
+}
+
+void journalStart(void)
+{
+    for (int i = 0; i < JOURNAL_MAX_LOGGED; i++)
+        memcpy(LAST(i), metaImage(i), BLOCK_SIZE);
+    memset(stale, 0, sizeof(stale));
+    nheld = nordered = 0;
+    unflushed = False;
+    memset(unsynced, 0, sizeof(unsynced));
+    unsynced_names = unsynced_any = False;
+    head = 0;
+    seq = SBP->journal_seq;
+    ops = 0;
+    active = True;
+
+    pthread_t timer;
+    if (!timing && pthread_create(&timer, NULL, journalTimer, NULL) == 0)
+    {
+        pthread_detach(timer);
+        timing = True; // without it the next operation commits the group
+    }
+}
+
+void journalStop(void)
+{
+    active = False;
+}
+
+int journalOp(int file)
+{
+    if (!active)
+        return 0;
+
+    if (file >= 0 && file < MAX_FILE)
+        unsynced[file] = True;
+    else
+        unsynced_names = True;
+    unsynced_any = True;
+
+    JSTATS.operations++;
+    if (ops++ == 0)
+    {
+        opened = statClock();
+        pthread_cond_signal(&journal_opened);
+    }
+    if (ops >= JOURNAL_GROUP || statClock() - opened >= journal_window)
+        return journalCommit();
+    return 0;
+}
+
+/* a flush covered every write made before it */
+static void synced(void)
+{
+    memset(unsynced, 0, sizeof(unsynced));
+    unsynced_names = unsynced_any = False;
+}
+
+int journalSync(int file)
+{
+    if (!active)
+        return -1;
+    if (!unsynced_any || (file >= 0 && !unsynced[file] && !unsynced_names))
+        return 0;
+
+    int commits = JSTATS.commits;
+    if (journalCommit() == -1)
+        return -1;
+    if ((JSTATS.commits == commits || unflushed) && disk_flush() == -1)
+        return -1; // only data changed, or it went home after the commit
+    unflushed = False;
+    synced();
+    JSTATS.syncs++;
+    return 0;
+}
+
+/* stage the blocks that differ from their committed image, the count */
+static int stage(journal_desc *desc)
+{
+    int n = 0;
+
+    memset(staged, 0, BLOCK_SIZE);
+    for (int i = 0; i < JOURNAL_MAX_LOGGED; i++)
+    {
+        char *image = metaImage(i);
+        if (memcmp(image, LAST(i), BLOCK_SIZE) != 0)
+        {
+            memcpy(staged + (1 + n) * BLOCK_SIZE, image, BLOCK_SIZE);
+            desc->blocks[n++] = metaBlock(i);
+        }
+    }
+    for (int k = 0; k < nheld; k++)
+    {
+        memcpy(staged + (1 + n) * BLOCK_SIZE, HELD(k), BLOCK_SIZE);
+        desc->blocks[n++] = held_block[k];
+    }
+    desc->ordered = nordered;
+    for (int k = 0; k < nordered; k++)
+    {
+        desc->ordered_block[k] = ordered_block[k];
+        desc->ordered_sum[k] = committedSum(ordered_block[k]);
+    }
+    return n;
+}
+
+int journalCommit(void)
+{
+    journal_desc *desc = (journal_desc *)staged;
+    int n;
+
+    if (!active)
+        return 0;
+    ops = 0;
+    if ((n = stage(desc)) == 0)
+        return release(); // data rewritten as it was, its checksums hold
+
+    /* no room: what is committed goes home and the log starts over, which
+       changes the checksums of the blocks that went home */
+    if (head + 1 + n > JOURNAL_BLOCKS)
+    {
+        if (checkIn() == -1)
+            return -1;
+        n = stage(desc);
+    }
+
+    unsigned long long t = statStart();
+    desc->magic = JOURNAL_MAGIC;
+    desc->seq = seq;
+    desc->count = n;
+    desc->data_sum = crc32c(0, staged + BLOCK_SIZE, n * BLOCK_SIZE);
+    desc->sum = journalDescSum(desc);
+    int rtn = -1;
+    if (disk_flush() == 0 && blocks_write(SBP->journal_index + head, 1 + n, staged) == 0 && disk_flush() == 0)
+    {
+        unflushed = False;
+        for (int k = 0; k < n; k++)
+        {
+            int slot = metaSlot(desc->blocks[k]);
+            if (slot == -1)
+                continue; // held, it goes home below
+            memcpy(LAST(slot), staged + (1 + k) * BLOCK_SIZE, BLOCK_SIZE);
+            stale[slot] = True;
+        }
+        if (nordered == 0)
+            synced(); // the data blocks going home below still need a flush
+        head += 1 + n;
+        seq++;
+        JSTATS.commits++;
+        JSTATS.blocks_logged += n;
+        rtn = release();
+    }
+    statEnd(OP_JOURNAL_COMMIT, t, rtn, (long long)(1 + n) * BLOCK_SIZE);
+    return rtn;
+}
+
+int journalCheckpoint(void)
+{
+    if (!active)
+        return 0;
+    if (journalCommit() == -1)
+        return -1;
+    return checkIn();
+}
+
+int fs_journal_stats(journal_stats *stats)
+{
+    if (stats == NULL)
+        return -1;
+    pthread_mutex_lock(&journal_lock);
+    *stats = JSTATS;
+    pthread_mutex_unlock(&journal_lock);
+    return 0;
+}
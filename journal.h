@@ -0,0 +1,77 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "sfs.h"
+
+/***************************************************************************/
+/* write-ahead log of the metadata blocks: directory, allocation map,      */
+/* reference counts and checksum table, and of the index, cluster,         */
+/* snapshot and fingerprint blocks that are rewritten in place             */
+/***************************************************************************/
+#define JOURNAL_MAGIC 0x4c4e524a   /* "JRNL" */
+#define JOURNAL_GROUP 32           /* operations that share one commit      */
+#define JOURNAL_WINDOW_NS 10000000 /* or the age of the oldest of them      */
+#define JOURNAL_MAX_LOGGED (MAP_BLOCKS + 1 + REF_BLOCKS + CRC_BLOCKS)
+#define JOURNAL_HELD (FP_BLOCKS + 2 * MAP_INDEX_BLOCKS) /* other blocks a commit carries */
+#define JOURNAL_COMMIT_MAX (JOURNAL_MAX_LOGGED + JOURNAL_HELD)
+#define JOURNAL_LOGGED_MAX (JOURNAL_BLOCKS - 1) /* make_fs keeps JOURNAL_COMMIT_MAX below */
+#define JOURNAL_ORDERED_BYTES (1 << 20) /* data blocks waiting for a commit */
+#define JOURNAL_ORDERED (JOURNAL_ORDERED_BYTES / BLOCK_SIZE)
+#define JOURNAL_ORDERED_MAX (JOURNAL_ORDERED_BYTES / DEFAULT_BLOCK_SIZE) /* make_fs keeps JOURNAL_ORDERED below */
+
+/* first block of a transaction, its images follow it in the log */
+typedef struct
+{
+    unsigned int magic;
+    unsigned int seq;      /* super block journal_seq for the first one   */
+    int count;             /* images after this block                      */
+    unsigned int data_sum; /* checksum of the images                       */
+    int blocks[JOURNAL_LOGGED_MAX]; /* home block of each image            */
+    int ordered;           /* data blocks that go home after the commit    */
+    int ordered_block[JOURNAL_ORDERED_MAX];
+    unsigned int ordered_sum[JOURNAL_ORDERED_MAX]; /* their checksums before it */
+    unsigned int sum;      /* checksum of this struct, taken with sum = 0  */
+} journal_desc;
+
+extern unsigned char MAP[MAP_BYTES_MAX];
+extern unsigned long long journal_window; /* JOURNAL_WINDOW_NS, tests stretch it */
+
+boolean journaled(int block);
+/* block is held in memory and reaches its home only after a commit       */
+void journalRead(int block, char *buf);
+void journalWrite(int block, char *buf);
+int journalHold(int block, char *buf);
+/* 1 if block is in the committed map and is kept until the next commit
+   logs it, 0 if nothing committed points at it and it can go home now,
+   -1 if the commit that made room failed                                  */
+int journalOrder(int block, char *buf);
+/* the same for a data block, which the commit does not log: it goes home
+   after the commit that carries its new checksum and lists its old one   */
+
+int journalValid(int copy);
+/* the log of copy starts with a transaction of the mounted super block   */
+int journalReplay(void);
+/* apply the committed transactions and check them in, the number applied */
+void journalStart(void);
+/* start logging, once the metadata is in memory                          */
+void journalStop(void);
+
+void journalLock(void);
+void journalUnlock(void);
+/* held by every public call, so the window timer commits between them    */
+
+int journalOp(int file);
+/* an operation changed file (-1 for the directory as a whole): commit once
+   the group is full or old; a group left alone is committed by a timer
+   thread when its window closes                                           */
+int journalSync(int file);
+/* make what changed durable, unless nothing did for file (-1 for all)    */
+int journalCommit(void);
+/* log the changed blocks as one transaction, behind one disk_flush       */
+int journalCheckpoint(void);
+/* write the changed metadata blocks home, then the super block, and empty
+   the log                                                                 */
+unsigned int journalDescSum(journal_desc *desc);
+/***************************************************************************/
+
+#endif
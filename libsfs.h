@@ -0,0 +1,129 @@
+#ifndef _LIBSFS_H_
+#define _LIBSFS_H_
+
+/***************************************************************************/
+/* public interface of libsfs: the fs_* calls and the structs they fill;   */
+/* sfs.h adds the on-disk layout and the helpers behind them               */
+/***************************************************************************/
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "disk.h"
+#include "slowdisk.h"
+#include "stripedisk.h"
+#include "mirrordisk.h"
+#include "writeback.h"
+#include "stats.h"
+#include "trace.h"
+#include "fsck.h"
+
+#define MAX_FILENAME_LEN 15
+#define MAX_FILE_DESCRIPTOR 32
+#define MAX_FILE 64
+
+typedef enum
+{
+    False,
+    True
+} boolean;
+
+/* tail packing statistics */
+typedef struct
+{
+    int packed_files; /* files stored entirely in tail fragments */
+    int tail_blocks;  /* shared blocks holding those fragments */
+    int frags_used;   /* fragment slots in use */
+    int blocks_saved; /* whole blocks a block-per-file layout would need on top */
+    int bytes_saved;  /* blocks_saved in bytes */
+} pack_stats;
+
+/* dedup statistics */
+typedef struct
+{
+    int shared_blocks;  /* MAP_SHARED blocks in use */
+    int references;     /* logical blocks pointing at them */
+    int blocks_saved;   /* references - shared_blocks */
+    int dedup_hits;     /* writes that found an identical block */
+    int filter_skips;   /* lookups the bloom filter answered alone */
+    int index_lookups;  /* lookups that read a fingerprint bucket */
+} dedup_stats;
+
+/* layout statistics of the files the defragmenter handles (chain and mapped) */
+typedef struct
+{
+    int files;            /* files holding data blocks */
+    int fragmented_files; /* files in more than one extent */
+    int blocks;           /* data blocks of those files */
+    int extents;          /* runs of consecutive blocks in file order */
+    int free_extents;     /* runs of free blocks */
+    int largest_free;     /* longest run of free blocks */
+} frag_stats;
+
+/* metadata journal statistics */
+typedef struct
+{
+    int operations;    /* metadata operations since mount */
+    int commits;       /* transactions written, one flush each */
+    int blocks_logged; /* metadata block images in them */
+    int checkpoints;   /* times the metadata went home and the log emptied */
+    int blocks_home;   /* metadata blocks the checkpoints wrote */
+    int syncs;         /* fs_sync and fs_fsync calls that had to flush */
+    int replayed;      /* transactions the mount applied */
+    int timed;         /* commits of a group whose window closed while idle */
+} journal_stats;
+
+/* space and file counts, kept up to date as blocks are allocated and freed */
+typedef struct
+{
+    int block_size;
+    int total_blocks;
+    int used_blocks;  /* metadata, file, shared and snapshot blocks */
+    int free_blocks;
+    int largest_free; /* longest run of free blocks */
+    int files;        /* names in the directory */
+    int free_files;   /* directory slots left */
+} statfs_info;
+
+int make_fs(char *name); /* DEFAULT_BLOCK_SIZE x DEFAULT_DISK_BLOCKS */
+int make_fs_geometry(char *name, int block_size, int blocks);
+/* an image of blocks blocks of block_size bytes, which its super block
+   records for mount_fs; -1 unless the directory, a snapshot and the
+   summaries each fit in one block (4 KB and up) and the metadata of the
+   layout fits the journal and leaves data blocks                         */
+int mount_fs(char *name);
+int umount_fs(char *name);
+
+int fs_open(char *name);
+int fs_close(int fd);
+
+int fs_create(char *name);
+int fs_delete(char *name);
+
+int fs_read(int fd, void *buf, size_t nbyte);
+int fs_write(int fd, void *buf, size_t nbyte);
+
+int fs_get_filesize(int fd);
+int fs_lseek(int fd, off_t offset);
+int fs_truncate(int fd, off_t length);
+
+int fs_pack_stats(pack_stats *stats);
+int fs_set_compression(int fd, boolean on);
+int fs_set_dedup(int fd, boolean on);
+int fs_dedup_stats(dedup_stats *stats);
+int fs_checksum_errors(void);
+int fs_checksum_repairs(void);
+int fs_journal_stats(journal_stats *stats);
+int fs_sync(void);
+int fs_fsync(int fd);
+
+int fs_clone(char *src, char *dst);
+int fs_snapshot(void);
+int fs_rollback(int id);
+int fs_snapshot_delete(int id);
+int fs_copy_range(int src_fd, off_t src_off, int dst_fd, off_t dst_off, size_t len);
+int fs_frag_stats(frag_stats *stats);
+int fs_statfs(statfs_info *stats);
+int fs_defrag(int budget);
+/***************************************************************************/
+
+#endif
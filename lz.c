@@ -0,0 +1,166 @@
+#include <string.h>
+
+#include "lz.h"
+
+/***************************************************************************/
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 /* the block always ends with literals         */
+#define LZ_MATCH_LIMIT 12  /* no match may start in the last 12 bytes     */
+#define LZ_MAX_OFFSET 65535
+/***************************************************************************/
+
+static unsigned int read32(const unsigned char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int hash32(unsigned int v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* write a length continuation: runs of 255 closed by a smaller byte */
+static int putLength(unsigned char *dst, int op, int dstcap, int len)
+{
+    while (len >= 255)
+    {
+        if (op >= dstcap)
+            return -1;
+        dst[op++] = 255;
+        len -= 255;
+    }
+    if (op >= dstcap)
+        return -1;
+    dst[op++] = (unsigned char)len;
+    return op;
+}
+
+static int putSequence(unsigned char *dst, int op, int dstcap,
+                       const unsigned char *lit, int litlen, int offset, int mlen)
+{
+    int token = op++;
+    if (token >= dstcap)
+        return -1;
+
+    dst[token] = (unsigned char)((litlen < 15 ? litlen : 15) << 4);
+    if (litlen >= 15 && (op = putLength(dst, op, dstcap, litlen - 15)) < 0)
+        return -1;
+    if (op + litlen > dstcap)
+        return -1;
+    memcpy(dst + op, lit, litlen);
+    op += litlen;
+
+    if (mlen == 0)
+        return op; // last sequence, literals only
+
+    if (op + 2 > dstcap)
+        return -1;
+    dst[op++] = (unsigned char)(offset & 0xff);
+    dst[op++] = (unsigned char)(offset >> 8);
+
+    mlen -= LZ_MIN_MATCH;
+    dst[token] |= (unsigned char)(mlen < 15 ? mlen : 15);
+    if (mlen >= 15 && (op = putLength(dst, op, dstcap, mlen - 15)) < 0)
+        return -1;
+    return op;
+}
+
+int lz_compress(const char *source, int srclen, char *dest, int dstcap)
+{
+    const unsigned char *src = (const unsigned char *)source;
+    unsigned char *dst = (unsigned char *)dest;
+    int table[1 << LZ_HASH_BITS];
+    int ip = 0, anchor = 0, op = 0;
+
+    if (srclen < 0 || dstcap <= 0)
+        return -1;
+
+    memset(table, -1, sizeof(table));
+    while (ip < srclen - LZ_MATCH_LIMIT)
+    {
+        unsigned int seq = read32(src + ip);
+        unsigned int h = hash32(seq);
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(src + ref) != seq)
+        {
+            ip++;
+            continue;
+        }
+
+        int mlen = LZ_MIN_MATCH;
+        while (ip + mlen < srclen - LZ_LAST_LITERALS && src[ref + mlen] == src[ip + mlen])
+            mlen++;
+
+        op = putSequence(dst, op, dstcap, src + anchor, ip - anchor, ip - ref, mlen);
+        if (op < 0)
+            return -1;
+        ip += mlen;
+        anchor = ip;
+    }
+
+    return putSequence(dst, op, dstcap, src + anchor, srclen - anchor, 0, 0);
+}
+
+int lz_decompress(const char *source, int srclen, char *dest, int dstcap)
+{
+    const unsigned char *src = (const unsigned char *)source;
+    unsigned char *dst = (unsigned char *)dest;
+    int ip = 0, op = 0;
+
+    while (ip < srclen)
+    {
+        int token = src[ip++];
+        int len = token >> 4;
+        int b;
+
+        /* literals */
+        if (len == 15)
+        {
+            do
+            {
+                if (ip >= srclen)
+                    return -1;
+                b = src[ip++];
+                len += b;
+            } while (b == 255);
+        }
+        if (ip + len > srclen || op + len > dstcap)
+            return -1;
+        memcpy(dst + op, src + ip, len);
+        ip += len;
+        op += len;
+        if (ip == srclen)
+            break; // last sequence has no match
+
+        /* match, may overlap its own output */
+        if (ip + 2 > srclen)
+            return -1;
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op)
+            return -1;
+
+        len = (token & 15);
+        if (len == 15)
+        {
+            do
+            {
+                if (ip >= srclen)
+                    return -1;
+                b = src[ip++];
+                len += b;
+            } while (b == 255);
+        }
+        len += LZ_MIN_MATCH;
+        if (op + len > dstcap)
+            return -1;
+        for (b = 0; b < len; b++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
@@ -0,0 +1,15 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+
+/***************************************************************************/
+/* LZ4 block format codec, small enough to live next to the file system    */
+/***************************************************************************/
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16) /* worst case compressed size  */
+
+int lz_compress(const char *src, int srclen, char *dst, int dstcap);
+/* compress srclen bytes, -1 if the result does not fit into dstcap       */
+int lz_decompress(const char *src, int srclen, char *dst, int dstcap);
+/* expand a compressed block, -1 if it is malformed or exceeds dstcap     */
+/***************************************************************************/
+
+#endif
@@ -0,0 +1,479 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "mirrordisk.h"
+
+/***************************************************************************/
+/* Writes go to every copy: for long runs the calling thread writes the    */
+/* first one and a worker thread per copy the others at the same time.     */
+/* Reads come from one copy; with a unit, a run is split by unit and the   */
+/* copies read their parts at the same time. A copy that fails a transfer  */
+/* is dropped and its reads go to the next one; a copy whose data fails    */
+/* the checksum is left to sfs.c, which rereads the block from each copy   */
+/* (read_copy) and writes the good one back to all of them.                */
+/*                                                                         */
+/* Every copy ends in a label past the disk blocks with a generation. The  */
+/* flush after a copy is dropped raises it on the copies still in use, so  */
+/* the next open finds the dropped one behind and copies a current one     */
+/* over it before anything reads it.                                       */
+/***************************************************************************/
+
+typedef struct
+{
+    int fd;
+    pthread_t worker;
+    int state;   /* MIRROR_IDLE, MIRROR_POSTED or MIRROR_DONE            */
+    int write;   /* the posted job writes                                 */
+    int block;   /* first disk block of the posted run                    */
+    int count;
+    char *buf;
+    int rtn;
+    int reading; /* reads in flight                                       */
+    int failed;  /* a transfer failed, the copy is not used any more      */
+} mirror_member;
+
+typedef struct
+{
+    unsigned int magic;
+    unsigned int generation; /* raised each time a copy is dropped         */
+} mirror_label;
+
+#define MIRROR_MAGIC 0x5252494d /* "MIRR"                                  */
+#define MIRROR_CHUNK (1 << 20)  /* bytes a resync copies at a time          */
+
+#define MIRROR_IDLE 0
+#define MIRROR_POSTED 1
+#define MIRROR_DONE 2
+
+static mirror_member mirrors[MIRROR_MAX];
+static int ncopies, unit, stopping, failovers, resyncs;
+static int dropped;          /* a copy was dropped since the labels were written */
+static unsigned int generation;
+static off_t label_at;       /* where the label is: the bytes of disk blocks */
+static unsigned int turn; /* round robin between copies with equal queues */
+static pthread_mutex_t mirror_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mirror_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t mirror_done = PTHREAD_COND_INITIALIZER;
+
+/* split "[unit:]a,b" into copies, 0 if the name is usable */
+static int mirror_parse(char *name, char paths[MIRROR_MAX][256], int *n, int *u)
+{
+    char *colon = strchr(name, ':');
+    char *p = name;
+
+    *u = 0;
+    if (colon && colon > name && strspn(name, "0123456789") == (size_t)(colon - name))
+    {
+        if ((*u = atoi(name)) < 1)
+            return -1;
+        p = colon + 1;
+    }
+
+    for (*n = 0; *p; (*n)++)
+    {
+        size_t len = strcspn(p, ",");
+        if (*n == MIRROR_MAX || len == 0 || len >= 256)
+            return -1;
+        memcpy(paths[*n], p, len);
+        paths[*n][len] = '\0';
+        p += len + (p[len] == ',');
+    }
+    return *n > 0 ? 0 : -1;
+}
+
+/* stop using copy m, and have the next flush record it */
+static void mirror_drop(int m)
+{
+    mirrors[m].failed = 1;
+    __atomic_store_n(&dropped, 1, __ATOMIC_RELAXED);
+}
+
+/* copy to read block from: by unit, else the shortest queue */
+static int mirror_pick(int block)
+{
+    int best = -1;
+
+    if (unit)
+        return block / unit % ncopies;
+
+    unsigned int start = __atomic_fetch_add(&turn, 1, __ATOMIC_RELAXED);
+    for (int k = 0; k < ncopies; k++)
+    {
+        int m = (start + k) % ncopies;
+        if (!mirrors[m].failed &&
+            (best == -1 || __atomic_load_n(&mirrors[m].reading, __ATOMIC_RELAXED) < mirrors[best].reading))
+            best = m;
+    }
+    return best == -1 ? 0 : best;
+}
+
+/* read from copy m, or the copies after it once m has failed */
+static int mirror_pread(int m, int block, int count, char *buf)
+{
+    for (int k = 0; k < ncopies; k++)
+    {
+        mirror_member *c = &mirrors[(m + k) % ncopies];
+        if (c->failed)
+            continue;
+
+        __atomic_add_fetch(&c->reading, 1, __ATOMIC_RELAXED);
+        ssize_t done = pread(c->fd, buf, (size_t)count * BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+        __atomic_sub_fetch(&c->reading, 1, __ATOMIC_RELAXED);
+
+        if (done == (ssize_t)count * BLOCK_SIZE)
+        {
+            if (k > 0)
+                __atomic_add_fetch(&failovers, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        mirror_drop(c - mirrors);
+    }
+    return -1;
+}
+
+/* the share of copy m in a run: all of it for writes, its units for reads */
+static int mirror_io(int m, int write, int block, int count, char *buf)
+{
+    if (write)
+    {
+        if (pwrite(mirrors[m].fd, buf, (size_t)count * BLOCK_SIZE, (off_t)block * BLOCK_SIZE) <
+            (ssize_t)count * BLOCK_SIZE)
+        {
+            mirror_drop(m);
+            return -1;
+        }
+        return 0;
+    }
+
+    for (int b = block; b < block + count;)
+    {
+        int n = unit - b % unit;
+        if (n > block + count - b)
+            n = block + count - b;
+        if (b / unit % ncopies == m && mirror_pread(m, b, n, buf + (size_t)(b - block) * BLOCK_SIZE) == -1)
+            return -1;
+        b += n;
+    }
+    return 0;
+}
+
+static void *mirror_worker(void *arg)
+{
+    mirror_member *me = arg;
+    int m = me - mirrors;
+
+    pthread_mutex_lock(&mirror_lock);
+    for (;;)
+    {
+        while (me->state != MIRROR_POSTED && !stopping)
+            pthread_cond_wait(&mirror_work, &mirror_lock);
+        if (stopping)
+            break;
+        pthread_mutex_unlock(&mirror_lock);
+
+        int rtn = mirror_io(m, me->write, me->block, me->count, me->buf);
+
+        pthread_mutex_lock(&mirror_lock);
+        me->rtn = rtn;
+        me->state = MIRROR_DONE;
+        pthread_cond_broadcast(&mirror_done);
+    }
+    pthread_mutex_unlock(&mirror_lock);
+    return NULL;
+}
+
+/* hand the run to the copies in use, serving the first one here */
+static int mirror_fan(int write, int block, int count, char *buf)
+{
+    int used[MIRROR_MAX], n = 0, ok = 0, rtn = 0;
+    int units = write ? 0 : (block + count - 1) / unit - block / unit + 1;
+
+    for (int m = 0; m < ncopies; m++)
+    {
+        /* a read uses the copies that own one of its units */
+        if (write ? !mirrors[m].failed : (m - block / unit % ncopies + ncopies) % ncopies < units)
+            used[n++] = m;
+    }
+    if (n == 0)
+        return -1;
+
+    /* a short write costs less than waking the workers */
+    if (write && count < MIRROR_FAN)
+    {
+        for (int i = 0; i < n; i++)
+            ok += mirror_io(used[i], 1, block, count, buf) == 0;
+        return ok ? 0 : -1;
+    }
+
+    pthread_mutex_lock(&mirror_lock);
+    for (int i = 1; i < n; i++)
+    {
+        mirror_member *c = &mirrors[used[i]];
+        c->write = write;
+        c->block = block;
+        c->count = count;
+        c->buf = buf;
+        c->state = MIRROR_POSTED;
+    }
+    pthread_cond_broadcast(&mirror_work);
+    pthread_mutex_unlock(&mirror_lock);
+
+    if (mirror_io(used[0], write, block, count, buf) == 0)
+        ok++;
+    else
+        rtn = -1;
+
+    pthread_mutex_lock(&mirror_lock);
+    for (int i = 1; i < n; i++)
+    {
+        mirror_member *c = &mirrors[used[i]];
+        while (c->state != MIRROR_DONE)
+            pthread_cond_wait(&mirror_done, &mirror_lock);
+        c->state = MIRROR_IDLE;
+        if (c->rtn == 0)
+            ok++;
+        else
+            rtn = -1;
+    }
+    pthread_mutex_unlock(&mirror_lock);
+
+    /* a write holds while one copy took it, a read needs every part */
+    return write ? (ok ? 0 : -1) : rtn;
+}
+
+/* the generation of the copy on fd and where its label is, 0 if it has none */
+static unsigned int mirror_label_read(int fd, off_t *at)
+{
+    mirror_label label;
+    off_t end = lseek(fd, 0, SEEK_END);
+
+    *at = end;
+    if (end < (off_t)sizeof(label) ||
+        pread(fd, &label, sizeof(label), end - (off_t)sizeof(label)) != (ssize_t)sizeof(label) ||
+        label.magic != MIRROR_MAGIC)
+        return 0;
+    *at = end - (off_t)sizeof(label);
+    return label.generation;
+}
+
+static int mirror_label_write(int fd, off_t at, unsigned int gen)
+{
+    mirror_label label = {MIRROR_MAGIC, gen};
+
+    return pwrite(fd, &label, sizeof(label), at) == (ssize_t)sizeof(label) ? 0 : -1;
+}
+
+/* raise the generation of the copies in use after one was dropped */
+static void mirror_record(void)
+{
+    if (!__atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED))
+        return;
+
+    generation++;
+    for (int m = 0; m < ncopies; m++)
+    {
+        if (!mirrors[m].failed && mirror_label_write(mirrors[m].fd, label_at, generation) == -1)
+            mirror_drop(m);
+    }
+}
+
+/* copy the newest copy over those behind it, which were dropped before */
+static int mirror_resync(void)
+{
+    unsigned int gen[MIRROR_MAX] = {0};
+    off_t at[MIRROR_MAX] = {0};
+    int src = 0;
+    char *buf = NULL;
+
+    for (int m = 0; m < ncopies; m++)
+    {
+        gen[m] = mirror_label_read(mirrors[m].fd, &at[m]);
+        if (gen[m] > gen[src])
+            src = m;
+    }
+    generation = gen[src];
+    label_at = at[src];
+
+    for (int m = 0; m < ncopies; m++)
+    {
+        if (gen[m] == generation)
+            continue;
+        if (buf == NULL && (buf = malloc(MIRROR_CHUNK)) == NULL)
+            return -1;
+
+        for (off_t off = 0; off < label_at; off += MIRROR_CHUNK)
+        {
+            size_t len = label_at - off < MIRROR_CHUNK ? (size_t)(label_at - off) : MIRROR_CHUNK;
+            if (pread(mirrors[src].fd, buf, len, off) != (ssize_t)len)
+            {
+                free(buf);
+                return -1;
+            }
+            if (pwrite(mirrors[m].fd, buf, len, off) != (ssize_t)len)
+            {
+                mirrors[m].failed = 1; // still behind, the next open tries again
+                break;
+            }
+        }
+        if (mirrors[m].failed || fdatasync(mirrors[m].fd) == -1 ||
+            mirror_label_write(mirrors[m].fd, label_at, generation) == -1 || fdatasync(mirrors[m].fd) == -1)
+        {
+            mirrors[m].failed = 1;
+            continue;
+        }
+        resyncs++;
+    }
+    free(buf);
+    return 0;
+}
+
+static int mirror_make(char *name)
+{
+    char paths[MIRROR_MAX][256];
+    int n, u, f;
+
+    if (mirror_parse(name, paths, &n, &u) == -1)
+        return -1;
+
+    for (int m = 0; m < n; m++)
+    {
+        if (disk_make_image(paths[m], (long long)DISK_BLOCKS * BLOCK_SIZE + (long long)sizeof(mirror_label)) == -1 ||
+            (f = open(paths[m], O_WRONLY)) < 0)
+        {
+            perror("make_disk: cannot create mirror");
+            return -1;
+        }
+        int rtn = mirror_label_write(f, (off_t)DISK_BLOCKS * BLOCK_SIZE, 0);
+        if (close(f) == -1 || rtn == -1)
+        {
+            perror("make_disk: cannot label mirror");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int mirror_close(void);
+
+static int mirror_open(char *name)
+{
+    char paths[MIRROR_MAX][256];
+    int n, u;
+
+    if (mirror_parse(name, paths, &n, &u) == -1)
+        return -1;
+
+    ncopies = 0;
+    unit = u;
+    stopping = 0;
+    dropped = 0;
+    for (int m = 0; m < n; m++)
+    {
+        memset(&mirrors[m], 0, sizeof(mirror_member));
+        if ((mirrors[m].fd = open(paths[m], O_RDWR)) < 0)
+        {
+            perror("open_disk: cannot open mirror");
+            mirror_close();
+            return -1;
+        }
+        if (pthread_create(&mirrors[m].worker, NULL, mirror_worker, &mirrors[m]) != 0)
+        {
+            close(mirrors[m].fd);
+            mirror_close();
+            return -1;
+        }
+        ncopies++;
+    }
+    if (mirror_resync() == -1)
+    {
+        perror("open_disk: cannot resync mirror");
+        mirror_close();
+        return -1;
+    }
+    return 0;
+}
+
+static int mirror_readv(int block, int count, char *buf)
+{
+    if (unit == 0 || (block + count - 1) / unit == block / unit)
+        return mirror_pread(mirror_pick(block), block, count, buf);
+    return mirror_fan(0, block, count, buf);
+}
+
+static int mirror_writev(int block, int count, char *buf)
+{
+    return mirror_fan(1, block, count, buf);
+}
+
+static int mirror_read(int block, char *buf)
+{
+    return mirror_readv(block, 1, buf);
+}
+
+static int mirror_write(int block, char *buf)
+{
+    return mirror_fan(1, block, 1, buf);
+}
+
+static int mirror_flush(void)
+{
+    int rtn = 0;
+
+    mirror_record();
+    for (int m = 0; m < ncopies; m++)
+    {
+        if (!mirrors[m].failed && fdatasync(mirrors[m].fd) == -1)
+            rtn = -1;
+    }
+    return rtn;
+}
+
+static int mirror_close(void)
+{
+    pthread_mutex_lock(&mirror_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&mirror_work);
+    pthread_mutex_unlock(&mirror_lock);
+
+    mirror_record();
+    for (int m = 0; m < ncopies; m++)
+    {
+        pthread_join(mirrors[m].worker, NULL);
+        close(mirrors[m].fd);
+    }
+    ncopies = 0;
+    return 0;
+}
+
+static int mirror_copies(void)
+{
+    return ncopies;
+}
+
+static int mirror_read_copy(int copy, int block, int count, char *buf)
+{
+    if (copy < 0 || copy >= ncopies)
+        return -1;
+    return pread(mirrors[copy].fd, buf, (size_t)count * BLOCK_SIZE, (off_t)block * BLOCK_SIZE) ==
+                   (ssize_t)count * BLOCK_SIZE ? 0 : -1;
+}
+
+const disk_backend disk_mirror = {.name = "mirror", .make = mirror_make, .open = mirror_open,
+                                  .read = mirror_read, .write = mirror_write, .readv = mirror_readv,
+                                  .writev = mirror_writev, .flush = mirror_flush, .close = mirror_close,
+                                  .copies = mirror_copies, .read_copy = mirror_read_copy};
+
+int disk_mirror_failovers(void)
+{
+    return failovers;
+}
+
+int disk_mirror_resyncs(void)
+{
+    return resyncs;
+}
@@ -0,0 +1,24 @@
+#ifndef _MIRRORDISK_H_
+#define _MIRRORDISK_H_
+
+#include "disk.h"
+
+/***************************************************************************/
+/* every block on several image files, "mirror:[<unit>:]<file>,<file>,..." */
+/***************************************************************************/
+#define MIRROR_MAX 4   /* copies of a set                                  */
+#define MIRROR_FAN 16  /* blocks a write needs before the copies are written
+                          by worker threads instead of one after the other */
+
+/* reads go to the copy with the fewest reads in flight, or with a unit to
+   copy (block / unit) % copies, so a long run is read from all of them    */
+
+extern const disk_backend disk_mirror;
+
+int disk_mirror_failovers(void);
+/* reads that a copy failed and another one served                        */
+int disk_mirror_resyncs(void);
+/* copies that were dropped before and brought up to date at open          */
+/***************************************************************************/
+
+#endif
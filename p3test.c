@@ -13,627 +13,35 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <features.h>
+#include <time.h>
+#include <sys/stat.h>
 
 // #ifdef _XOPEN_SOURCE
 #define POLLRDNORM 0x040 
 // #endif
 
-#define NUM_TESTS 13
+#define NUM_TESTS 37
 #define PASS 1
 #define FAIL 0
 
 // #define _DEBUG
 #define TEST_WAIT_MILI 3000 // how many miliseconds do we wait before assuming a test is hung
+#define TEST_BASELINE "p3test.times" // wall times of a reference run, written by -w
+#define TEST_SLOWER 2.0              // slowdown against the baseline that is flagged
+#define TEST_SLACK_MILI 50           // differences below this are noise
 
-#include "disk.h"
-#include "disk.c"
+#include "journal.h"
+#include "summary.h"
+#include "sfs.h"
 
-#define MAX_FILENAME_LEN 15
-#define MAX_FILE_DESCRIPTOR 32
-#define MAX_FILE 64
 
-typedef enum
+/* the disk goes away between two calls, as in a crash; the lock keeps the
+   journal's window timer from writing to it meanwhile */
+static void crash(void)
 {
-    False,
-    True
-} boolean;
-
-typedef struct
-{
-    int dir_index;
-    int dir_len;
-    int data_index;
-} super_block;
-
-/* file information */
-typedef struct
-{
-    boolean used;
-    char name[MAX_FILENAME_LEN];
-    int size;
-    int head;
-    int num_blocks;
-    int fd_count;
-} file_info;
-
-/* file descriptor */
-typedef struct
-{
-    boolean used;
-    char file;
-    int offset;
-} file_descriptor;
-
-super_block *SBP;
-file_info *dir_pointer;
-file_descriptor META[MAX_FILE_DESCRIPTOR];
-
-char findFile(char *name);
-int findUnallocatedMetaInfo(char file_index);
-int findFreeBlock(char file_index);
-int findNextBlock(int current, char file_index);
-
-int make_fs(char *name);
-int mount_fs(char *name);
-int umount_fs(char *name);
-
-int fs_open(char *name);
-int fs_close(int fd);
-
-int fs_create(char *name);
-int fs_delete(char *name);
-
-int fs_read(int fd, void *buf, size_t nbyte);
-int fs_write(int fd, void *buf, size_t nbyte);
-
-int fs_get_filesize(int fd);
-int fs_lseek(int fd, off_t offset);
-int fs_truncate(int fd, off_t length);
-
-/* Struggle Begin */
-
-int make_fs(char *disk_name)
-{
-    if (make_disk(disk_name) == -1)
-        return -1;
-    if (open_disk(disk_name) == -1)
-        return -1;
-
-    make_disk(disk_name);
-    open_disk(disk_name);
-
-    /* Initialize the super block */
-    SBP = (super_block *)malloc(sizeof(super_block));
-    if (SBP == NULL)
-        return -1;
-
-    SBP->dir_index = 1;
-    SBP->dir_len = 0;
-    SBP->data_index = 2;
-
-    char buf[BLOCK_SIZE] = "";
-    memset(buf, 0, BLOCK_SIZE);
-    memcpy(buf, &SBP, sizeof(super_block));
-
-    /* Writing super block to disk  */
-    if (block_write(0, buf) == -1)
-        return -1;
-
-    free(SBP);
-    close_disk();
-    return 0;
-}
-
-int mount_fs(char *disk_name)
-{
-    if (disk_name == NULL)
-        return -1;
-    if (open_disk(disk_name) == -1)
-        return -1;
-
-    open_disk(disk_name);
-
-    /* reading super block */
-    char buf[BLOCK_SIZE] = "";
-    memset(buf, 0, BLOCK_SIZE);
-    block_read(0, buf);
-    memcpy(&SBP, buf, sizeof(SBP));
-
-    /* reading directory info */
-    dir_pointer = (file_info *)malloc(BLOCK_SIZE);
-    memset(buf, 0, BLOCK_SIZE);
-    block_read(SBP->dir_index, buf);
-    memcpy(dir_pointer, buf, sizeof(file_info) * SBP->dir_len);
-
-    /* clearing file descriptors */
-    for (int i = 0; i < MAX_FILE_DESCRIPTOR; ++i)
-    {
-        META[i].used = False;
-    }
-
-    return 0;
-}
-
-int umount_fs(char *disk_name)
-{
-    if (disk_name == NULL)
-        return -1;
-
-    /* write directory info */
-    int i, j = 0;
-    file_info *file_ptr = (file_info *)dir_pointer;
-    char buf[BLOCK_SIZE];
-    memset(buf, 0, BLOCK_SIZE);
-    char *block_ptr = buf;
-
-    for (i = 0; i < MAX_FILE; ++i)
-    {
-        if (dir_pointer[i].used == True)
-        {
-            memcpy(block_ptr, &dir_pointer[i], sizeof(dir_pointer[i]));
-            block_ptr += sizeof(file_info);
-        }
-    }
-
-    block_write(SBP->dir_index, buf);
-
-    /* clear file descriptors */
-    for (j = 0; j < MAX_FILE_DESCRIPTOR; ++j)
-    {
-        if (META[j].used == 1)
-        {
-            META[j].used = False;
-            META[j].file = -1;
-            META[j].offset = 0;
-        }
-    }
-
-    free(dir_pointer);
+    journalLock();
     close_disk();
-    return 0;
-}
-
-int fs_open(char *name)
-{
-    char file_index = findFile(name);
-    if (file_index < 0)
-    {
-        return -1;
-    }
-
-    int fd = findUnallocatedMetaInfo(file_index);
-    if (fd < 0)
-    {
-        return -1;
-    }
-
-    dir_pointer[file_index].fd_count++;
-    return fd;
-}
-
-int fs_close(int fildes)
-{
-    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTOR || !META[fildes].used)
-    {
-        return -1;
-    }
-
-    file_descriptor *fd = &META[fildes];
-
-    dir_pointer[fd->file].fd_count--;
-    fd->used = False;
-
-    return 0;
-}
-
-int fs_create(char *name)
-{
-    int len = strlen(name);
-    if (strlen(name) > MAX_FILENAME_LEN)
-    {
-        return -1;
-    }
-    char file_index = findFile(name);
-
-    if (file_index < 0) // Create file
-    { 
-        for (char i = 0; i < MAX_FILE; i++)
-        {
-            if (dir_pointer[i].used == False)
-            {
-                SBP->dir_len++;
-                /* Initialize file information */
-                dir_pointer[i].used = True;
-                strcpy(dir_pointer[i].name, name);
-                dir_pointer[i].size = 0;
-                dir_pointer[i].head = -1;
-                dir_pointer[i].num_blocks = 0;
-                dir_pointer[i].fd_count = 0;
-                return 0;
-            }
-        }
-        return -1;
-    }
-    else // File already exists
-    { 
-        return -1; 
-    }
-}
-
-int fs_delete(char *name)
-{
-    for (int i = 0; i < MAX_FILE; ++i)
-    {
-        if (strcmp(dir_pointer[i].name, name) == 0)
-        {
-            char file_index = '0' + i;
-            file_info *file = &dir_pointer[i];
-            int block_index = file->head;
-            int block_found = file->num_blocks;
-
-            if (dir_pointer[i].fd_count != 0)
-            { 
-                return -1; // File is currently open
-            }
-
-            // Remove file information
-            SBP->dir_len--;
-            file->used = False;
-            strcpy(file->name, "");
-            file->size = 0;
-            file->fd_count = 0;
-
-            /* Free file blocks */
-            char buf1[BLOCK_SIZE] = "";
-            char buf2[BLOCK_SIZE] = "";
-            block_read(SBP->data_index, buf1);
-            block_read(SBP->data_index + 1, buf2);
-            while (block_found > 0)
-            {
-                if (block_index < BLOCK_SIZE)
-                {
-                    buf1[block_index] = '\0';
-                }
-                else
-                {
-                    buf2[block_index - BLOCK_SIZE] = '\0';
-                }
-                block_index = findNextBlock(file->head, file_index);
-                block_found--;
-            }
-
-            dir_pointer[i].head = -1;
-            dir_pointer[i].num_blocks = 0;
-            block_write(SBP->data_index, buf1);
-            block_write(SBP->data_index + 1, buf2);
-
-            return 0;
-        }
-    }
-    return -1; //file does not exists
-}
-
-int fs_read(int fildes, void *buf, size_t nbyte)
-{
-    if (nbyte <= 0 || !META[fildes].used){return -1;}
-
-    int i, j = 0;
-    char *dst = buf;
-    char block[BLOCK_SIZE] = "";
-    char file_index = META[fildes].file;
-    file_info *file = &dir_pointer[file_index];
-    int block_index = file->head;
-    int block_found = 0;
-    int offset = META[fildes].offset;
-
-    /* load current block */
-    while (offset >= BLOCK_SIZE)
-    {
-        block_index = findNextBlock(block_index, file_index);
-        block_found++;
-        offset -= BLOCK_SIZE;
-    }
-    block_read(block_index, block);
-
-    /* read current block */
-    int r_found = 0;
-    for (i = offset; i < BLOCK_SIZE; i++)
-    {
-        dst[r_found++] = block[i];
-        if (r_found == (int)nbyte)
-        {
-            META[fildes].offset += r_found;
-            return r_found;
-        }
-    }
-    block_found++;
-
-    /* read the following blocks */
-    strcpy(block, "");
-    while (r_found < (int)nbyte && block_found <= file->num_blocks)
-    {
-        block_index = findNextBlock(block_index, file_index);
-        strcpy(block, "");
-        block_read(block_index, block);
-        for (j = 0; j < BLOCK_SIZE; j++, i++)
-        {
-            dst[r_found++] = block[j];
-            if (r_found == (int)nbyte)
-            {
-                META[fildes].offset += r_found;
-                return r_found;
-            }
-        }
-        block_found++;
-    }
-    META[fildes].offset += r_found;
-    return r_found;
-}
-
-int fs_write(int fildes, void *buf, size_t nbyte)
-{
-    if (nbyte <= 0 || !META[fildes].used || fildes < 0)
-    { return -1; }
-
-    int i = 0;
-    char *src = buf;
-    char block[BLOCK_SIZE] = "";
-    char file_index = META[fildes].file;
-    file_info *file = &dir_pointer[file_index];
-    int block_index = file->head;
-    int size = file->size;
-    int block_found = 0;
-    int offset = META[fildes].offset;
-
-    /* load current block */
-    while (offset >= BLOCK_SIZE)
-    {
-        block_index = findNextBlock(block_index, file_index);
-        block_found++;
-        offset -= BLOCK_SIZE;
-    }
-
-    int w_found = 0;
-    if (block_index != -1)
-    {
-        /* write current block */
-        block_read(block_index, block);
-        for (i = offset; i < BLOCK_SIZE; i++)
-        {
-            block[i] = src[w_found++];
-            if (w_found == (int)nbyte || w_found == strlen(src))
-            {
-                block_write(block_index, block);
-                META[fildes].offset += w_found;
-                if (size < META[fildes].offset)
-                {
-                    file->size = META[fildes].offset;
-                }
-                return w_found;
-            }
-        }
-        block_write(block_index, block);
-        block_found++;
-    }
-
-    /* write the allocated blocks */
-    strcpy(block, "");
-    while (w_found < (int)nbyte && w_found < strlen(src) && block_found < file->num_blocks)
-    {
-        block_index = findNextBlock(block_index, file_index);
-        for (i = 0; i < BLOCK_SIZE; i++)
-        {
-            block[i] = src[w_found++];
-            if (w_found == (int)nbyte || w_found == strlen(src))
-            {
-                block_write(block_index, block);
-                META[fildes].offset += w_found;
-                if (size < META[fildes].offset)
-                {
-                    file->size = META[fildes].offset;
-                }
-                return w_found;
-            }
-        }
-        block_write(block_index, block);
-        block_found++;
-    }
-
-    /* write into new blocks */
-    strcpy(block, "");
-    while (w_found < (int)nbyte && w_found < strlen(src))
-    {
-        block_index = findFreeBlock(file_index);
-        file->num_blocks++;
-        if (file->head == -1){
-            file->head = block_index;
-        }
-        if (block_index < 0){
-            return -1;
-        }
-        for (i = 0; i < BLOCK_SIZE; i++)
-        {
-            block[i] = src[w_found++];
-            if (w_found == (int)nbyte || w_found == strlen(src))
-            {
-                block_write(block_index, block);
-                META[fildes].offset += w_found;
-                if (size < META[fildes].offset){
-                    file->size = META[fildes].offset;
-                }
-                return w_found;
-            }
-        }
-        block_write(block_index, block);
-    }
-
-    META[fildes].offset += w_found;
-    if (size < META[fildes].offset){
-        file->size = META[fildes].offset;
-    }
-    return w_found;
-}
-
-int fs_get_filesize(int fildes)
-{
-    if (fildes < 0)
-    { return -1; }
-    if (!META[fildes].used)
-    { return -1; }
-    return dir_pointer[META[fildes].file].size;
-}
-
-int fs_lseek(int fildes, off_t offset)
-{
-    if (offset > dir_pointer[META[fildes].file].size || offset < 0)
-    { return -1; }
-    else if (!META[fildes].used)
-    { return -1; }
-    else
-    {
-        META[fildes].offset = (int)offset;
-        return 0;
-    }
-}
-
-int fs_truncate(int fildes, off_t length)
-{
-    char file_index = META[fildes].file;
-    file_info *file = &dir_pointer[file_index];
-
-    if (!META[fildes].used || fildes < 0)
-    { return -1; }
-
-    if (length > file->size || length < 0)
-    { return -1; }
-
-    /* free blocks */
-    int new_block_num = (int)(length + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    int i;
-    int block_index = file->head;
-    for (i = 0; i < new_block_num; ++i){
-        block_index = findNextBlock(block_index, file_index);
-    }
-    while (block_index > 0)
-    {
-        char buf[BLOCK_SIZE] = "";
-        if (block_index < BLOCK_SIZE)
-        {
-            block_read(SBP->data_index, buf);
-            buf[block_index] = '\0';
-            block_write(SBP->data_index, buf);
-        }
-        else
-        {
-            block_read(SBP->data_index + 1, buf);
-            buf[block_index - BLOCK_SIZE] = '\0';
-            block_write(SBP->data_index + 1, buf);
-        }
-        block_index = findNextBlock(block_index, file_index);
-    }
-
-    /* modify file information */
-    file->size = (int)length;
-    file->num_blocks = new_block_num;
-
-    /* truncate file_directory offset */
-    for (i = 0; i < MAX_FILE_DESCRIPTOR; i++)
-    {
-        if (META[i].used == True && META[i].file == file_index){
-            META[i].offset = (int)length;
-        }
-    }
-    return 0;
-}
-
-/* Helper Function */
-
-char findFile(char *name)
-{
-    char i;
-    for (i = 0; i < MAX_FILE; i++)
-    {
-        if (dir_pointer[i].used == 1 && strcmp(dir_pointer[i].name, name) == 0)
-        {
-            return i;
-        }
-    }
-    return -1;
-}
-
-int findUnallocatedMetaInfo(char file_index)
-{
-    int i = 0;
-    for (i = 0; i < MAX_FILE_DESCRIPTOR; i++)
-    {
-        if (META[i].used == False)
-        {
-            META[i].used = True;
-            META[i].file = file_index;
-            META[i].offset = 0;
-            return i; // file descriptor number will return
-        }
-    }
-    return -1;
-}
-
-int findFreeBlock(char file_index)
-{
-    int i;
-    char buf1[BLOCK_SIZE] = "";
-    char buf2[BLOCK_SIZE] = "";
-    block_read(SBP->data_index, buf1);
-    block_read(SBP->data_index + 1, buf2);
-
-    for (i = 0; i < BLOCK_SIZE; i++)
-    {
-        if (buf1[i] == '\0')
-        {
-            buf1[i] = (char)(file_index + 1);
-            block_write(SBP->data_index, buf1);
-            return i; // block number determine
-        }
-    }
-    for (i = 0; i < BLOCK_SIZE; i++)
-    {
-        if (buf2[i] == '\0')
-        {
-            buf2[i] = (char)(file_index + 1);
-            block_write(SBP->data_index, buf2);
-            return i; // block number will return
-        }
-    }
-    return -1;
-}
-
-int findNextBlock(int current, char file_index)
-{
-    char buf[BLOCK_SIZE] = "";
-    int i;
-
-    if (current < BLOCK_SIZE)
-    {
-        block_read(SBP->data_index, buf);
-        for (i = current + 1; i < BLOCK_SIZE; i++)
-        {
-            if (buf[i] == (file_index + 1))
-            {
-                return i;
-            }
-        }
-    }
-    else
-    {
-        block_read(SBP->data_index + 1, buf);
-        for (i = current - BLOCK_SIZE + 1; i < BLOCK_SIZE; i++)
-        {
-            if (buf[i] == (file_index + 1))
-            {
-                return i + BLOCK_SIZE;
-            }
-        }
-    }
-    return -1;
+    journalUnlock();
 }
 
 // if your code compiles you pass test 0 for free
@@ -747,7 +155,7 @@ static int test4(void)
     fs_write(fd, wt, 10);
 
     rtn = fs_read(fd, rd, 10);
-    if (rtn == 0)
+    if (rtn != 0)
         return FAIL;
 
     rtn = fs_lseek(fd, 0);
@@ -763,7 +171,7 @@ static int test4(void)
         return FAIL;
 
     fs_close(fd);
-    // umount_fs("disk.4");
+    umount_fs("disk.4");
 
     return PASS;
 }
@@ -798,11 +206,11 @@ static int test5(void)
     if (rtn != BLOCK_SIZE * 2)
         return FAIL;
 
-    if (strcmp(rd, wt) == 0)
+    if (strcmp(rd, wt))
         return FAIL;
 
     fs_close(fd);
-    // umount_fs("disk.5");
+    umount_fs("disk.5");
 
     return PASS;
 }
@@ -826,10 +234,10 @@ static int test6(void)
     fs_write(fd, wt, strlen(wt));
     fs_close(fd);
 
-    // umount_fs("disk.6");
-    // rtn = mount_fs("disk.6");
-    // if (rtn)
-    //     return FAIL;
+    umount_fs("disk.6");
+    rtn = mount_fs("disk.6");
+    if (rtn)
+        return FAIL;
 
     fd = fs_open("file.6");
     fs_read(fd, rd, 20);
@@ -838,7 +246,7 @@ static int test6(void)
         return FAIL;
 
     fs_close(fd);
-    // umount_fs("disk.6");
+    umount_fs("disk.6");
 
     return PASS;
 }
@@ -875,7 +283,7 @@ static int test7(void)
         return FAIL;
 
     fs_close(fd);
-    // umount_fs("disk.7");
+    umount_fs("disk.7");
 
     return PASS;
 }
@@ -899,14 +307,14 @@ static int test8(void)
 
     fs_truncate(fd, 64);
     rtn = fs_read(fd, buf, 32);
-    if (rtn == 0)
+    if (rtn != 0)
         return FAIL;
 
     if (fs_get_filesize(fd) != 64)
         return FAIL;
 
     fs_close(fd);
-    // umount_fs("disk.8");
+    umount_fs("disk.8");
 
     return PASS;
 }
@@ -961,7 +369,7 @@ static int test9(void)
         fs_close(fd[i]);
     }
 
-    // umount_fs("disk.9");
+    umount_fs("disk.9");
 
     return PASS;
 }
@@ -1046,7 +454,7 @@ static int test10(void)
         return FAIL;
 
     fs_close(fd);
-    // umount_fs("disk.10");
+    umount_fs("disk.10");
 
     return PASS;
 }
@@ -1063,7 +471,7 @@ static int test11(void)
 
     make_fs("disk.11");
 
-    rtn = mount_fs("disk.10");
+    rtn = mount_fs("none.11"); // a disk that was never made
     if (rtn != -1)
         return FAIL;
 
@@ -1072,7 +480,7 @@ static int test11(void)
     if (rtn != -1)
         return FAIL;
 
-    // umount_fs("disk.11");
+    umount_fs("disk.11");
 
     return PASS;
 }
@@ -1113,125 +521,2024 @@ static int test12(void)
     rtn = fs_truncate(fd, 100);
     if (rtn != -1)
         return FAIL;
+    if (fs_truncate(-1, 0) != -1 || fs_truncate(MAX_FILE_DESCRIPTOR, 0) != -1 || fs_truncate(fd + 1, 0) != -1)
+        return FAIL;
 
     rtn = fs_close(fd + 1);
     if (rtn != -1)
         return FAIL;
 
     fs_close(fd);
-    // umount_fs("disk.12");
+    umount_fs("disk.12");
 
     return PASS;
 }
 
-// end of tests
+// tail packing test
 //==============================================================================
+static int test13(void)
+{
+    int i, fd;
+    char fname[32];
+    char wt[600];
+    char rd[600];
+    char big[BLOCK_SIZE];
+    pack_stats stats;
 
-/**
- *  Some implementation details: Main spawns a child process for each
- *  test, that way if test 2/20 segfaults, we can still run the remaining
- *  tests. It also hands the child a pipe to write the result of the test.
- *  the parent polls this pipe, and counts the test as a failure if there
- *  is a timeout (which would indicate the child is hung).
- */
+    make_fs("disk.13");
+    mount_fs("disk.13");
 
-static int (*test_arr[NUM_TESTS])(void) = {&test0, &test1, &test2,
-                                           &test3, &test4, &test5,
-                                           &test6, &test7, &test8, &test9,
-                                           &test10, &test11, &test12};
-// static int (*test_arr[NUM_TESTS])(void) = {&test9};
+    /* eight small files share a single tail block */
+    for (i = 0; i < 8; i++)
+    {
+        snprintf(fname, 32, "file13.%i", i);
+        fs_create(fname);
+        fd = fs_open(fname);
+        memset(wt, 'a' + i, 100);
+        if (fs_write(fd, wt, 100) != 100)
+            return FAIL;
+        fs_close(fd);
+    }
 
-// int main(void)
-// {
-//     char disk[10];
-//     int score = 0;
-//     int total_score = 0;
+    fs_pack_stats(&stats);
+    if (stats.packed_files != 8 || stats.tail_blocks != 1 || stats.blocks_saved != 7)
+        return FAIL;
 
-//     for (int i = 0; i < NUM_TESTS; i++)
-//     {
-//         score = 0;
-//         score = test_arr[i]();
-//         total_score += score;
-//         if (score)
-//         {
-//             printf("test %i : PASS\n", i);
-//         }
-//         else
-//         {
-//             printf("test %i : FAIL\n", i);
-//         }
-//         sprintf(disk, "disk.%d", i);
-//         remove(disk);
-//     }
-//     printf("total score was %i / %i\n", total_score, NUM_TESTS);
-//     return 0;
-// }
+    /* growing past PACK_MAX moves the file into a block of its own */
+    memset(big, 'z', BLOCK_SIZE);
+    fd = fs_open("file13.0");
+    fs_lseek(fd, 100);
+    if (fs_write(fd, big, BLOCK_SIZE) != BLOCK_SIZE)
+        return FAIL;
+    fs_lseek(fd, 0);
+    if (fs_read(fd, rd, 100) != 100 || rd[0] != 'a' || rd[99] != 'a')
+        return FAIL;
+    fs_close(fd);
 
-int main(void)
-{
+    /* growing within PACK_MAX moves the file to a longer fragment run */
+    memset(wt, 'y', 600);
+    fd = fs_open("file13.1");
+    fs_lseek(fd, 100);
+    fs_write(fd, wt, 500);
+    fs_close(fd);
+
+    umount_fs("disk.13");
+    mount_fs("disk.13");
+
+    fs_pack_stats(&stats);
+    if (stats.packed_files != 7 || stats.tail_blocks != 1 || stats.frags_used != 8)
+        return FAIL;
+
+    fd = fs_open("file13.1");
+    if (fs_read(fd, rd, 600) != 600 || rd[0] != 'b' || rd[100] != 'y')
+        return FAIL;
+    fs_close(fd);
+
+    for (i = 2; i < 8; i++)
+    {
+        snprintf(fname, 32, "file13.%i", i);
+        fd = fs_open(fname);
+        if (fs_read(fd, rd, 600) != 100 || rd[0] != 'a' + i || rd[99] != 'a' + i)
+            return FAIL;
+        fs_close(fd);
+    }
+
+    /* the tail block is freed with its last fragment */
+    for (i = 1; i < 8; i++)
+    {
+        snprintf(fname, 32, "file13.%i", i);
+        fs_delete(fname);
+    }
+    fs_pack_stats(&stats);
+    if (stats.packed_files != 0 || stats.tail_blocks != 0)
+        return FAIL;
+
+    umount_fs("disk.13");
+
+    return PASS;
+}
+
+// compressed file test
+//==============================================================================
+static int test14(void)
+{
+    int i, fd, rtn;
+    char line[64];
+    static char wt[8 * DEFAULT_BLOCK_SIZE * 3];
+    static char rd[8 * DEFAULT_BLOCK_SIZE * 3];
+
+    /* log lines compress well but are not all alike */
+    for (i = 0; i < (int)sizeof(wt); i += 32)
+    {
+        snprintf(line, sizeof(line), "%08d INFO request served ok\n", i);
+        memcpy(wt + i, line, 32);
+    }
+
+    make_fs("disk.14");
+    mount_fs("disk.14");
+
+    fs_create("file.14");
+    fd = fs_open("file.14");
+    if (fs_set_compression(fd, True))
+        return FAIL;
+
+    for (i = 0; i < (int)sizeof(wt); i += BLOCK_SIZE)
+    {
+        if (fs_write(fd, wt + i, BLOCK_SIZE) != BLOCK_SIZE)
+            return FAIL;
+    }
+
+    /* the layout cannot change once there is data */
+    if (fs_set_compression(fd, False) != -1)
+        return FAIL;
+    if (fs_get_filesize(fd) != sizeof(wt))
+        return FAIL;
+    if (dir_pointer[META[fd].file].num_blocks >= (int)sizeof(wt) / BLOCK_SIZE / 2)
+        return FAIL;
+
+    /* overwrite across a cluster boundary */
+    memset(rd, 'x', 100);
+    memset(wt + CLUSTER_SIZE - 50, 'x', 100);
+    fs_lseek(fd, CLUSTER_SIZE - 50);
+    fs_write(fd, rd, 100);
+    fs_close(fd);
+
+    umount_fs("disk.14");
+    mount_fs("disk.14");
+
+    fd = fs_open("file.14");
+    rtn = fs_read(fd, rd, sizeof(rd));
+    if (rtn != sizeof(wt) || memcmp(rd, wt, sizeof(wt)))
+        return FAIL;
+
+    fs_truncate(fd, CLUSTER_SIZE + 10);
+    fs_lseek(fd, CLUSTER_SIZE - 50);
+    memset(rd, 0, sizeof(rd));
+    if (fs_read(fd, rd, 100) != 60 || memcmp(rd, wt + CLUSTER_SIZE - 50, 60))
+        return FAIL;
+
+    fs_close(fd);
+    if (fs_delete("file.14"))
+        return FAIL;
+
+    umount_fs("disk.14");
+
+    return PASS;
+}
+
+// dedup test
+//==============================================================================
+static int test15(void)
+{
+    int i, fd1, fd2;
+    static char wt[DEFAULT_BLOCK_SIZE * 8];
+    static char rd[DEFAULT_BLOCK_SIZE * 8];
+    dedup_stats stats;
+
+    for (i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i * 7 + i / BLOCK_SIZE);
+
+    make_fs("disk.15");
+    mount_fs("disk.15");
+
+    fs_create("file15.a");
+    fs_create("file15.b");
+    fd1 = fs_open("file15.a");
+    fd2 = fs_open("file15.b");
+    if (fs_set_dedup(fd1, True) || fs_set_dedup(fd2, True))
+        return FAIL;
+
+    /* the second copy only adds references */
+    fs_write(fd1, wt, sizeof(wt));
+    fs_write(fd2, wt, sizeof(wt));
+    fs_dedup_stats(&stats);
+    if (stats.shared_blocks != 8 || stats.blocks_saved != 8 || stats.dedup_hits != 8)
+        return FAIL;
+
+    /* writing one copy must not show through the other */
+    memset(rd, 'x', 10);
+    fs_lseek(fd2, BLOCK_SIZE * 3 + 5);
+    fs_write(fd2, rd, 10);
+    fs_dedup_stats(&stats);
+    if (stats.shared_blocks != 9 || stats.blocks_saved != 7)
+        return FAIL;
+    fs_close(fd1);
+    fs_close(fd2);
+
+    umount_fs("disk.15");
+    mount_fs("disk.15");
+
+    fd1 = fs_open("file15.a");
+    if (fs_read(fd1, rd, sizeof(rd)) != sizeof(wt) || memcmp(rd, wt, sizeof(wt)))
+        return FAIL;
+    fs_close(fd1);
+
+    /* the blocks outlive the file that wrote them first */
+    fs_delete("file15.a");
+    fd2 = fs_open("file15.b");
+    memset(wt + BLOCK_SIZE * 3 + 5, 'x', 10);
+    if (fs_read(fd2, rd, sizeof(rd)) != sizeof(wt) || memcmp(rd, wt, sizeof(wt)))
+        return FAIL;
+    fs_dedup_stats(&stats);
+    if (stats.shared_blocks != 8 || stats.blocks_saved != 0)
+        return FAIL;
+
+    fs_close(fd2);
+    fs_delete("file15.b");
+    fs_dedup_stats(&stats);
+    if (stats.shared_blocks != 0)
+        return FAIL;
+
+    umount_fs("disk.15");
+
+    return PASS;
+}
+
+// checksum test
+//==============================================================================
+static int test16(void)
+{
+    int fd, f, head;
+    char wt[BLOCK_SIZE];
+    char rd[BLOCK_SIZE];
+
+    memset(wt, 'c', BLOCK_SIZE);
+
+    make_fs("disk.16");
+    mount_fs("disk.16");
+
+    fs_create("file.16");
+    fd = fs_open("file.16");
+    fs_write(fd, wt, BLOCK_SIZE);
+    head = dir_pointer[META[fd].file].head;
+    fs_close(fd);
+    umount_fs("disk.16");
+
+    /* flip a byte behind the file system's back */
+    f = open("disk.16", O_RDWR);
+    pwrite(f, "x", 1, (off_t)head * BLOCK_SIZE + 100);
+    close(f);
+
+    if (mount_fs("disk.16"))
+        return FAIL;
+    fd = fs_open("file.16");
+    if (fs_read(fd, rd, BLOCK_SIZE) != -1 || fs_checksum_errors() != 1)
+        return FAIL;
+    fs_close(fd);
+    umount_fs("disk.16");
+
+    /* a damaged super block keeps the image from mounting */
+    f = open("disk.16", O_RDWR);
+    pwrite(f, "x", 1, 0);
+    close(f);
+
+    if (mount_fs("disk.16") != -1)
+        return FAIL;
+
+    return PASS;
+}
+
+// clone and snapshot test
+//==============================================================================
+static int test17(void)
+{
+    int i, fd, id;
+    static char wt[DEFAULT_BLOCK_SIZE * 16];
+    static char rd[DEFAULT_BLOCK_SIZE * 16];
+    dedup_stats stats;
+
+    for (i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i * 13 + i / BLOCK_SIZE);
+
+    make_fs("disk.17");
+    mount_fs("disk.17");
+
+    fs_create("tmpl.17");
+    fd = fs_open("tmpl.17");
+    fs_write(fd, wt, sizeof(wt));
+    fs_close(fd);
+    fs_create("small.17");
+    fd = fs_open("small.17");
+    fs_write(fd, "tail", 4);
+    fs_close(fd);
+
+    /* a clone only adds references */
+    if (fs_clone("tmpl.17", "clone.17") || fs_clone("small.17", "copy.17"))
+        return FAIL;
+    if (fs_clone("tmpl.17", "clone.17") != -1 || fs_clone("none.17", "x.17") != -1)
+        return FAIL;
+    fs_dedup_stats(&stats);
+    if (stats.shared_blocks != 16 || stats.blocks_saved != 16)
+        return FAIL;
+
+    /* writing the clone copies the one block it touches */
+    fd = fs_open("clone.17");
+    fs_lseek(fd, BLOCK_SIZE * 5);
+    fs_write(fd, "changed", 7);
+    fs_lseek(fd, 0);
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(wt) || memcmp(rd + BLOCK_SIZE * 5, "changed", 7))
+        return FAIL;
+    fs_close(fd);
+    fs_dedup_stats(&stats);
+    if (stats.shared_blocks != 17 || stats.blocks_saved != 15)
+        return FAIL;
+
+    fd = fs_open("tmpl.17");
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(wt) || memcmp(rd, wt, sizeof(wt)))
+        return FAIL;
+    fs_close(fd);
+    fd = fs_open("copy.17");
+    if (fs_read(fd, rd, 10) != 4 || memcmp(rd, "tail", 4))
+        return FAIL;
+    fs_close(fd);
+
+    /* snapshot, then change everything */
+    id = fs_snapshot();
+    if (id < 0)
+        return FAIL;
+    fd = fs_open("tmpl.17");
+    fs_write(fd, "overwritten", 11);
+    fs_close(fd);
+    fs_delete("clone.17");
+    fs_delete("small.17");
+    fs_create("new.17");
+
+    umount_fs("disk.17");
+    mount_fs("disk.17");
+
+    if (fs_rollback(id))
+        return FAIL;
+    if (findFile("new.17") != -1 || findFile("clone.17") == -1)
+        return FAIL;
+    fd = fs_open("tmpl.17");
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(wt) || memcmp(rd, wt, sizeof(wt)))
+        return FAIL;
+    fs_close(fd);
+    fd = fs_open("small.17");
+    if (fs_read(fd, rd, 10) != 4 || memcmp(rd, "tail", 4))
+        return FAIL;
+    fs_close(fd);
+
+    /* once the snapshot and the files are gone no block is referenced */
+    if (fs_snapshot_delete(id) || fs_snapshot_delete(id) != -1)
+        return FAIL;
+    fs_delete("tmpl.17");
+    fs_delete("clone.17");
+    fs_dedup_stats(&stats);
+    if (stats.shared_blocks != 0)
+        return FAIL;
+
+    umount_fs("disk.17");
+
+    return PASS;
+}
+
+// copy range test
+//==============================================================================
+static int test18(void)
+{
+    int i, fd1, fd2;
+    static char wt[DEFAULT_BLOCK_SIZE * 10];
+    static char rd[DEFAULT_BLOCK_SIZE * 11];
+    static char model[DEFAULT_BLOCK_SIZE * 11];
+    int size = 3000 + sizeof(wt) - 100;
+    dedup_stats before, after;
+
+    for (i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i * 11 + i / BLOCK_SIZE);
+
+    make_fs("disk.18");
+    mount_fs("disk.18");
+
+    fs_create("src.18");
+    fs_create("dst.18");
+    fd1 = fs_open("src.18");
+    fd2 = fs_open("dst.18");
+    fs_write(fd1, wt, sizeof(wt));
+
+    /* whole blocks, the file offsets stay where they were */
+    if (fs_copy_range(fd1, 0, fd2, 0, BLOCK_SIZE * 6) != BLOCK_SIZE * 6)
+        return FAIL;
+    if (META[fd1].offset != sizeof(wt) || META[fd2].offset != 0)
+        return FAIL;
+    memcpy(model, wt, BLOCK_SIZE * 6);
+
+    /* unaligned on both sides, past the end of the destination and the source */
+    if (fs_copy_range(fd1, 100, fd2, 3000, sizeof(wt)) != (int)sizeof(wt) - 100)
+        return FAIL;
+    memcpy(model + 3000, wt + 100, sizeof(wt) - 100);
+
+    /* the same offset in a block on both sides: partial blocks at the edges,
+       whole blocks in between */
+    if (fs_copy_range(fd1, 200, fd2, BLOCK_SIZE * 6 + 200, BLOCK_SIZE * 3) != BLOCK_SIZE * 3)
+        return FAIL;
+    memcpy(model + BLOCK_SIZE * 6 + 200, wt + 200, BLOCK_SIZE * 3);
+    if (fs_get_filesize(fd2) != size)
+        return FAIL;
+    if (fs_read(fd2, rd, sizeof(rd)) != size || memcmp(rd, model, size))
+        return FAIL;
+
+    /* overlapping ranges of one file are refused */
+    if (fs_copy_range(fd1, 0, fd1, 100, 200) != -1)
+        return FAIL;
+    fs_close(fd1);
+    fs_close(fd2);
+
+    /* mapped files just take references */
+    if (fs_clone("src.18", "map.18"))
+        return FAIL;
+    fs_create("copy.18");
+    fd1 = fs_open("map.18");
+    fd2 = fs_open("copy.18");
+    fs_set_dedup(fd2, True);
+    fs_dedup_stats(&before);
+    if (fs_copy_range(fd1, BLOCK_SIZE * 2, fd2, 0, BLOCK_SIZE * 4) != BLOCK_SIZE * 4)
+        return FAIL;
+    fs_dedup_stats(&after);
+    if (after.shared_blocks != before.shared_blocks || after.references != before.references + 4)
+        return FAIL;
+    if (fs_read(fd2, rd, sizeof(rd)) != BLOCK_SIZE * 4 || memcmp(rd, wt + BLOCK_SIZE * 2, BLOCK_SIZE * 4))
+        return FAIL;
+    fs_close(fd1);
+    fs_close(fd2);
+
+    umount_fs("disk.18");
+    mount_fs("disk.18");
+
+    fd2 = fs_open("dst.18");
+    if (fs_read(fd2, rd, sizeof(rd)) != size || memcmp(rd, model, size))
+        return FAIL;
+    fs_close(fd2);
+
+    umount_fs("disk.18");
+
+    return PASS;
+}
+
+// defragmentation test
+//==============================================================================
+static int test19(void)
+{
+    int i, fd1, fd2, fd3;
+    static char wt[DEFAULT_BLOCK_SIZE * 8];
+    static char rd[DEFAULT_BLOCK_SIZE * 8];
+    frag_stats stats;
+
+    for (i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i * 5 + i / BLOCK_SIZE);
+
+    make_fs("disk.19");
+    mount_fs("disk.19");
+
+    /* a block freed in front of a file is never appended to it */
+    fs_create("first.19");
+    fs_create("second.19");
+    fd1 = fs_open("first.19");
+    fd2 = fs_open("second.19");
+    fs_write(fd1, wt, BLOCK_SIZE * 3);
+    fs_write(fd2, wt, BLOCK_SIZE * 3);
+    fs_close(fd1);
+    fs_delete("first.19");
+    fs_write(fd2, wt + BLOCK_SIZE * 3, BLOCK_SIZE * 2);
+    fs_lseek(fd2, 0);
+    if (fs_read(fd2, rd, sizeof(rd)) != BLOCK_SIZE * 5 || memcmp(rd, wt, BLOCK_SIZE * 5))
+        return FAIL;
+
+    /* appends taking turns interleave the files */
+    fs_create("a.19");
+    fs_create("b.19");
+    fd1 = fs_open("a.19");
+    fd3 = fs_open("b.19");
+    for (i = 0; i < 8; i++)
+    {
+        fs_write(fd1, wt + i * BLOCK_SIZE, BLOCK_SIZE);
+        fs_write(fd3, wt + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    fs_frag_stats(&stats);
+    if (stats.files != 3 || stats.fragmented_files < 2 || stats.extents <= stats.files)
+        return FAIL;
+
+    /* a small budget still gets there, a call at a time */
+    while (fs_defrag(1) > 0)
+        ;
+    fs_frag_stats(&stats);
+    if (stats.fragmented_files != 0 || stats.extents != stats.files || stats.blocks != 21)
+        return FAIL;
+
+    /* open descriptors keep working */
+    fs_lseek(fd1, 0);
+    if (fs_read(fd1, rd, sizeof(rd)) != sizeof(wt) || memcmp(rd, wt, sizeof(wt)))
+        return FAIL;
+    fs_close(fd1);
+    fs_close(fd2);
+    fs_close(fd3);
+
+    umount_fs("disk.19");
+    mount_fs("disk.19");
+
+    fd3 = fs_open("b.19");
+    if (fs_read(fd3, rd, sizeof(rd)) != sizeof(wt) || memcmp(rd, wt, sizeof(wt)))
+        return FAIL;
+    fs_close(fd3);
+
+    umount_fs("disk.19");
+
+    return PASS;
+}
+
+// image verifier test
+//==============================================================================
+static int test20(void)
+{
+    int fd, f, head;
+    static char wt[DEFAULT_BLOCK_SIZE * 20];
+    fsck_report r;
+
+    memset(wt, 'v', sizeof(wt));
+
+    make_fs("disk.20");
+    mount_fs("disk.20");
+
+    /* one file of every layout, plus a clone and a snapshot */
+    fs_create("chain.20");
+    fd = fs_open("chain.20");
+    fs_write(fd, wt, BLOCK_SIZE * 5 + 7);
+    fs_close(fd);
+    fs_create("small.20");
+    fd = fs_open("small.20");
+    fs_write(fd, wt, 700);
+    fs_close(fd);
+    fs_create("comp.20");
+    fd = fs_open("comp.20");
+    fs_set_compression(fd, True);
+    fs_write(fd, wt, sizeof(wt));
+    fs_close(fd);
+    fs_create("dedup.20");
+    fd = fs_open("dedup.20");
+    fs_set_dedup(fd, True);
+    fs_write(fd, wt, sizeof(wt));
+    fs_close(fd);
+    fs_clone("chain.20", "clone.20");
+    fs_snapshot();
+    umount_fs("disk.20");
+
+    if (fsck_image("disk.20", 4, 0, &r) != 0 || r.files != 5 || r.snapshots != 1)
+        return FAIL;
+
+    /* a block count that does not add up */
+    mount_fs("disk.20");
+    fd = fs_open("small.20");
+    fs_close(fd);
+    fs_create("more.20");
+    fd = fs_open("more.20");
+    fs_write(fd, wt, BLOCK_SIZE * 3);
+    head = dir_pointer[META[fd].file].head;
+    dir_pointer[META[fd].file].num_blocks = 2;
+    fs_close(fd);
+    umount_fs("disk.20");
+
+    if (fsck_image("disk.20", 2, 0, &r) != 1 || r.count_mismatch != 1 || r.errors != 1)
+        return FAIL;
+
+    /* a data block changed behind the file system's back */
+    f = open("disk.20", O_RDWR);
+    pwrite(f, "x", 1, (off_t)head * BLOCK_SIZE + 9);
+    close(f);
+
+    if (fsck_image("disk.20", 3, 0, &r) != 1 || r.bad_checksums != 1)
+        return FAIL;
+
+    if (fsck_image("none.20", 1, 0, &r) != -1)
+        return FAIL;
+
+    return PASS;
+}
+
+static int test21(void)
+{
+    int fd;
+    static char wt[DEFAULT_BLOCK_SIZE * 4];
+    static char json[1 << 16];
+    op_stats st[OP_COUNT];
+    FILE *out;
+
+    memset(wt, 's', sizeof(wt));
+    fs_stats_reset();
+
+    make_fs("disk.21");
+    mount_fs("disk.21");
+    fs_create("stats.21");
+    fd = fs_open("stats.21");
+    for (int i = 0; i < 10; i++)
+        fs_write(fd, wt, sizeof(wt));
+    fs_lseek(fd, 0);
+    fs_read(fd, wt, sizeof(wt));
+    fs_read(-1, wt, 1);
+
+    if (fs_stats(st) != 0)
+        return FAIL;
+    if (st[OP_WRITE].calls != 10 || st[OP_WRITE].bytes != 10 * sizeof(wt) || st[OP_WRITE].errors != 0)
+        return FAIL;
+    if (st[OP_READ].calls != 2 || st[OP_READ].errors != 1 || st[OP_READ].bytes != sizeof(wt))
+        return FAIL;
+    if (st[OP_BLOCK_WRITE].calls == 0 || st[OP_MAP_SCAN].calls == 0 || st[OP_CHAIN_WALK].calls == 0)
+        return FAIL;
+    if (st[OP_WRITE].p50_ns > st[OP_WRITE].p99_ns || st[OP_WRITE].p99_ns > st[OP_WRITE].p999_ns ||
+        st[OP_WRITE].p999_ns > st[OP_WRITE].max_ns || st[OP_WRITE].max_ns > st[OP_WRITE].total_ns)
+        return FAIL;
+
+    out = tmpfile();
+    if (out == NULL || fs_stats_json(out) != 0)
+        return FAIL;
+    rewind(out);
+    json[fread(json, 1, sizeof(json) - 1, out)] = '\0';
+    fclose(out);
+    if (strstr(json, "\"name\": \"fs_write\", \"calls\": 10,") == NULL || strstr(json, "fs_truncate") != NULL)
+        return FAIL;
+
+    fs_stats_reset();
+    fs_stats(st);
+    if (st[OP_WRITE].calls != 0 || st[OP_BLOCK_WRITE].calls != 0)
+        return FAIL;
+
+    fs_close(fd);
+    umount_fs("disk.21");
+    return PASS;
+}
+
+static int test22(void)
+{
+    int fd, fd2, size, calls;
+    static char wt[DEFAULT_BLOCK_SIZE * 3];
+    replay_report r;
+    FILE *f;
+
+    memset(wt, 't', sizeof(wt));
+
+    if (fs_trace_start("trace.22") != 0 || fs_trace_start("trace.22") != -1)
+        return FAIL;
+    make_fs("disk.22");
+    mount_fs("disk.22");
+    fs_create("one.22");
+    fs_create("one.22"); // fails, and must fail again in the replay
+    fd = fs_open("one.22");
+    fs_write(fd, wt, sizeof(wt));
+    fs_lseek(fd, 100);
+    fs_read(fd, wt, 5000);
+    fs_truncate(fd, 9000);
+    fs_create("two.22");
+    fd2 = fs_open("two.22");
+    fs_set_dedup(fd2, True);
+    fs_copy_range(fd, 0, fd2, 0, 9000);
+    fs_close(fd);
+    fs_close(fd2);
+    fs_clone("one.22", "three.22");
+    fs_delete("two.22");
+    fs_snapshot();
+    umount_fs("disk.22");
+    calls = 19;
+    if (fs_trace_stop() != 0 || fs_trace_stop() != -1)
+        return FAIL;
+
+    /* header, fixed records, the disk name three times and seven file names plus three.22 */
+    f = fopen("trace.22", "rb");
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fclose(f);
+    if (size != (int)(sizeof(trace_header) + calls * sizeof(trace_record)) + 3 * 7 + 7 * 6 + 8)
+        return FAIL;
+
+    if (trace_replay("trace.22", "disk.22r", 0, &r) != 0 || r.ops != calls || r.skipped || r.mismatches)
+        return FAIL;
+
+    /* the replayed image ends up with the same files */
+    mount_fs("disk.22r");
+    fd = fs_open("three.22");
+    if (fd < 0 || fs_get_filesize(fd) != 9000 || fs_open("two.22") != -1)
+        return FAIL;
+    fs_close(fd);
+    umount_fs("disk.22r");
+
+    remove("disk.22r");
+    remove("trace.22");
+    if (trace_replay("none.22", "disk.22r", 0, &r) != -1)
+        return FAIL;
+    return PASS;
+}
+
+static int count_writes;
+
+static int countingWrite(int block, char *buf)
+{
+    count_writes++;
+    return disk_ram.write(block, buf);
+}
+
+static int test23(void)
+{
+    int fd;
+    static char wt[DEFAULT_BLOCK_SIZE * 3], rd[DEFAULT_BLOCK_SIZE * 3];
+    disk_backend counting = disk_ram;
+
+    for (int i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i * 7);
+
+    /* a RAM disk keeps its contents across mounts and leaves no file behind */
+    if (make_fs("ram:disk.23") != 0 || mount_fs("ram:disk.23") != 0)
+        return FAIL;
+    fs_create("ram.23");
+    fd = fs_open("ram.23");
+    fs_write(fd, wt, sizeof(wt));
+    fs_close(fd);
+    umount_fs("ram:disk.23");
+    if (access("ram:disk.23", F_OK) == 0 || access("disk.23", F_OK) == 0)
+        return FAIL;
+
+    if (mount_fs("ram:disk.23") != 0)
+        return FAIL;
+    fd = fs_open("ram.23");
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(rd) || memcmp(wt, rd, sizeof(rd)))
+        return FAIL;
+    if (disk_ram_free("disk.23") != -1) // still mounted
+        return FAIL;
+    fs_close(fd);
+    umount_fs("ram:disk.23");
+
+    if (disk_ram_free("disk.23") != 0 || mount_fs("ram:disk.23") != -1)
+        return FAIL;
+
+    /* another backend under a prefix of its own */
+    counting.write = countingWrite;
+    if (disk_register("count:", &counting) != 0 || disk_register("", &counting) != -1)
+        return FAIL;
+    make_fs("count:disk.23");
+    mount_fs("count:disk.23");
+    fs_create("count.23");
+    fd = fs_open("count.23");
+    fs_write(fd, wt, BLOCK_SIZE);
+    fs_close(fd);
+    umount_fs("count:disk.23");
+    if (count_writes == 0)
+        return FAIL;
+    disk_ram_free("disk.23");
+
+    return PASS;
+}
+
+static int test24(void)
+{
+    int fd;
+    static char wt[DEFAULT_BLOCK_SIZE * 16];
+    op_stats st[OP_COUNT];
+    slow_config slow = {.latency_us = 300, .queue_depth = 1};
+    unsigned long long t;
+
+    memset(wt, 'l', sizeof(wt));
+    if (disk_slow_config(&slow) != 0)
+        return FAIL;
+
+    make_fs("slow:ram:disk.24");
+    mount_fs("slow:ram:disk.24");
+    fs_create("slow.24");
+    fd = fs_open("slow.24");
+    fs_write(fd, wt, BLOCK_SIZE * 4);
+
+    /* every run that misses the cache pays the latency */
+    dropCache();
+    fs_stats_reset();
+    fs_lseek(fd, 0);
+    fs_read(fd, wt, BLOCK_SIZE * 4);
+    fs_stats(st);
+    if (st[OP_BLOCKS_READ].calls == 0 || st[OP_BLOCKS_READ].p50_ns < 300000)
+        return FAIL;
+
+    /* 16 blocks at 64 MB/s take a millisecond on top of the latency */
+    slow.latency_us = 0;
+    slow.bandwidth_mb = 64;
+    slow.jitter = SLOW_JITTER_EXPONENTIAL;
+    slow.jitter_us = 100;
+    disk_slow_config(&slow);
+    t = statClock();
+    if (blocks_write(5000, 16, wt) != 0 || statClock() - t < 16ULL * BLOCK_SIZE * 1000 / 64)
+        return FAIL;
+
+    slow.jitter = 7;
+    if (disk_slow_config(&slow) != -1)
+        return FAIL;
+
+    fs_close(fd);
+    umount_fs("slow:ram:disk.24");
+    disk_ram_free("disk.24");
+    return PASS;
+}
+
+static int test25(void)
+{
+    int fd, f;
+    static char wt[DEFAULT_BLOCK_SIZE * 50 + 123], rd[DEFAULT_BLOCK_SIZE * 50 + 123];
+    static char raw[DEFAULT_BLOCK_SIZE], blk[DEFAULT_BLOCK_SIZE];
+    struct stat st;
+
+    for (int i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i % 251);
+
+    /* three members with 4 block stripe units */
+    if (make_fs("stripe:4:disk.25a,disk.25b,disk.25c") != 0 || mount_fs("stripe:4:disk.25a,disk.25b,disk.25c") != 0)
+        return FAIL;
+    fs_create("wide.25");
+    fd = fs_open("wide.25");
+    if (fs_write(fd, wt, sizeof(wt)) != sizeof(wt))
+        return FAIL;
+    fs_lseek(fd, 0);
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(rd) || memcmp(wt, rd, sizeof(rd)))
+        return FAIL;
+    fs_close(fd);
+
+    /* disk block 4 is the first block of the second member */
+    block_read(4, blk);
+    umount_fs("stripe:4:disk.25a,disk.25b,disk.25c");
+    if (stat("disk.25b", &st) != 0 || st.st_size != (8192 / 4 + 2) / 3 * 4 * BLOCK_SIZE)
+        return FAIL;
+    f = open("disk.25b", O_RDONLY);
+    pread(f, raw, BLOCK_SIZE, 0);
+    close(f);
+    if (memcmp(raw, blk, BLOCK_SIZE))
+        return FAIL;
+
+    if (mount_fs("stripe:4:disk.25a,disk.25b,disk.25c") != 0)
+        return FAIL;
+    fd = fs_open("wide.25");
+    memset(rd, 0, sizeof(rd));
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(rd) || memcmp(wt, rd, sizeof(rd)))
+        return FAIL;
+    fs_close(fd);
+    umount_fs("stripe:4:disk.25a,disk.25b,disk.25c");
+
+    if (mount_fs("stripe:4:disk.25a,none.25") != -1 || make_fs("stripe:0:disk.25a") != -1)
+        return FAIL;
+
+    remove("disk.25a");
+    remove("disk.25b");
+    remove("disk.25c");
+    return PASS;
+}
+
+// mirror test
+//==============================================================================
+/* a copy of an image as it is now, the way a backup would keep it */
+static int copyImage(char *from, char *to)
+{
+    static char buf[DEFAULT_BLOCK_SIZE];
+    int in, out, rtn = 0;
+    ssize_t n;
+
+    if ((in = open(from, O_RDONLY)) < 0)
+        return -1;
+    if ((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        close(in);
+        return -1;
+    }
+    while ((n = read(in, buf, sizeof(buf))) > 0)
+    {
+        if (write(out, buf, n) != n)
+            rtn = -1;
+    }
+    close(in);
+    close(out);
+    return n < 0 ? -1 : rtn;
+}
+
+static int test26(void)
+{
+    int fd, f, head, repairs;
+    static char wt[DEFAULT_BLOCK_SIZE * 20], rd[DEFAULT_BLOCK_SIZE * 20];
+    char a[BLOCK_SIZE], b[BLOCK_SIZE];
+    char *mirror = "mirror:1:disk.26a,disk.26b";
+
+    for (int i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i % 253);
+
+    /* one block units, so block n is read from copy n % 2 */
+    if (make_fs(mirror) != 0 || mount_fs(mirror) != 0 || disk_copies() != 2)
+        return FAIL;
+    fs_create("file.26");
+    fd = fs_open("file.26");
+    if (fs_write(fd, wt, sizeof(wt)) != sizeof(wt))
+        return FAIL;
+    head = dir_pointer[META[fd].file].head;
+    fs_close(fd);
+    umount_fs(mirror);
+
+    /* damage the copy the head block is read from, and the first super block */
+    f = open(head % 2 ? "disk.26b" : "disk.26a", O_RDWR);
+    pwrite(f, "x", 1, (off_t)head * BLOCK_SIZE + 100);
+    close(f);
+    f = open("disk.26a", O_RDWR);
+    pwrite(f, "x", 1, 0);
+    close(f);
+
+    if (mount_fs(mirror) != 0 || fs_checksum_repairs() != 1)
+        return FAIL;
+    fd = fs_open("file.26");
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(rd) || memcmp(wt, rd, sizeof(rd)) || fs_checksum_repairs() != 2)
+        return FAIL;
+
+    /* the good copy was written back over the bad one */
+    if (blocks_read_copy(0, head, 1, a) != 0 || blocks_read_copy(1, head, 1, b) != 0 || memcmp(a, b, BLOCK_SIZE))
+        return FAIL;
+
+    /* a copy that is gone leaves the reads to the other one */
+    if (copyImage("disk.26b", "disk.26c") != 0)
+        return FAIL;
+    truncate("disk.26b", 0);
+    dropCache();
+    fs_lseek(fd, 0);
+    memset(rd, 0, sizeof(rd));
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(rd) || memcmp(wt, rd, sizeof(rd)) || disk_mirror_failovers() == 0)
+        return FAIL;
+
+    /* writes after the drop reach only the copy in use */
+    fs_lseek(fd, 0);
+    memset(wt, 'n', BLOCK_SIZE * 2);
+    if (fs_write(fd, wt, BLOCK_SIZE * 2) != BLOCK_SIZE * 2)
+        return FAIL;
+    fs_close(fd);
+    umount_fs(mirror);
+
+    /* the dropped copy comes back stale, and is brought up to date before it serves a read */
+    rename("disk.26c", "disk.26b");
+    repairs = fs_checksum_repairs();
+    if (mount_fs(mirror) != 0 || disk_mirror_resyncs() != 1)
+        return FAIL;
+    fd = fs_open("file.26");
+    memset(rd, 0, sizeof(rd));
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(rd) || memcmp(wt, rd, sizeof(rd)) || fs_checksum_repairs() != repairs)
+        return FAIL;
+    if (blocks_read_copy(0, head, 1, a) != 0 || blocks_read_copy(1, head, 1, b) != 0 || memcmp(a, b, BLOCK_SIZE))
+        return FAIL;
+    fs_close(fd);
+    umount_fs(mirror);
+
+    /* once in step, the next open copies nothing */
+    if (mount_fs(mirror) != 0 || disk_mirror_resyncs() != 1)
+        return FAIL;
+    umount_fs(mirror);
+
+    if (mount_fs("mirror:disk.26a,none.26") != -1)
+        return FAIL;
+
+    remove("disk.26a");
+    remove("disk.26b");
+    return PASS;
+}
+
+// metadata journal test
+//==============================================================================
+static int test27(void)
+{
+    int fd, f;
+    char name[16];
+    static char wt[DEFAULT_BLOCK_SIZE * 3 + 10], rd[DEFAULT_BLOCK_SIZE * 3 + 10];
+    char home[BLOCK_SIZE];
+    journal_stats js;
+    fsck_report r;
+
+    for (int i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i % 247);
+
+    journal_window = 60ULL * 1000000000; // the groups below close by count, not by age
+    make_fs("disk.27");
+    mount_fs("disk.27");
+
+    /* JOURNAL_GROUP operations share one commit */
+    for (int i = 0; i < JOURNAL_GROUP; i++)
+    {
+        sprintf(name, "g%d.27", i);
+        fs_create(name);
+    }
+    if (fs_journal_stats(&js) != 0 || js.operations != JOURNAL_GROUP || js.commits != 1)
+        return FAIL;
+
+    fs_create("a.27");
+    fd = fs_open("a.27");
+    fs_write(fd, wt, sizeof(wt));
+    fs_close(fd);
+    if (fs_sync() != 0 || fs_journal_stats(&js) != 0 || js.commits != 2)
+        return FAIL;
+
+    /* crash: nothing went home, the log holds it all */
+    crash();
+    f = open("disk.27", O_RDONLY);
+    pread(f, home, BLOCK_SIZE, (off_t)1 * BLOCK_SIZE);
+    close(f);
+    if (((file_info *)home)[0].used || fsck_image("disk.27", 1, 0, &r) != 0 || r.journal_pending != 2)
+        return FAIL;
+
+    if (mount_fs("disk.27") != 0 || fs_journal_stats(&js) != 0 || js.replayed != 2)
+        return FAIL;
+    fd = fs_open("a.27");
+    if (fd < 0 || fs_read(fd, rd, sizeof(rd)) != sizeof(rd) || memcmp(wt, rd, sizeof(rd)))
+        return FAIL;
+    fs_close(fd);
+    if (fs_open("g31.27") < 0 || fs_checksum_errors() != 0)
+        return FAIL;
+    umount_fs("disk.27");
+
+    if (fsck_image("disk.27", 1, 0, &r) != 0 || r.journal_pending != 0 || r.files != JOURNAL_GROUP + 1)
+        return FAIL;
+
+    /* a group that nothing else joins is committed once its window closes */
+    journal_window = JOURNAL_WINDOW_NS;
+    mount_fs("disk.27");
+    fs_create("late.27");
+    for (int i = 0; i < 100 && fs_journal_stats(&js) == 0 && js.timed == 0; i++)
+        usleep(JOURNAL_WINDOW_NS / 1000);
+    if (js.timed != 1 || js.commits != 1)
+        return FAIL;
+    crash();
+    if (mount_fs("disk.27") != 0 || fs_open("late.27") < 0)
+        return FAIL;
+    umount_fs("disk.27");
+    return PASS;
+}
+
+// fs_sync and fs_fsync test
+//==============================================================================
+static int test28(void)
+{
+    int fd, fd2, home;
+    static char wt[DEFAULT_BLOCK_SIZE * 2], rd[DEFAULT_BLOCK_SIZE * 2];
+    journal_stats js;
+
+    memset(wt, 's', sizeof(wt));
+    journal_window = 60ULL * 1000000000; // only the syncs below commit
+
+    make_fs("disk.28");
+    mount_fs("disk.28");
+    fs_create("a.28");
+    fd = fs_open("a.28");
+    fs_write(fd, wt, sizeof(wt));
+
+    /* the write is committed early, a second fsync finds nothing to do */
+    if (fs_fsync(fd) != 0 || fs_fsync(fd) != 0 || fs_journal_stats(&js) != 0 || js.commits != 1 || js.syncs != 1)
+        return FAIL;
+
+    /* an overwrite in place only changes a checksum */
+    fs_lseek(fd, 0);
+    fs_write(fd, "S", 1);
+    if (fs_fsync(fd) != 0 || fs_journal_stats(&js) != 0 || js.syncs != 2)
+        return FAIL;
+
+    /* another file's data needs no flush for this one, a new name does */
+    fs_create("b.28");
+    fd2 = fs_open("b.28");
+    if (fs_fsync(fd) != 0 || fs_journal_stats(&js) != 0 || js.syncs != 3)
+        return FAIL;
+    if (fs_write(fd2, wt, 10) != 10 || fs_fsync(fd) != 0 || fs_journal_stats(&js) != 0 || js.syncs != 3)
+        return FAIL;
+    if (fs_fsync(fd2) != 0 || fs_sync() != 0 || fs_journal_stats(&js) != 0 || js.syncs != 4)
+        return FAIL;
+    if (fs_fsync(-1) != -1 || fs_fsync(MAX_FILE_DESCRIPTOR) != -1)
+        return FAIL;
+
+    /* a full group commits on its own, and the data block rewritten in
+       place goes home after it: fsync still has to flush that */
+    for (int i = 0; i < JOURNAL_GROUP; i++)
+    {
+        fs_lseek(fd, 1);
+        fs_write(fd, "x", 1);
+    }
+    if (fs_journal_stats(&js) != 0 || js.commits != 5 || fs_fsync(fd) != 0 || fs_journal_stats(&js) != 0 ||
+        js.syncs != 5)
+        return FAIL;
+
+    /* crash after the sync: everything synced is there */
+    crash();
+    if (mount_fs("disk.28") != 0)
+        return FAIL;
+    fd = fs_open("a.28");
+    wt[0] = 'S';
+    wt[1] = 'x';
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(rd) || memcmp(wt, rd, sizeof(rd)) || fs_get_filesize(fs_open("b.28")) != 10)
+        return FAIL;
+
+    /* unmounting writes home only the blocks that changed, the data block
+       rewritten in place among them */
+    fs_lseek(fd, 0);
+    fs_write(fd, "s", 1);
+    fs_journal_stats(&js);
+    home = js.blocks_home;
+    umount_fs("disk.28");
+    if (fs_journal_stats(&js) != 0 || js.blocks_home == home || js.blocks_home > home + 3)
+        return FAIL;
+    return PASS;
+}
+
+static int fail_writes;
+
+static int failingWrite(int block, char *buf)
+{
+    return fail_writes ? -1 : disk_file.write(block, buf);
+}
+
+static int failingWritev(int block, int count, char *buf)
+{
+    return fail_writes ? -1 : disk_file.writev(block, count, buf);
+}
+
+static int test29(void)
+{
+    int fd;
+    static char wt[DEFAULT_BLOCK_SIZE * 16], rd[DEFAULT_BLOCK_SIZE * 16];
+    writeback_config wc = {256, 1024, 60000, 1000};
+    writeback_stats ws;
+    disk_backend failing = disk_file;
+
+    for (int i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i * 7 + i / BLOCK_SIZE);
+    journal_window = 60ULL * 1000000000; // a commit would drain the pool
+
+    wc.dirty_max_kb = 1;
+    if (disk_writeback(&wc) != -1)
+        return FAIL;
+    wc.dirty_max_kb = 1024;
+    if (disk_writeback(&wc) != 0)
+        return FAIL;
+
+    /* the blocks stay in memory, reads see them there */
+    make_fs("disk.29");
+    mount_fs("disk.29");
+    fs_create("a.29");
+    fd = fs_open("a.29");
+    if (fs_write(fd, wt, sizeof(wt)) != sizeof(wt) || disk_writeback_stats(&ws) != 0 || ws.absorbed == 0 || ws.dirty_blocks == 0)
+        return FAIL;
+    dropCache();
+    fs_lseek(fd, 0);
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(rd) || memcmp(wt, rd, sizeof(rd)))
+        return FAIL;
 
-    int status;
-    pid_t pid;
-    char disk[10];
-    int pipe_fd[2];
-    struct pollfd poll_fds;
-    int score = 0;
-    int total_score = 0;
+    /* a sync drains them, adjacent blocks in one transfer */
+    if (fs_sync() != 0 || disk_writeback_stats(&ws) != 0 || ws.dirty_blocks != 0 || ws.flushed == 0 || ws.runs >= ws.flushed)
+        return FAIL;
 
-    int devnull_fd = open("/dev/null", O_WRONLY);
+    /* a pool smaller than the write holds the writer back */
+    wc.dirty_kb = wc.dirty_max_kb = (BLOCK_SIZE * 4) / 1024;
+    if (disk_writeback(&wc) != 0)
+        return FAIL;
+    fs_create("b.29");
+    fd = fs_open("b.29");
+    memset(wt, 'w', sizeof(wt));
+    if (fs_write(fd, wt, sizeof(wt)) != sizeof(wt) || disk_writeback_stats(&ws) != 0 || ws.throttled == 0)
+        return FAIL;
 
-    pipe(pipe_fd);
-    poll_fds.fd = pipe_fd[0];     // only going to poll the read end of our pipe
-    poll_fds.events = POLLRDNORM; // only care about normal read operations
+    /* unmounting leaves nothing behind in memory */
+    umount_fs("disk.29");
+    if (disk_writeback(NULL) != 0 || disk_writeback_stats(&ws) != 0 || ws.dirty_blocks != 0)
+        return FAIL;
+    mount_fs("disk.29");
+    fd = fs_open("b.29");
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(rd) || memcmp(wt, rd, sizeof(rd)))
+        return FAIL;
+    umount_fs("disk.29");
+
+    /* blocks the device fails stay dirty: the sync reports it, the next
+       one writes them */
+    failing.write = failingWrite;
+    failing.writev = failingWritev;
+    wc.dirty_kb = 256;
+    wc.dirty_max_kb = 1024;
+    if (disk_register("failing:", &failing) != 0 || disk_writeback(&wc) != 0 || make_fs("failing:disk.29") != 0 ||
+        mount_fs("failing:disk.29") != 0)
+        return FAIL;
+    fs_create("c.29");
+    fd = fs_open("c.29");
+    memset(wt, 'f', sizeof(wt));
+    fail_writes = 1;
+    if (fs_write(fd, wt, sizeof(wt)) != sizeof(wt) || fs_sync() != -1 || disk_writeback_stats(&ws) != 0 ||
+        ws.failed == 0 || ws.dirty_blocks == 0)
+        return FAIL;
+    fail_writes = 0;
+    if (fs_sync() != 0 || disk_writeback_stats(&ws) != 0 || ws.dirty_blocks != 0)
+        return FAIL;
+    umount_fs("failing:disk.29");
 
-    for (int i = 0; i < NUM_TESTS; i++)
+    /* blocks far apart go out one run each, the clean ones in between
+       are not visited */
+    int far[] = {1, 63, 64, 4095, 4097, DISK_BLOCKS - 1};
+    writeback_stats w0;
+    if (make_disk("ram:far.29") != 0 || open_disk("ram:far.29") < 0 || disk_writeback_stats(&w0) != 0)
+        return FAIL;
+    for (int i = 0; i < (int)(sizeof(far) / sizeof(far[0])); i++)
+        block_write(far[i], wt);
+    if (disk_flush() != 0 || disk_writeback_stats(&ws) != 0 || ws.dirty_blocks != 0 ||
+        ws.flushed - w0.flushed != 6 || ws.runs - w0.runs != 5)
+        return FAIL;
+    close_disk();
+    disk_ram_free("far.29");
+
+    if (disk_writeback(NULL) != 0 || mount_fs("disk.29") != 0)
+        return FAIL;
+    fd = fs_open("c.29");
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(rd) || memcmp(wt, rd, sizeof(rd)))
+        return FAIL;
+    umount_fs("disk.29");
+    return PASS;
+}
+
+static int test30(void)
+{
+    int fd;
+    static char wt[DEFAULT_BLOCK_SIZE * 4], rd[DEFAULT_BLOCK_SIZE * 16], big[DEFAULT_BLOCK_SIZE * 16];
+    ioqueue_stats q0, q;
+
+    for (int i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)('a' + i / BLOCK_SIZE);
+    for (int i = 0; i < (int)sizeof(big); i++)
+        big[i] = (char)(i * 13);
+
+    make_fs("ram:disk.30");
+    mount_fs("ram:disk.30");
+
+    /* four writes out of order and a rewrite go down as one transfer */
+    disk_queue_stats(&q0);
+    disk_plug();
+    block_write(7003, wt + 3 * BLOCK_SIZE);
+    block_write(7001, wt);
+    block_write(7002, wt + 2 * BLOCK_SIZE);
+    block_write(7000, wt);
+    block_write(7001, wt + BLOCK_SIZE);
+    if (block_read(7002, rd) != 0 || memcmp(rd, wt + 2 * BLOCK_SIZE, BLOCK_SIZE))
+        return FAIL;
+
+    /* an inner unplug leaves the queue alone */
+    disk_plug();
+    if (disk_unplug() != 0 || disk_queue_stats(&q) != 0 || q.pending != 4)
+        return FAIL;
+    if (disk_unplug() != 0 || disk_queue_stats(&q) != 0 || q.pending != 0 || q.transfers != q0.transfers + 1 ||
+        q.submitted != q0.submitted + 4 || q.absorbed != q0.absorbed + 1 || q.read_hits == q0.read_hits)
+        return FAIL;
+    if (blocks_read(7000, 4, rd) != 0 || memcmp(rd + BLOCK_SIZE, wt + BLOCK_SIZE, BLOCK_SIZE * 3))
+        return FAIL;
+
+    /* a flush does not wait for the unplug */
+    disk_plug();
+    block_write(7004, wt);
+    if (disk_flush() != 0 || disk_queue_stats(&q) != 0 || q.pending != 0 || disk_unplug() != 0)
+        return FAIL;
+
+    /* the file system plugs around its operations */
+    fs_create("a.30");
+    fd = fs_open("a.30");
+    disk_queue_stats(&q0);
+    if (fs_write(fd, big, sizeof(big)) != sizeof(big) || disk_queue_stats(&q) != 0 || q.queued == q0.queued || q.pending != 0)
+        return FAIL;
+    fs_close(fd);
+    umount_fs("ram:disk.30");
+    mount_fs("ram:disk.30");
+    fd = fs_open("a.30");
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(rd) || memcmp(big, rd, sizeof(rd)))
+        return FAIL;
+    umount_fs("ram:disk.30");
+    disk_ram_free("disk.30");
+    return PASS;
+}
+
+static int test31(void)
+{
+    int fd, f;
+    char name[16];
+    static char wt[DEFAULT_BLOCK_SIZE * 3];
+    op_stats st[OP_COUNT];
+    fsck_report r;
+
+    memset(wt, 'm', sizeof(wt));
+
+    /* make_fs stores summaries, mount takes them without a rebuild */
+    make_fs("disk.31");
+    fs_stats_reset();
+    mount_fs("disk.31");
+    for (int i = 0; i < 40; i++)
+    {
+        sprintf(name, "f%d.31", i);
+        fs_create(name);
+        fd = fs_open(name);
+        fs_write(fd, wt, (i % 3 + 1) * BLOCK_SIZE);
+        fs_close(fd);
+    }
+    for (int i = 0; i < 40; i += 4)
+    {
+        sprintf(name, "f%d.31", i);
+        fs_delete(name);
+    }
+    if (fs_stats(st) != 0 || st[OP_SUMMARY_BUILD].calls != 0)
+        return FAIL;
+
+    /* the name index finds what is left, and nothing that was deleted */
+    for (int i = 0; i < 40; i++)
+    {
+        sprintf(name, "f%d.31", i);
+        fd = fs_open(name);
+        if ((fd == -1) != (i % 4 == 0) || (fd != -1 && fs_get_filesize(fd) != (i % 3 + 1) * BLOCK_SIZE))
+            return FAIL;
+        fs_close(fd);
+    }
+    umount_fs("disk.31");
+
+    /* the summaries stored at umount agree with the map and the directory */
+    if (fsck_image("disk.31", 2, 0, &r) != 0 || r.bad_summary != 0)
+        return FAIL;
+    fs_stats_reset();
+    mount_fs("disk.31");
+    fs_create("new.31");
+    if (fs_open("f5.31") == -1 || fs_stats(st) != 0 || st[OP_SUMMARY_BUILD].calls != 0)
+        return FAIL;
+    umount_fs("disk.31");
+
+    /* a damaged summary is rebuilt the first time it is needed */
+    f = open("disk.31", O_RDWR);
+    pwrite(f, "x", 1, SUMMARY_OFFSET + 8);
+    close(f);
+    fs_stats_reset();
+    mount_fs("disk.31");
+    if (fs_open("f7.31") == -1 || fs_open("f8.31") != -1 || fs_stats(st) != 0 || st[OP_SUMMARY_BUILD].calls != 1)
+        return FAIL;
+
+    /* so is one a replay went past */
+    fs_create("late.31");
+    journalCommit();
+    crash();
+    fs_stats_reset();
+    mount_fs("disk.31");
+    if (fs_open("late.31") == -1 || fs_stats(st) != 0 || st[OP_SUMMARY_BUILD].calls != 1)
+        return FAIL;
+    umount_fs("disk.31");
+    if (fsck_image("disk.31", 2, 0, &r) != 0 || r.bad_summary != 0)
+        return FAIL;
+    return PASS;
+}
+
+/* fs_statfs agrees with a scan of the map */
+static int statfsMatches(int files)
+{
+    statfs_info sf;
+    frag_stats fr;
+    int free_blocks = 0;
+
+    for (int i = 0; i < DISK_BLOCKS; i++)
+        free_blocks += MAP[i] == 0;
+    return fs_statfs(&sf) == 0 && fs_frag_stats(&fr) == 0 && sf.free_blocks == free_blocks &&
+           sf.used_blocks + sf.free_blocks == DISK_BLOCKS && sf.total_blocks == DISK_BLOCKS &&
+           sf.largest_free == fr.largest_free && sf.files == files && sf.free_files == MAX_FILE - files;
+}
+
+static int test32(void)
+{
+    int fd, fd2;
+    static char wt[DEFAULT_BLOCK_SIZE * 40];
+    statfs_info sf;
+
+    for (int i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i / 100);
+
+    if (fs_statfs(&sf) != -1)
+        return FAIL;
+    make_fs("disk.32");
+    mount_fs("disk.32");
+    if (!statfsMatches(0) || fs_statfs(NULL) != -1 || fs_statfs(&sf) != 0 || sf.block_size != BLOCK_SIZE)
+        return FAIL;
+
+    /* chain, packed, compressed and deduplicated files */
+    fs_create("chain.32");
+    fd = fs_open("chain.32");
+    fs_write(fd, wt, sizeof(wt));
+    fs_create("small.32");
+    fd2 = fs_open("small.32");
+    fs_write(fd2, wt, 100);
+    fs_close(fd2);
+    fs_create("comp.32");
+    fd2 = fs_open("comp.32");
+    fs_set_compression(fd2, True);
+    fs_write(fd2, wt, sizeof(wt));
+    fs_close(fd2);
+    fs_create("dedup.32");
+    fd2 = fs_open("dedup.32");
+    fs_set_dedup(fd2, True);
+    fs_write(fd2, wt, sizeof(wt));
+    fs_write(fd2, wt, sizeof(wt));
+    fs_close(fd2);
+    if (!statfsMatches(4))
+        return FAIL;
+
+    /* snapshots hold blocks, truncate and delete give them back */
+    fs_close(fd);
+    if (fs_snapshot() < 0 || !statfsMatches(4))
+        return FAIL;
+    fd = fs_open("chain.32");
+    fs_truncate(fd, BLOCK_SIZE * 3);
+    fs_close(fd);
+    fs_delete("comp.32");
+    if (!statfsMatches(3) || fs_snapshot_delete(0) != 0 || !statfsMatches(3))
+        return FAIL;
+    fs_defrag(1000);
+    if (!statfsMatches(3))
+        return FAIL;
+
+    /* the counts come back with the mount */
+    fs_statfs(&sf);
+    umount_fs("disk.32");
+    mount_fs("disk.32");
+    statfs_info again;
+    if (fs_statfs(&again) != 0 || memcmp(&sf, &again, sizeof(sf)) || !statfsMatches(3))
+        return FAIL;
+    umount_fs("disk.32");
+    return PASS;
+}
+
+static int test33(void)
+{
+    int fd, fd2, g;
+    static char wt[DEFAULT_BLOCK_SIZE * 64], rd[DEFAULT_BLOCK_SIZE * 64];
+    int shapes[2][3] = {{65536, 512, 20}, {4096, 20000, 40}}; // one map block, five
+    statfs_info sf;
+    fsck_report r;
+
+    for (int i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i * 7 / 3);
+
+    /* the small blocks the disk layer takes but the file system does not,
+       a block size that is no power of two, no room for data, a map too
+       big for one transaction */
+    if (make_fs_geometry("disk.33", 512, 8192) != -1 || make_fs_geometry("disk.33", 1024, 8192) != -1 ||
+        make_fs_geometry("disk.33", 2048, 8192) != -1 || make_fs_geometry("disk.33", 6000, 8192) != -1 ||
+        make_fs_geometry("disk.33", 4096, 160) != -1 || make_fs_geometry("disk.33", 4096, 1 << 20) != -1)
+        return FAIL;
+
+    /* a make or a mount that fails leaves the geometry as it was */
+    disk_set_geometry(DEFAULT_BLOCK_SIZE, DEFAULT_DISK_BLOCKS);
+    if (make_fs_geometry("no.dir.33/disk.33", 65536, 512) != -1 || BLOCK_SIZE != DEFAULT_BLOCK_SIZE ||
+        make_fs_geometry("disk.33", 65536, 512) != 0)
+        return FAIL;
     {
-        score = 0;
-        pid = fork();
+        super_block sb;
+        int f = open("disk.33", O_RDWR);
+        if (f < 0 || pread(f, &sb, sizeof(sb), 0) != sizeof(sb) ||
+            pwrite(f, &sb, sizeof(sb), (off_t)sb.crc_index * 65536) != sizeof(sb))
+            return FAIL; // a checksum table the super block does not vouch for
+        close(f);
+    }
+    disk_set_geometry(DEFAULT_BLOCK_SIZE, DEFAULT_DISK_BLOCKS);
+    if (mount_fs("disk.33") != -1 || BLOCK_SIZE != DEFAULT_BLOCK_SIZE || DISK_BLOCKS != DEFAULT_DISK_BLOCKS)
+        return FAIL;
 
-        // child, launches the test
-        if (pid == 0)
+    for (g = 0; g < 2; g++)
+    {
+        if (make_fs_geometry("disk.33", shapes[g][0], shapes[g][1]) != 0)
+            return FAIL;
+        disk_set_geometry(DEFAULT_BLOCK_SIZE, DEFAULT_DISK_BLOCKS); // mount has to find it
+        if (mount_fs("disk.33") != 0 || BLOCK_SIZE != shapes[g][0] || DISK_BLOCKS != shapes[g][1] ||
+            !statfsMatches(0))
+            return FAIL;
+
+        /* chain files past the first map block, a packed and a compressed one */
+        fs_create("chain.33");
+        fs_create("chain2.33");
+        fd = fs_open("chain.33");
+        fd2 = fs_open("chain2.33");
+        for (int k = 0; k < shapes[g][2]; k++)
         {
+            fs_write(fd, wt, sizeof(wt));
+            fs_write(fd2, wt, sizeof(wt));
+        }
+        fs_close(fd);
+        fs_close(fd2);
+        fs_create("small.33");
+        fd = fs_open("small.33");
+        fs_write(fd, wt, 100);
+        fs_close(fd);
+        fs_create("comp.33");
+        fd = fs_open("comp.33");
+        fs_set_compression(fd, True);
+        fs_write(fd, wt, sizeof(wt));
+        fs_close(fd);
+        if (fs_snapshot() < 0 || !statfsMatches(4))
+            return FAIL;
+        umount_fs("disk.33");
+
+        disk_set_geometry(DEFAULT_BLOCK_SIZE, DEFAULT_DISK_BLOCKS);
+        if (mount_fs("disk.33") != 0 || fs_statfs(&sf) != 0 || sf.block_size != shapes[g][0] ||
+            sf.total_blocks != shapes[g][1] || !statfsMatches(4))
+            return FAIL;
+        fd = fs_open("chain2.33");
+        if (fs_get_filesize(fd) != shapes[g][2] * (int)sizeof(wt))
+            return FAIL;
+        fs_lseek(fd, (shapes[g][2] - 1) * sizeof(wt));
+        if (fs_read(fd, rd, sizeof(rd)) != (int)sizeof(rd) || memcmp(wt, rd, sizeof(wt)))
+            return FAIL;
+        fs_close(fd);
+        fd = fs_open("comp.33");
+        if (fs_read(fd, rd, sizeof(rd)) != (int)sizeof(rd) || memcmp(wt, rd, sizeof(wt)))
+            return FAIL;
+        fs_close(fd);
+        fd = fs_open("small.33");
+        if (fs_read(fd, rd, 100) != 100 || memcmp(wt, rd, 100))
+            return FAIL;
+        fs_close(fd);
+        umount_fs("disk.33");
+
+        if (fsck_image("disk.33", 2, 0, &r) != 0 || r.files != 4 || r.snapshots != 1)
+            return FAIL;
+    }
+    return PASS;
+}
+
+/* a make that leaves the old contents behind, as a reused device would */
+static int dirtyMake(char *name)
+{
+    char buf[DEFAULT_BLOCK_SIZE];
+    int f;
+
+    if (disk_file.make(name) == -1 || (f = open(name, O_WRONLY)) < 0)
+        return -1;
+    memset(buf, 0xa5, sizeof(buf));
+    for (int i = 0; i < DISK_BLOCKS; i++)
+        write(f, buf, BLOCK_SIZE);
+    close(f);
+    return 0;
+}
+
+static int test34(void)
+{
+    int fd;
+    static char wt[DEFAULT_BLOCK_SIZE * 3], rd[DEFAULT_BLOCK_SIZE * 3];
+    disk_backend dirty = disk_file;
+    struct stat st;
+    fsck_report r;
+
+    for (int i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i * 5);
+
+    /* an image is made sparse, or with its blocks allocated */
+    if (make_fs("disk.34") != 0 || stat("disk.34", &st) != 0 ||
+        st.st_size != (off_t)DEFAULT_BLOCK_SIZE * DEFAULT_DISK_BLOCKS || st.st_blocks * 512 >= st.st_size)
+        return FAIL;
+    disk_preallocate = 1;
+    if (make_fs("disk.34") != 0 || stat("disk.34", &st) != 0 ||
+        st.st_size != (off_t)DEFAULT_BLOCK_SIZE * DEFAULT_DISK_BLOCKS)
+        return FAIL;
+    disk_preallocate = 0;
+
+    /* nothing of the file system relies on blocks it did not write */
+    dirty.make = dirtyMake;
+    if (disk_register("dirty:", &dirty) != 0 || make_fs("dirty:disk.34") != 0 ||
+        mount_fs("dirty:disk.34") != 0 || !statfsMatches(0))
+        return FAIL;
+    fs_create("file.34");
+    fd = fs_open("file.34");
+    if (fs_write(fd, wt, sizeof(wt)) != sizeof(wt))
+        return FAIL;
+    fs_close(fd);
+    if (fs_snapshot() < 0 || !statfsMatches(1))
+        return FAIL;
+    umount_fs("dirty:disk.34");
+
+    if (mount_fs("disk.34") != 0 || !statfsMatches(1))
+        return FAIL;
+    fd = fs_open("file.34");
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(rd) || memcmp(wt, rd, sizeof(rd)))
+        return FAIL;
+    fs_close(fd);
+    umount_fs("disk.34");
+    if (fsck_image("disk.34", 2, 0, &r) != 0 || r.files != 1 || r.snapshots != 1)
+        return FAIL;
+    return PASS;
+}
+
+static int test35(void)
+{
+    int i, fa, fb, fc, ff;
+    static char wt[DEFAULT_BLOCK_SIZE * 320], rd[DEFAULT_BLOCK_SIZE * 320];
+    fsck_report r;
+
+    for (i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i * 3 + i / DEFAULT_BLOCK_SIZE);
+
+    /* a run in front, two files taking turns, a one-block file, and the
+       rest of the disk full behind them */
+    make_fs("disk.35");
+    mount_fs("disk.35");
+    fs_create("front.35");
+    ff = fs_open("front.35");
+    fs_write(ff, wt, BLOCK_SIZE * 64);
+    fs_close(ff);
+    fs_create("a.35");
+    fs_create("b.35");
+    fa = fs_open("a.35");
+    fb = fs_open("b.35");
+    for (i = 0; i < 300; i++)
+    {
+        fs_write(fa, wt + i * BLOCK_SIZE, BLOCK_SIZE);
+        fs_write(fb, wt + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    fs_close(fb);
+    fs_create("c.35");
+    fc = fs_open("c.35");
+    fs_write(fc, rd, BLOCK_SIZE);
+    fs_create("fill.35");
+    ff = fs_open("fill.35");
+    while (fs_write(ff, wt, BLOCK_SIZE * 16) == BLOCK_SIZE * 16)
+        ;
+    while (fs_write(ff, wt, BLOCK_SIZE) == BLOCK_SIZE)
+        ;
+    fs_close(ff);
+    fs_delete("front.35");
+    fs_delete("b.35");
+
+    /* growing c moves it into the run, and the write lands where it went */
+    fs_lseek(fc, 0);
+    if (fs_write(fc, wt, BLOCK_SIZE * 2) != BLOCK_SIZE * 2)
+        return FAIL;
+    fs_lseek(fc, 0);
+    if (fs_read(fc, rd, BLOCK_SIZE * 2) != BLOCK_SIZE * 2 || memcmp(rd, wt, BLOCK_SIZE * 2))
+        return FAIL;
+
+    /* a has no room behind it and no run to move to: it grows into the
+       blocks b left between its own */
+    if (fs_write(fa, wt + 300 * BLOCK_SIZE, BLOCK_SIZE * 4) != BLOCK_SIZE * 4 ||
+        fs_write(fa, wt + 304 * BLOCK_SIZE, 100) != 100)
+        return FAIL;
+
+    /* once the disk is full, a write that needs a block fails and changes nothing */
+    ff = fs_open("fill.35");
+    fs_lseek(ff, fs_get_filesize(ff));
+    while (fs_write(ff, wt, BLOCK_SIZE) == BLOCK_SIZE)
+        ;
+    fs_close(ff);
+    if (fs_write(fa, wt, BLOCK_SIZE) != -1 || !statfsMatches(3))
+        return FAIL;
+    fs_lseek(fa, 0);
+    if (fs_read(fa, rd, sizeof(rd)) != 304 * BLOCK_SIZE + 100 || memcmp(rd, wt, 304 * BLOCK_SIZE + 100))
+        return FAIL;
+    fs_close(fa);
+    fs_close(fc);
+    umount_fs("disk.35");
+
+    if (fsck_image("disk.35", 2, 0, &r) != 0 || r.files != 3)
+        return FAIL;
+    mount_fs("disk.35");
+    fa = fs_open("a.35");
+    if (fs_read(fa, rd, sizeof(rd)) != 304 * BLOCK_SIZE + 100 || memcmp(rd, wt, 304 * BLOCK_SIZE + 100))
+        return FAIL;
+    fs_close(fa);
+    umount_fs("disk.35");
+    return PASS;
+}
+
+// crash test
+//==============================================================================
+static int test36(void)
+{
+    int fd, f, head, errors;
+    static char wt[DEFAULT_BLOCK_SIZE * 16], rd[DEFAULT_BLOCK_SIZE * 16];
+    fsck_report r;
+
+    for (int i = 0; i < (int)sizeof(wt); i++)
+        wt[i] = (char)(i * 11 + i / DEFAULT_BLOCK_SIZE);
+    journal_window = 60ULL * 1000000000; // the crashes below come before a commit
+
+    make_fs("disk.36");
+    mount_fs("disk.36");
+    fs_create("tmpl.36");
+    fd = fs_open("tmpl.36");
+    fs_write(fd, wt, sizeof(wt));
+    fs_close(fd);
+    fs_create("plain.36");
+    fd = fs_open("plain.36");
+    fs_write(fd, wt, sizeof(wt));
+    fs_close(fd);
+    if (fs_clone("tmpl.36", "clone.36") != 0 || fs_sync() != 0)
+        return FAIL;
+
+    /* the write gives the clone a block of its own, and its index that
+       the committed map already owns points at it only in memory */
+    fd = fs_open("clone.36");
+    fs_lseek(fd, BLOCK_SIZE * 5);
+    if (fs_write(fd, "changed", 7) != 7)
+        return FAIL;
+
+    /* crash before the group commits: the index is as it was committed */
+    crash();
+    if (mount_fs("disk.36") != 0)
+        return FAIL;
+    fd = fs_open("clone.36");
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(wt) || memcmp(rd, wt, sizeof(wt)))
+        return FAIL;
+
+    /* once committed it comes back after a crash too */
+    fs_lseek(fd, BLOCK_SIZE * 5);
+    if (fs_write(fd, "changed", 7) != 7 || fs_sync() != 0)
+        return FAIL;
+    crash();
+    if (mount_fs("disk.36") != 0)
+        return FAIL;
+    fd = fs_open("clone.36");
+    memcpy(wt + BLOCK_SIZE * 5, "changed", 7);
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(wt) || memcmp(rd, wt, sizeof(wt)))
+        return FAIL;
+    fs_close(fd);
+    umount_fs("disk.36");
+
+    if (fsck_image("disk.36", 1, 0, &r) != 0 || r.files != 3)
+        return FAIL;
+
+    /* a block rewritten in place waits for the commit of its checksum, so
+       a crash before that finds it as it was */
+    mount_fs("disk.36");
+    fd = fs_open("plain.36");
+    head = dir_pointer[(int)META[fd].file].head;
+    if (fs_write(fd, "again", 5) != 5)
+        return FAIL;
+    crash();
+    if (fsck_image("disk.36", 1, 0, &r) != 0)
+        return FAIL;
+    errors = fs_checksum_errors();
+    mount_fs("disk.36");
+    fd = fs_open("plain.36");
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(wt) || memcmp(rd, wt, BLOCK_SIZE) || fs_checksum_errors() != errors)
+        return FAIL;
+
+    /* it goes home after the commit, which keeps its old checksum too: a
+       crash that stops it on the way leaves a block that still reads */
+    fs_lseek(fd, 0);
+    if (fs_write(fd, "again", 5) != 5 || fs_sync() != 0)
+        return FAIL;
+    crash();
+    f = open("disk.36", O_RDWR);
+    pwrite(f, wt, 5, (off_t)head * BLOCK_SIZE);
+    close(f);
+    if (fsck_image("disk.36", 1, 0, &r) != 0 || r.journal_pending == 0)
+        return FAIL;
+    mount_fs("disk.36");
+    fd = fs_open("plain.36");
+    if (fs_read(fd, rd, sizeof(rd)) != sizeof(wt) || memcmp(rd, wt, BLOCK_SIZE) || fs_checksum_errors() != errors)
+        return FAIL;
+
+    /* a block that matches neither checksum is damaged, crash or not */
+    fs_lseek(fd, 0);
+    if (fs_write(fd, "again", 5) != 5 || fs_sync() != 0)
+        return FAIL;
+    crash();
+    f = open("disk.36", O_RDWR);
+    pwrite(f, "x", 1, (off_t)head * BLOCK_SIZE + 9);
+    close(f);
+    if (fsck_image("disk.36", 1, 0, &r) != 1 || r.bad_checksums != 1)
+        return FAIL;
+    mount_fs("disk.36");
+    fd = fs_open("plain.36");
+    if (fs_read(fd, rd, sizeof(rd)) != -1 || fs_checksum_errors() == errors)
+        return FAIL;
+    fs_close(fd);
+    umount_fs("disk.36");
+    return PASS;
+}
+
+// end of tests
+//==============================================================================
+
+/**
+ *  Some implementation details: Main spawns a child process for each
+ *  test, that way if test 2/20 segfaults, we can still run the remaining
+ *  tests. It also hands every child a pipe of its own to write the result
+ *  of the test. Up to one test per CPU runs at a time (-j sets another
+ *  count); the parent polls the pipes of all running tests and counts a
+ *  test as a failure if it runs past its own deadline, TEST_WAIT_MILI
+ *  after it started or -t ms (which would indicate the child is hung), or
+ *  if it dies without writing. Every test works on its
+ *  own disk.<test number>, which is deleted when the test ends.
+ *
+ *  The wall time of every test is printed and compared with the times in
+ *  TEST_BASELINE, which -w writes from the current run; a test that got
+ *  TEST_SLOWER times slower (and by more than TEST_SLACK_MILI) is flagged.
+ */
+
+static int (*test_arr[NUM_TESTS])(void) = {&test0, &test1, &test2,
+                                           &test3, &test4, &test5,
+                                           &test6, &test7, &test8, &test9,
+                                           &test10, &test11, &test12,
+                                           &test13, &test14, &test15,
+                                           &test16, &test17, &test18,
+                                           &test19, &test20, &test21,
+                                           &test22, &test23,
+                                           &test24, &test25, &test26, &test27, &test28,
+                                           &test29, &test30, &test31, &test32,
+                                           &test33, &test34, &test35, &test36};
+// static int (*test_arr[NUM_TESTS])(void) = {&test9};
+
+// int main(void)
+// {
+//     char disk[10];
+//     int score = 0;
+//     int total_score = 0;
+
+//     for (int i = 0; i < NUM_TESTS; i++)
+//     {
+//         score = 0;
+//         score = test_arr[i]();
+//         total_score += score;
+//         if (score)
+//         {
+//             printf("test %i : PASS\n", i);
+//         }
+//         else
+//         {
+//             printf("test %i : FAIL\n", i);
+//         }
+//         sprintf(disk, "disk.%d", i);
+//         remove(disk);
+//     }
+//     printf("total score was %i / %i\n", total_score, NUM_TESTS);
+//     return 0;
+// }
+
+typedef struct
+{
+    pid_t pid;
+    int fd;        // read end of the test's pipe, -1 once it has finished
+    double start;  // ms
+    double ms;     // wall time
+    int score;
+    int timed_out;
+} test_run;
+
+static double nowMili(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void startTest(test_run *run, int i, int devnull_fd)
+{
+    int pipe_fd[2];
+
+    pipe(pipe_fd);
+    run->start = nowMili();
+    run->pid = fork();
+
+    // child, launches the test
+    if (run->pid == 0)
+    {
 #ifndef _DEBUG
-            dup2(devnull_fd, STDOUT_FILENO); // begone debug messages
-            dup2(devnull_fd, STDERR_FILENO);
+        dup2(devnull_fd, STDOUT_FILENO); // begone debug messages
+        dup2(devnull_fd, STDERR_FILENO);
 #endif
+        close(pipe_fd[0]);
 
-            score = test_arr[i]();
+        int score = test_arr[i]();
 
-            write(pipe_fd[1], &score, sizeof(score));
-            exit(0);
-        }
+        write(pipe_fd[1], &score, sizeof(score));
+        exit(0);
+    }
+
+    // parent keeps the read end only, so a child that dies shows up as EOF
+    close(pipe_fd[1]);
+    run->fd = pipe_fd[0];
+}
+
+static void finishTest(test_run *run, int i, int timed_out)
+{
+    char disk[16];
+    int status;
+
+    run->score = 0;
+    run->timed_out = timed_out;
+    if (!timed_out && read(run->fd, &run->score, sizeof(run->score)) != sizeof(run->score))
+    {
+        run->score = 0;
+    }
+    run->ms = nowMili() - run->start;
 
-        // parent, polls on the pipe we gave the child, kills the child,
-        // keeps track of score
+    kill(run->pid, SIGKILL);
+    waitpid(run->pid, &status, 0);
+    close(run->fd);
+    run->fd = -1;
+
+    /* Delete Disk */
+    sprintf(disk, "disk.%d", i);
+    remove(disk);
+}
+
+int main(int argc, char **argv)
+{
+    static test_run runs[NUM_TESTS];
+    static double baseline[NUM_TESTS];
+    struct pollfd poll_fds[NUM_TESTS];
+    int slot[NUM_TESTS];
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int wait_mili = TEST_WAIT_MILI;
+    int write_baseline = 0, next = 0, running = 0, finished = 0;
+    int total_score = 0, slow = 0;
+    double t0, busy = 0;
+    FILE *f;
+
+    for (int a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "-j") == 0 && a + 1 < argc)
+            workers = atoi(argv[++a]);
+        else if (strcmp(argv[a], "-t") == 0 && a + 1 < argc)
+            wait_mili = atoi(argv[++a]);
+        else if (strcmp(argv[a], "-w") == 0)
+            write_baseline = 1;
         else
         {
+            fprintf(stderr, "usage: %s [-j workers] [-t timeout ms] [-w]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (workers < 1)
+        workers = 1;
+
+    if ((f = fopen(TEST_BASELINE, "r")) != NULL)
+    {
+        int i;
+        double ms;
+        while (fscanf(f, "%d %lf", &i, &ms) == 2)
+        {
+            if (i >= 0 && i < NUM_TESTS)
+                baseline[i] = ms;
+        }
+        fclose(f);
+    }
 
-            if (poll(&poll_fds, 1, TEST_WAIT_MILI))
-            {
-                read(pipe_fd[0], &score, sizeof(score));
-            }
+    int devnull_fd = open("/dev/null", O_WRONLY);
+
+    t0 = nowMili();
+    while (finished < NUM_TESTS)
+    {
+        while (running < workers && next < NUM_TESTS)
+        {
+            startTest(&runs[next], next, devnull_fd);
+            next++;
+            running++;
+        }
 
-            total_score += score;
-            kill(pid, SIGKILL);
-            waitpid(pid, &status, 0);
+        /* wait for a result or for the nearest deadline */
+        int n = 0;
+        double wait = wait_mili;
+        for (int i = 0; i < next; i++)
+        {
+            if (runs[i].fd < 0)
+                continue;
+            double left = runs[i].start + wait_mili - nowMili();
+            if (left < wait)
+                wait = left;
+            poll_fds[n].fd = runs[i].fd;
+            poll_fds[n].events = POLLRDNORM; // only care about normal read operations
+            slot[n++] = i;
+        }
+        poll(poll_fds, n, wait > 0 ? (int)wait + 1 : 0);
 
-            if (score)
-            {
-                printf("test %2i : PASS\n", i);
-            }
+        for (int k = 0; k < n; k++)
+        {
+            int i = slot[k];
+            if (poll_fds[k].revents)
+                finishTest(&runs[i], i, 0);
+            else if (nowMili() - runs[i].start >= wait_mili)
+                finishTest(&runs[i], i, 1);
             else
-            {
-                printf("test %2i : FAIL\n", i);
-            }
+                continue;
+            running--;
+            finished++;
+        }
+    }
 
-            /* Delete Disk */
-            sprintf(disk, "disk.%d", i);
-            remove(disk);
+    for (int i = 0; i < NUM_TESTS; i++)
+    {
+        test_run *run = &runs[i];
+        total_score += run->score;
+        busy += run->ms;
+        printf("test %2i : %s %8.1f ms", i, run->score ? "PASS" : "FAIL", run->ms);
+        if (run->timed_out)
+            printf("  (timed out)");
+        else if (baseline[i] > 0 && run->ms > baseline[i] * TEST_SLOWER && run->ms - baseline[i] > TEST_SLACK_MILI)
+        {
+            printf("  SLOWER than baseline %.1f ms", baseline[i]);
+            slow++;
         }
+        printf("\n");
+    }
+
+    if (write_baseline && (f = fopen(TEST_BASELINE, "w")) != NULL)
+    {
+        for (int i = 0; i < NUM_TESTS; i++)
+            fprintf(f, "%d %.1f\n", i, runs[i].ms);
+        fclose(f);
     }
 
+    printf("%d workers: %.1f ms wall, %.1f ms of tests", workers, nowMili() - t0, busy);
+    if (slow)
+        printf(", %d slower than baseline", slow);
+    printf("\n");
     printf("total score was %i / %i\n", total_score, NUM_TESTS);
     return 0;
 }
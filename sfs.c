@@ -0,0 +1,3526 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32c.h"
+#include "hash.h"
+#include "journal.h"
+#include "lz.h"
+#include "sfs.h"
+#include "summary.h"
+
+super_block *SBP;
+file_info *dir_pointer;
+file_descriptor META[MAX_FILE_DESCRIPTOR];
+cluster_cache CCACHE[CLUSTER_CACHE];
+unsigned int cache_clock;
+unsigned char REFS[MAP_BYTES_MAX];
+unsigned char BLOOM[BLOOM_BITS / 8];
+boolean bloom_ready;
+dedup_stats DSTATS;
+unsigned int CRCS[CRC_BYTES_MAX / sizeof(unsigned int)];
+cached_block BCACHE[BCACHE_SETS][BCACHE_WAYS];
+unsigned int bcache_clock;
+boolean crc_enabled = True; // benchmarks switch it off to measure the cost
+int crc_errors;
+int crc_repairs; // bad blocks a mirror copy replaced
+int defrag_next; // file the defragmenter looks at next
+
+/* Struggle Begin */
+
+int make_fs(char *disk_name)
+{
+    return make_fs_geometry(disk_name, DEFAULT_BLOCK_SIZE, DEFAULT_DISK_BLOCKS);
+}
+
+int make_fs_geometry(char *disk_name, int block_size, int blocks)
+{
+    traceAuto(); // SFS_TRACE names a trace to record
+    unsigned long long t = statStart();
+    journalLock();
+    int rtn = makeFs(disk_name, block_size, blocks);
+    journalUnlock();
+    statEnd(OP_MAKE_FS, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_MAKE_FS, .arg = block_size, .arg2 = blocks};
+        traceCall(&r, t, rtn, disk_name, NULL);
+    }
+    return rtn;
+}
+
+/* the directory, a snapshot, the summaries and a journal descriptor take
+   one block each, all the metadata blocks and the held ones go into one
+   transaction, and blocks are left for data */
+static boolean layoutFits(super_block *sb)
+{
+    return sizeof(file_info) * MAX_FILE <= (size_t)BLOCK_SIZE && sizeof(snapshot) <= (size_t)BLOCK_SIZE &&
+           SUMMARY_OFFSET + SUMMARY_BYTES <= (size_t)BLOCK_SIZE && sizeof(journal_desc) <= (size_t)BLOCK_SIZE &&
+           JOURNAL_COMMIT_MAX <= JOURNAL_LOGGED_MAX && JOURNAL_ORDERED <= JOURNAL_ORDERED_MAX &&
+           sb->journal_index + JOURNAL_BLOCKS < DISK_BLOCKS;
+}
+
+int makeFs(char *disk_name, int block_size, int blocks)
+{
+    geometry old = disk_geometry;
+    char *meta = NULL;
+    boolean opened = False;
+
+    if (disk_open_backend() != NULL || disk_set_geometry(block_size, blocks) == -1)
+        return -1; // a mounted file system keeps its disk and super block
+    journalStop(); // the log of a mount a crash ended is not this image's
+
+    /* Initialize the super block */
+    SBP = (super_block *)malloc(sizeof(super_block));
+    if (SBP == NULL)
+        goto fail;
+
+    SBP->block_size = BLOCK_SIZE;
+    SBP->blocks = DISK_BLOCKS;
+    SBP->dir_index = 1;
+    SBP->dir_len = 0;
+    SBP->data_index = 2;
+    SBP->ref_index = SBP->data_index + MAP_BLOCKS;
+    SBP->fp_index = SBP->ref_index + REF_BLOCKS;
+    SBP->crc_index = SBP->fp_index + FP_BLOCKS;
+    SBP->snap_index = SBP->crc_index + CRC_BLOCKS;
+    SBP->journal_index = SBP->snap_index + SNAP_MAX;
+    if (!layoutFits(SBP))
+        goto fail;
+
+    if (make_disk(disk_name) == -1 || open_disk(disk_name) == -1)
+        goto fail;
+    opened = True;
+
+    /* An image only promises to read back as zeroes, and one made over an
+       old image may not; every block from the directory to the head of the
+       log is written here, in one transfer: no file, no snapshot, nothing
+       logged, no references, fingerprints or checksums yet. Block 0 of the
+       buffer is the super block, written last */
+    meta = calloc(SBP->journal_index + 1, BLOCK_SIZE);
+    if (meta == NULL)
+        goto fail;
+    unsigned char *map = (unsigned char *)meta + (size_t)SBP->data_index * BLOCK_SIZE;
+    memset(map, MAP_RESERVED, SBP->journal_index + JOURNAL_BLOCKS);
+    if (blocks_write(1, SBP->journal_index, meta + BLOCK_SIZE) == -1)
+        goto fail;
+
+    /* The rest of the log is not cleared: a commit an old image left there
+       replays only if its sequence number follows, so each file system
+       starts its sequence somewhere new */
+    unsigned long long clk = statClock();
+    SBP->journal_seq = (unsigned int)hash64((char *)&clk, sizeof(clk), 0);
+    SBP->crc_sum = 0;
+    for (int i = 0; i < CRC_BLOCKS; i++)
+    {
+        SBP->crc_sum = crc32c(SBP->crc_sum, meta + (size_t)(SBP->crc_index + i) * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    SBP->sb_sum = superSum(SBP);
+
+    /* Writing super block to disk, with the summaries of the empty map */
+    file_info none[MAX_FILE];
+    memset(none, 0, sizeof(none));
+    memcpy(meta, SBP, sizeof(super_block));
+    summaryBuild(map, none);
+    summaryStore(meta, SBP->journal_seq, True);
+    summaryDrop();
+    if (block_write(0, meta) == -1)
+        goto fail;
+
+    free(meta);
+    free(SBP);
+    SBP = NULL;
+    close_disk();
+    return 0;
+
+fail:
+    free(meta);
+    free(SBP);
+    SBP = NULL;
+    if (opened)
+        close_disk();
+    disk_set_geometry(old.block_size, old.blocks);
+    return -1;
+}
+
+int mount_fs(char *disk_name)
+{
+    traceAuto(); // SFS_TRACE names a trace to record
+    unsigned long long t = statStart();
+    journalLock();
+    int rtn = mountFs(disk_name);
+    journalUnlock();
+    statEnd(OP_MOUNT, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_MOUNT};
+        traceCall(&r, t, rtn, disk_name, NULL);
+    }
+    return rtn;
+}
+
+/* the super block tells the geometry of the image; block 0 starts at byte
+   0 at any geometry, so it is read at the smallest one first */
+static int probeGeometry(char *disk_name)
+{
+    geometry old = disk_geometry;
+    char buf[BLOCK_SIZE_MIN];
+    super_block *sb = (super_block *)buf;
+    int rtn = -1;
+
+    if (disk_set_geometry(BLOCK_SIZE_MIN, 1) == -1)
+        return -1;
+    if (open_disk(disk_name) != -1)
+    {
+        for (int copy = 0; copy < disk_copies() && rtn == -1; copy++)
+        {
+            if (blocks_read_copy(copy, 0, 1, buf) == 0 && sb->sb_sum == superSum(sb))
+                rtn = 0;
+        }
+        close_disk();
+    }
+    if (rtn == 0 && disk_set_geometry(sb->block_size, sb->blocks) == 0 && layoutFits(sb))
+        return 0;
+    disk_set_geometry(old.block_size, old.blocks);
+    return -1;
+}
+
+int mountFs(char *disk_name)
+{
+    static char buf[BLOCK_SIZE_MAX];
+    static char meta[BLOCK_SIZE_MAX + 2 * MAP_BYTES_MAX];
+    geometry old = disk_geometry;
+    boolean torn = False;
+
+    if (disk_name == NULL || disk_open_backend() != NULL)
+        return -1;
+    if (probeGeometry(disk_name) == -1)
+        return -1; // the geometry is left as it was
+    if (open_disk(disk_name) == -1)
+        goto fail;
+
+    /* reading super block and checksums, which vouch for each other unless
+       a checkpoint was cut short, and then the log holds the difference; on
+       a mirror each copy is tried until one works */
+    SBP = (super_block *)malloc(sizeof(super_block));
+    if (SBP == NULL)
+        goto fail;
+    for (int copy = 0;; copy++)
+    {
+        if (copy == disk_copies())
+            goto fail;
+
+        memset(buf, 0, BLOCK_SIZE);
+        blocks_read_copy(copy, 0, 1, buf);
+        memcpy(SBP, buf, sizeof(super_block));
+
+        unsigned int crc_sum = 0;
+        blocks_read_copy(copy, SBP->crc_index, CRC_BLOCKS, (char *)CRCS);
+        for (int i = 0; i < CRC_BLOCKS; ++i)
+        {
+            crc_sum = crc32c(crc_sum, (char *)CRCS + i * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        torn = crc_sum != SBP->crc_sum;
+        if (SBP->sb_sum == superSum(SBP) && (!torn || journalValid(copy)))
+        {
+            if (copy > 0)
+            {
+                block_write(0, buf); // the copies before held a bad header
+                blocks_write(SBP->crc_index, CRC_BLOCKS, (char *)CRCS);
+                crc_repairs++;
+            }
+            break;
+        }
+        crc_errors++;
+    }
+    dropCache();
+
+    /* applying what was committed after the last checkpoint; the summaries
+       stored with that checkpoint only hold if nothing came after it */
+    summaryDrop();
+    int replayed = journalReplay();
+    if (replayed == -1 || (torn && replayed == 0))
+    {
+        crc_errors++;
+        goto fail;
+    }
+    if (replayed == 0)
+    {
+        summaryLoad(buf);
+    }
+
+    /* the directory, the allocation map and the reference counts lie next
+       to each other and come in with one read */
+    if (SBP->data_index != SBP->dir_index + 1 || readRun(SBP->dir_index, 1 + MAP_BLOCKS + REF_BLOCKS, meta) == -1)
+        goto fail;
+
+    /* reading directory info */
+    dir_pointer = (file_info *)calloc(MAX_FILE, sizeof(file_info));
+    memcpy(dir_pointer, meta, sizeof(file_info) * MAX_FILE);
+    dropClusters(-1);
+
+    /* the allocation map stays in memory, the journal logs it from here */
+    memcpy(MAP, meta + BLOCK_SIZE, MAP_BLOCKS * BLOCK_SIZE);
+
+    /* reading reference counts, the fingerprint filter is built on first use */
+    memcpy(REFS, meta + (1 + MAP_BLOCKS) * BLOCK_SIZE, REF_BLOCKS * BLOCK_SIZE);
+    bloom_ready = False;
+    memset(&DSTATS, 0, sizeof(DSTATS));
+
+    dropCache();
+    journalStart();
+
+    /* clearing file descriptors */
+    for (int i = 0; i < MAX_FILE_DESCRIPTOR; ++i)
+    {
+        META[i].used = False;
+    }
+
+    return 0;
+
+fail:
+    free(SBP);
+    SBP = NULL;
+    close_disk();
+    disk_set_geometry(old.block_size, old.blocks);
+    return -1;
+}
+
+int umount_fs(char *disk_name)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    int rtn = umountFs(disk_name);
+    journalUnlock();
+    statEnd(OP_UMOUNT, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_UMOUNT};
+        traceCall(&r, t, rtn, disk_name, NULL);
+    }
+    return rtn;
+}
+
+int umountFs(char *disk_name)
+{
+    if (disk_name == NULL)
+        return -1;
+
+    /* write the directory, map, reference counts and checksums home, then
+       the super block that covers them; directory entries stay at their
+       index since the allocation map tags blocks with it */
+    int j = 0;
+    journalCheckpoint();
+    journalStop();
+
+    /* clear file descriptors */
+    for (j = 0; j < MAX_FILE_DESCRIPTOR; ++j)
+    {
+        if (META[j].used == 1)
+        {
+            META[j].used = False;
+            META[j].file = -1;
+            META[j].offset = 0;
+        }
+    }
+
+    free(dir_pointer);
+    free(SBP);
+    dir_pointer = NULL;
+    SBP = NULL;
+    summaryDrop();
+    dropCache();
+    close_disk();
+    return 0;
+}
+
+int fs_open(char *name)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    int rtn = openFile(name);
+    journalUnlock();
+    statEnd(OP_OPEN, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_OPEN};
+        traceCall(&r, t, rtn, name, NULL);
+    }
+    return rtn;
+}
+
+int openFile(char *name)
+{
+    char file_index = findFile(name);
+    if (file_index < 0)
+    {
+        return -1;
+    }
+
+    int fd = findUnallocatedMetaInfo(file_index);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    dir_pointer[file_index].fd_count++;
+    return fd;
+}
+
+int fs_close(int fildes)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    int rtn = closeFile(fildes);
+    journalUnlock();
+    statEnd(OP_CLOSE, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_CLOSE, .arg = fildes};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int closeFile(int fildes)
+{
+    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTOR || !META[fildes].used)
+    {
+        return -1;
+    }
+
+    file_descriptor *fd = &META[fildes];
+
+    dir_pointer[fd->file].fd_count--;
+    fd->used = False;
+
+    return 0;
+}
+
+int fs_create(char *name)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    disk_plug();
+    int rtn = createFile(name);
+    if (disk_unplug() != 0)
+        rtn = -1;
+    journalOp(-1); // joins the running group commit
+    journalUnlock();
+    statEnd(OP_CREATE, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_CREATE};
+        traceCall(&r, t, rtn, name, NULL);
+    }
+    return rtn;
+}
+
+int createFile(char *name)
+{
+    if (strlen(name) > MAX_FILENAME_LEN)
+    {
+        return -1;
+    }
+    char file_index = findFile(name);
+
+    if (file_index < 0) // Create file
+    { 
+        for (char i = 0; i < MAX_FILE; i++)
+        {
+            if (dir_pointer[i].used == False)
+            {
+                SBP->dir_len++;
+                /* Initialize file information */
+                dir_pointer[i].used = True;
+                strcpy(dir_pointer[i].name, name);
+                dirIndexAdd(i);
+                dir_pointer[i].size = 0;
+                dir_pointer[i].head = -1;
+                dir_pointer[i].num_blocks = 0;
+                dir_pointer[i].fd_count = 0;
+                dir_pointer[i].tail = -1;
+                dir_pointer[i].frag = 0;
+                dir_pointer[i].flags = 0;
+                return 0;
+            }
+        }
+        return -1;
+    }
+    else // File already exists
+    { 
+        return -1; 
+    }
+}
+
+int fs_delete(char *name)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    disk_plug();
+    int rtn = deleteFile(name);
+    if (disk_unplug() != 0)
+        rtn = -1;
+    journalOp(-1);
+    journalUnlock();
+    statEnd(OP_DELETE, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_DELETE};
+        traceCall(&r, t, rtn, name, NULL);
+    }
+    return rtn;
+}
+
+int deleteFile(char *name)
+{
+    for (int i = 0; i < MAX_FILE; ++i)
+    {
+        if (strcmp(dir_pointer[i].name, name) == 0)
+        {
+            char file_index = i;
+            file_info *file = &dir_pointer[i];
+
+            if (dir_pointer[i].fd_count != 0)
+            { 
+                return -1; // File is currently open
+            }
+
+            // Remove file information
+            SBP->dir_len--;
+            dirIndexDrop(i);
+            file->used = False;
+            strcpy(file->name, "");
+            file->size = 0;
+            file->fd_count = 0;
+
+            /* Drop the references of a mapped file */
+            if (file->flags & FI_MAPPED)
+            {
+                mapTruncate(file_index, 0);
+            }
+
+            /* Free file blocks, compressed runs are not in chain order
+               so every block carrying the file's tag goes */
+            char map[MAP_BLOCKS * BLOCK_SIZE];
+            loadMap(map);
+            for (int j = 0; j < DISK_BLOCKS; j++)
+            {
+                if (map[j] == file_index + 1)
+                {
+                    map[j] = '\0';
+                }
+            }
+            storeMap(map);
+            dropClusters(file_index);
+
+            dir_pointer[i].head = -1;
+            dir_pointer[i].num_blocks = 0;
+            dir_pointer[i].flags = 0;
+
+            /* Free tail fragments */
+            if (file->tail != -1)
+            {
+                int tail = file->tail;
+                file->tail = -1;
+                releaseTail(tail);
+            }
+
+            return 0;
+        }
+    }
+    return -1; //file does not exists
+}
+
+int fs_read(int fildes, void *buf, size_t nbyte)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    int rtn = readFile(fildes, buf, nbyte);
+    journalUnlock();
+    statEnd(OP_READ, t, rtn, rtn);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_READ, .arg = fildes, .off = fileOffset(fildes, rtn), .len = nbyte};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int readFile(int fildes, void *buf, size_t nbyte)
+{
+    if (nbyte <= 0 || fildes < 0 || fildes >= MAX_FILE_DESCRIPTOR || !META[fildes].used){return -1;}
+
+    int i, j = 0;
+    char *dst = buf;
+    char block[BLOCK_SIZE];
+    memset(block, 0, BLOCK_SIZE);
+    char file_index = META[fildes].file;
+    file_info *file = &dir_pointer[file_index];
+    int block_index = file->head;
+    int block_found = 0;
+    int offset = META[fildes].offset;
+
+    /* nothing to read past the end of file */
+    if (offset >= file->size)
+    {
+        return 0;
+    }
+    if ((int)nbyte > file->size - offset)
+    {
+        nbyte = file->size - offset;
+    }
+
+    /* compressed file, served from the cluster cache */
+    if (file->flags & FI_COMPRESS)
+    {
+        return compRead(fildes, dst, (int)nbyte);
+    }
+
+    /* mapped file, blocks come from its index */
+    if (file->flags & FI_MAPPED)
+    {
+        return mapRead(fildes, dst, (int)nbyte);
+    }
+
+    /* packed file, the data sits in fragments of its tail block */
+    if (file->tail != -1)
+    {
+        if (readBlock(file->tail, block) == -1)
+        {
+            return -1;
+        }
+        memcpy(dst, block + file->frag * FRAG_SIZE + offset, nbyte);
+        META[fildes].offset += (int)nbyte;
+        return (int)nbyte;
+    }
+
+    /* spans of blocks go out as runs, which a striped disk splits across its members */
+    if ((int)nbyte > BLOCK_SIZE)
+    {
+        return chainSpan(fildes, dst, (int)nbyte, False);
+    }
+
+    /* load current block */
+    while (offset >= BLOCK_SIZE)
+    {
+        block_index = findNextBlock(block_index, file_index);
+        block_found++;
+        offset -= BLOCK_SIZE;
+    }
+    if (readBlock(block_index, block) == -1)
+    {
+        return -1;
+    }
+
+    /* read current block */
+    int r_found = 0;
+    for (i = offset; i < BLOCK_SIZE; i++)
+    {
+        dst[r_found++] = block[i];
+        if (r_found == (int)nbyte)
+        {
+            META[fildes].offset += r_found;
+            return r_found;
+        }
+    }
+    block_found++;
+
+    /* read the following blocks */
+    strcpy(block, "");
+    while (r_found < (int)nbyte && block_found <= file->num_blocks)
+    {
+        block_index = findNextBlock(block_index, file_index);
+        strcpy(block, "");
+        if (readBlock(block_index, block) == -1)
+        {
+            return -1;
+        }
+        for (j = 0; j < BLOCK_SIZE; j++, i++)
+        {
+            dst[r_found++] = block[j];
+            if (r_found == (int)nbyte)
+            {
+                META[fildes].offset += r_found;
+                return r_found;
+            }
+        }
+        block_found++;
+    }
+    META[fildes].offset += r_found;
+    return r_found;
+}
+
+int fs_write(int fildes, void *buf, size_t nbyte)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    disk_plug();
+    int rtn = writeFile(fildes, buf, nbyte);
+    if (disk_unplug() != 0)
+        rtn = -1;
+    journalOp(fileOf(fildes));
+    journalUnlock();
+    statEnd(OP_WRITE, t, rtn, rtn);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_WRITE, .arg = fildes, .off = fileOffset(fildes, rtn), .len = nbyte};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int writeFile(int fildes, void *buf, size_t nbyte)
+{
+    if (nbyte <= 0 || fildes < 0 || fildes >= MAX_FILE_DESCRIPTOR || !META[fildes].used)
+    { return -1; }
+
+    int i = 0;
+    char *src = buf;
+    char block[BLOCK_SIZE];
+    memset(block, 0, BLOCK_SIZE);
+    char file_index = META[fildes].file;
+    file_info *file = &dir_pointer[file_index];
+
+    /* compressed file, goes through the cluster cache */
+    if (file->flags & FI_COMPRESS)
+    {
+        return compWrite(fildes, src, (int)nbyte);
+    }
+
+    /* mapped file, blocks are shared or copied on write */
+    if (file->flags & FI_MAPPED)
+    {
+        return mapWrite(fildes, src, (int)nbyte);
+    }
+
+    /* small files are packed into fragments of a shared tail block */
+    if (file->head == -1 && META[fildes].offset + (int)nbyte <= PACK_MAX)
+    {
+        return packWrite(fildes, src, (int)nbyte);
+    }
+    if (file->tail != -1 && unpackFile(file_index) == -1)
+    {
+        return -1;
+    }
+
+    if ((int)nbyte > BLOCK_SIZE)
+    {
+        return chainSpan(fildes, src, (int)nbyte, True);
+    }
+    if (growChain(file_index, blocksFor(META[fildes].offset + (int)nbyte) - file->num_blocks) == -1)
+    {
+        return -1;
+    }
+
+    int block_index = file->head;
+    int size = file->size;
+    int block_found = 0;
+    int offset = META[fildes].offset;
+
+    /* load current block */
+    while (offset >= BLOCK_SIZE)
+    {
+        block_index = findNextBlock(block_index, file_index);
+        block_found++;
+        offset -= BLOCK_SIZE;
+    }
+
+    int w_found = 0;
+    if (block_index != -1)
+    {
+        /* write current block */
+        readBlock(block_index, block);
+        for (i = offset; i < BLOCK_SIZE; i++)
+        {
+            block[i] = src[w_found++];
+            if (w_found == (int)nbyte)
+            {
+                writeBlock(block_index, block);
+                META[fildes].offset += w_found;
+                if (size < META[fildes].offset)
+                {
+                    file->size = META[fildes].offset;
+                }
+                return w_found;
+            }
+        }
+        writeBlock(block_index, block);
+        block_found++;
+    }
+
+    /* write the allocated blocks */
+    strcpy(block, "");
+    while (w_found < (int)nbyte && block_found < file->num_blocks)
+    {
+        block_index = findNextBlock(block_index, file_index);
+        for (i = 0; i < BLOCK_SIZE; i++)
+        {
+            block[i] = src[w_found++];
+            if (w_found == (int)nbyte)
+            {
+                writeBlock(block_index, block);
+                META[fildes].offset += w_found;
+                if (size < META[fildes].offset)
+                {
+                    file->size = META[fildes].offset;
+                }
+                return w_found;
+            }
+        }
+        writeBlock(block_index, block);
+        block_found++;
+    }
+
+    /* write into new blocks */
+    strcpy(block, "");
+    while (w_found < (int)nbyte)
+    {
+        block_index = findFreeBlock(file_index);
+        if (block_index < 0){
+            return -1;
+        }
+        file->num_blocks++;
+        if (file->head == -1){
+            file->head = block_index;
+        }
+        for (i = 0; i < BLOCK_SIZE; i++)
+        {
+            block[i] = src[w_found++];
+            if (w_found == (int)nbyte)
+            {
+                writeBlock(block_index, block);
+                META[fildes].offset += w_found;
+                if (size < META[fildes].offset){
+                    file->size = META[fildes].offset;
+                }
+                return w_found;
+            }
+        }
+        writeBlock(block_index, block);
+    }
+
+    META[fildes].offset += w_found;
+    if (size < META[fildes].offset){
+        file->size = META[fildes].offset;
+    }
+    return w_found;
+}
+
+int fs_get_filesize(int fildes)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    int rtn = fileSize(fildes);
+    journalUnlock();
+    statEnd(OP_FILESIZE, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_FILESIZE, .arg = fildes};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int fileSize(int fildes)
+{
+    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTOR)
+    { return -1; }
+    if (!META[fildes].used)
+    { return -1; }
+    return dir_pointer[META[fildes].file].size;
+}
+
+int fs_lseek(int fildes, off_t offset)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    int rtn = seekFile(fildes, offset);
+    journalUnlock();
+    statEnd(OP_LSEEK, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_LSEEK, .arg = fildes, .off = offset};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int seekFile(int fildes, off_t offset)
+{
+    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTOR || !META[fildes].used)
+    { return -1; }
+    else if (offset > dir_pointer[META[fildes].file].size || offset < 0)
+    { return -1; }
+    else
+    {
+        META[fildes].offset = (int)offset;
+        return 0;
+    }
+}
+
+int fs_truncate(int fildes, off_t length)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    disk_plug();
+    int rtn = truncateFile(fildes, length);
+    if (disk_unplug() != 0)
+        rtn = -1;
+    journalOp(fileOf(fildes));
+    journalUnlock();
+    statEnd(OP_TRUNCATE, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_TRUNCATE, .arg = fildes, .len = length};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int truncateFile(int fildes, off_t length)
+{
+    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTOR || !META[fildes].used)
+    { return -1; }
+
+    char file_index = META[fildes].file;
+    file_info *file = &dir_pointer[file_index];
+
+    if (length > file->size || length < 0)
+    { return -1; }
+
+    /* free blocks */
+    int new_block_num = (int)(length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (file->flags & FI_COMPRESS)
+    {
+        /* compressed file, clusters past the new end are dropped */
+        if (compTruncate(file_index, (int)length) == -1)
+        { return -1; }
+        new_block_num = file->num_blocks;
+    }
+    else if (file->flags & FI_MAPPED)
+    {
+        /* mapped file, references past the new end are dropped */
+        if (mapTruncate(file_index, (int)length) == -1)
+        { return -1; }
+        new_block_num = file->num_blocks;
+    }
+    else if (file->tail != -1)
+    {
+        /* packed file, its fragments shrink along with the size */
+        new_block_num = 0;
+        if (length == 0)
+        {
+            int tail = file->tail;
+            file->tail = -1;
+            releaseTail(tail);
+        }
+    }
+    int i;
+    int block_index = (file->flags & (FI_COMPRESS | FI_MAPPED)) ? -1 : file->head;
+    for (i = 0; i < new_block_num && block_index != -1; ++i){
+        block_index = findNextBlock(block_index, file_index);
+    }
+    while (block_index > 0)
+    {
+        setBlockTag(block_index, '\0');
+        block_index = findNextBlock(block_index, file_index);
+    }
+
+    /* modify file information */
+    file->size = (int)length;
+    file->num_blocks = new_block_num;
+    if (new_block_num == 0)
+    {
+        file->head = -1;
+    }
+
+    /* truncate file_directory offset */
+    for (i = 0; i < MAX_FILE_DESCRIPTOR; i++)
+    {
+        if (META[i].used == True && META[i].file == file_index){
+            META[i].offset = (int)length;
+        }
+    }
+    return 0;
+}
+
+int fs_pack_stats(pack_stats *stats)
+{
+    int tails[MAX_FILE];
+    int i, j;
+
+    if (stats == NULL)
+    {
+        return -1;
+    }
+    memset(stats, 0, sizeof(pack_stats));
+
+    for (i = 0; i < MAX_FILE; i++)
+    {
+        if (dir_pointer[i].used == False || dir_pointer[i].tail == -1)
+        {
+            continue;
+        }
+        stats->packed_files++;
+        stats->frags_used += fragsFor(dir_pointer[i].size);
+        for (j = 0; j < stats->tail_blocks && tails[j] != dir_pointer[i].tail; j++)
+            ;
+        if (j == stats->tail_blocks)
+        {
+            tails[stats->tail_blocks++] = dir_pointer[i].tail;
+        }
+    }
+
+    /* every packed file would otherwise hold at least one whole block */
+    stats->blocks_saved = stats->packed_files - stats->tail_blocks;
+    stats->bytes_saved = stats->blocks_saved * BLOCK_SIZE;
+    return 0;
+}
+
+int fs_set_compression(int fildes, boolean on)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    disk_plug();
+    int rtn = setCompression(fildes, on);
+    if (disk_unplug() != 0)
+        rtn = -1;
+    journalOp(fileOf(fildes));
+    journalUnlock();
+    statEnd(OP_SET_COMPRESSION, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_SET_COMPRESSION, .arg = fildes, .len = on};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int setCompression(int fildes, boolean on)
+{
+    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTOR || !META[fildes].used)
+    { return -1; }
+
+    /* the layout is picked before the first write */
+    file_info *file = &dir_pointer[META[fildes].file];
+    if (file->size != 0 || file->head != -1 || file->tail != -1 || (file->flags & FI_MAPPED))
+    { return -1; }
+
+    if (on)
+    {
+        file->flags |= FI_COMPRESS;
+    }
+    else
+    {
+        file->flags &= ~FI_COMPRESS;
+    }
+    return 0;
+}
+
+int fs_set_dedup(int fildes, boolean on)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    disk_plug();
+    int rtn = setDedup(fildes, on);
+    if (disk_unplug() != 0)
+        rtn = -1;
+    journalOp(fileOf(fildes));
+    journalUnlock();
+    statEnd(OP_SET_DEDUP, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_SET_DEDUP, .arg = fildes, .len = on};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int setDedup(int fildes, boolean on)
+{
+    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTOR || !META[fildes].used)
+    { return -1; }
+
+    /* the layout is picked before the first write */
+    file_info *file = &dir_pointer[META[fildes].file];
+    if (file->size != 0 || file->head != -1 || file->tail != -1 || (file->flags & FI_COMPRESS))
+    { return -1; }
+
+    if (on)
+    {
+        file->flags |= FI_MAPPED | FI_DEDUP;
+    }
+    else
+    {
+        file->flags &= ~(FI_MAPPED | FI_DEDUP);
+    }
+    return 0;
+}
+
+int fs_dedup_stats(dedup_stats *stats)
+{
+    if (stats == NULL)
+    { return -1; }
+
+    *stats = DSTATS;
+    stats->shared_blocks = 0;
+    stats->references = 0;
+    for (int i = 0; i < DISK_BLOCKS; i++)
+    {
+        if (REFS[i] > 0)
+        {
+            stats->shared_blocks++;
+            stats->references += REFS[i];
+        }
+    }
+    stats->blocks_saved = stats->references - stats->shared_blocks;
+    return 0;
+}
+
+int fs_checksum_errors(void)
+{
+    return crc_errors;
+}
+
+int fs_checksum_repairs(void)
+{
+    return crc_repairs;
+}
+
+int fs_sync(void)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    int rtn = syncFs();
+    journalUnlock();
+    statEnd(OP_SYNC, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_SYNC};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int syncFs(void)
+{
+    return journalSync(-1);
+}
+
+int fs_fsync(int fildes)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    int rtn = syncFile(fildes);
+    journalUnlock();
+    statEnd(OP_FSYNC, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_FSYNC, .arg = fildes};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int syncFile(int fildes)
+{
+    int file = fileOf(fildes);
+    if (file == -1)
+    { return -1; }
+
+    /* the data went through when it was written, a flush covers it */
+    return journalSync(file);
+}
+
+int fs_clone(char *src_name, char *dst_name)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    disk_plug();
+    int rtn = cloneFile(src_name, dst_name);
+    if (disk_unplug() != 0)
+        rtn = -1;
+    journalOp(-1);
+    journalUnlock();
+    statEnd(OP_CLONE, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_CLONE};
+        traceCall(&r, t, rtn, src_name, dst_name);
+    }
+    return rtn;
+}
+
+int cloneFile(char *src_name, char *dst_name)
+{
+    char src_index = findFile(src_name);
+    if (src_index < 0 || findFile(dst_name) >= 0)
+    { return -1; }
+
+    /* a chain file becomes a mapped one so its blocks can be shared */
+    file_info *src = &dir_pointer[src_index];
+    if (src->flags == 0 && src->head != -1 && mapFile(src_index) == -1)
+    { return -1; }
+
+    if (createFile(dst_name) == -1)
+    { return -1; }
+    char dst_index = findFile(dst_name);
+    file_info *dst = &dir_pointer[dst_index];
+
+    dst->size = src->size;
+    dst->flags = src->flags;
+    if (src->head != -1)
+    {
+        /* mapped data is shared, compressed runs are copied */
+        char tag = (char)(dst_index + 1);
+        dst->head = (src->flags & FI_COMPRESS) ? copyClusters(src->head, tag) : copyIndex(src->head, tag);
+        if (dst->head == -1)
+        {
+            deleteFile(dst_name);
+            return -1;
+        }
+        dst->num_blocks = src->num_blocks;
+    }
+    else if (src->tail != -1 && copyFrags(src->tail, src->frag, dst_index) == -1)
+    {
+        deleteFile(dst_name);
+        return -1;
+    }
+    return 0;
+}
+
+int fs_snapshot(void)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    disk_plug();
+    int rtn = takeSnapshot();
+    if (disk_unplug() != 0)
+        rtn = -1;
+    journalOp(-1);
+    journalUnlock();
+    statEnd(OP_SNAPSHOT, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_SNAPSHOT};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int takeSnapshot(void)
+{
+    int buf[BLOCK_SIZE / sizeof(int)];
+    snapshot *snap = (snapshot *)buf;
+    int id, i, j;
+
+    for (id = 0; id < SNAP_MAX; id++)
+    {
+        readBlock(SBP->snap_index + id, (char *)buf);
+        if (!snap->used)
+        {
+            break;
+        }
+    }
+    if (id == SNAP_MAX)
+    { return -1; }
+
+    memset(buf, 0, BLOCK_SIZE);
+    snap->used = True;
+    for (i = 0; i < MAX_FILE; i++)
+    {
+        file_info *file = &dir_pointer[i];
+        file_info *copy = &snap->dir[i];
+        if (file->used == False)
+        {
+            continue;
+        }
+        if (file->flags == 0 && file->head != -1 && mapFile((char)i) == -1)
+        {
+            freeSnapshot(snap);
+            return -1;
+        }
+
+        *copy = *file;
+        copy->fd_count = 0;
+        if (file->head != -1)
+        {
+            copy->head = (file->flags & FI_COMPRESS) ? copyClusters(file->head, MAP_SNAP) : copyIndex(file->head, MAP_SNAP);
+        }
+        else if (file->tail != -1)
+        {
+            /* packed files sharing a tail block share its copy too */
+            for (j = 0; j < i && !(dir_pointer[j].used && dir_pointer[j].tail == file->tail); j++)
+                ;
+            if (j < i)
+            {
+                copy->tail = snap->dir[j].tail;
+            }
+            else
+            {
+                char block[BLOCK_SIZE];
+                copy->tail = allocBlock(MAP_SNAP);
+                if (copy->tail != -1)
+                {
+                    readBlock(file->tail, block);
+                    writeBlock(copy->tail, block);
+                }
+            }
+        }
+        if ((file->head != -1 && copy->head == -1) || (file->tail != -1 && copy->tail == -1))
+        {
+            copy->used = False;
+            freeSnapshot(snap);
+            return -1;
+        }
+    }
+
+    writeMeta(SBP->snap_index + id, (char *)buf);
+    return id;
+}
+
+int fs_rollback(int id)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    disk_plug();
+    int rtn = rollbackSnapshot(id);
+    if (disk_unplug() != 0)
+        rtn = -1;
+    journalOp(-1);
+    journalUnlock();
+    statEnd(OP_ROLLBACK, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_ROLLBACK, .arg = id};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int rollbackSnapshot(int id)
+{
+    int buf[BLOCK_SIZE / sizeof(int)];
+    snapshot *snap = (snapshot *)buf;
+    int i, rtn = 0;
+
+    if (id < 0 || id >= SNAP_MAX)
+    { return -1; }
+    readBlock(SBP->snap_index + id, (char *)buf);
+    if (!snap->used)
+    { return -1; }
+
+    /* every file is replaced, so none may be open */
+    for (i = 0; i < MAX_FILE_DESCRIPTOR; i++)
+    {
+        if (META[i].used)
+        { return -1; }
+    }
+
+    for (i = 0; i < MAX_FILE; i++)
+    {
+        if (dir_pointer[i].used)
+        {
+            deleteFile(dir_pointer[i].name);
+        }
+    }
+    dropClusters(-1);
+
+    /* entries go back to their index, the allocation map tags blocks with it */
+    for (i = 0; i < MAX_FILE; i++)
+    {
+        if (snap->dir[i].used)
+        {
+            dir_pointer[i] = snap->dir[i];
+            dirIndexAdd(i);
+            dir_pointer[i].head = -1;
+            dir_pointer[i].tail = -1;
+            dir_pointer[i].num_blocks = 0;
+            SBP->dir_len++;
+        }
+    }
+    for (i = 0; i < MAX_FILE; i++)
+    {
+        file_info *copy = &snap->dir[i];
+        file_info *file = &dir_pointer[i];
+        if (!copy->used)
+        {
+            continue;
+        }
+
+        if (copy->head != -1)
+        {
+            char tag = (char)(i + 1);
+            file->head = (copy->flags & FI_COMPRESS) ? copyClusters(copy->head, tag) : copyIndex(copy->head, tag);
+            file->num_blocks = (file->head == -1) ? 0 : copy->num_blocks;
+        }
+        else if (copy->tail != -1 && copyFrags(copy->tail, copy->frag, (char)i) == -1)
+        {
+            file->tail = -1;
+        }
+
+        if ((copy->head != -1 && file->head == -1) || (copy->tail != -1 && file->tail == -1))
+        {
+            /* out of space, the file comes back empty */
+            file->size = 0;
+            file->flags &= ~FI_COMPRESS;
+            rtn = -1;
+        }
+    }
+    return rtn;
+}
+
+int fs_snapshot_delete(int id)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    disk_plug();
+    int rtn = deleteSnapshot(id);
+    if (disk_unplug() != 0)
+        rtn = -1;
+    journalOp(-1);
+    journalUnlock();
+    statEnd(OP_SNAPSHOT_DELETE, t, rtn, 0);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_SNAPSHOT_DELETE, .arg = id};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int deleteSnapshot(int id)
+{
+    int buf[BLOCK_SIZE / sizeof(int)];
+    snapshot *snap = (snapshot *)buf;
+
+    if (id < 0 || id >= SNAP_MAX)
+    { return -1; }
+    readBlock(SBP->snap_index + id, (char *)buf);
+    if (!snap->used)
+    { return -1; }
+
+    freeSnapshot(snap);
+    memset(buf, 0, BLOCK_SIZE);
+    writeMeta(SBP->snap_index + id, (char *)buf);
+    return 0;
+}
+
+int fs_frag_stats(frag_stats *stats)
+{
+    static int blocks[DISK_BLOCKS_MAX];
+    char map[MAP_BLOCKS * BLOCK_SIZE];
+    int i, run = 0;
+
+    if (stats == NULL)
+    { return -1; }
+    memset(stats, 0, sizeof(frag_stats));
+
+    for (i = 0; i < MAX_FILE; i++)
+    {
+        if (dir_pointer[i].used == False)
+        {
+            continue;
+        }
+        int n = fileBlocks((char)i, blocks);
+        if (n <= 0)
+        {
+            continue;
+        }
+        int extents = countExtents(blocks, n);
+        stats->files++;
+        stats->blocks += n;
+        stats->extents += extents;
+        if (extents > 1)
+        {
+            stats->fragmented_files++;
+        }
+    }
+
+    loadMap(map);
+    for (i = 0; i < DISK_BLOCKS; i++)
+    {
+        run = (map[i] == '\0') ? run + 1 : 0;
+        if (run == 1)
+        {
+            stats->free_extents++;
+        }
+        if (run > stats->largest_free)
+        {
+            stats->largest_free = run;
+        }
+    }
+    return 0;
+}
+
+int fs_statfs(statfs_info *stats)
+{
+    /* from the free-space summary, no map scan */
+    if (stats == NULL || SBP == NULL || !summaryReady())
+    { return -1; }
+
+    stats->block_size = BLOCK_SIZE;
+    stats->total_blocks = DISK_BLOCKS;
+    stats->free_blocks = SUMMARY.free_blocks;
+    stats->used_blocks = DISK_BLOCKS - SUMMARY.free_blocks;
+    stats->largest_free = summaryLargestFree();
+    stats->files = SBP->dir_len;
+    stats->free_files = MAX_FILE - SBP->dir_len;
+    return 0;
+}
+
+int fs_defrag(int budget)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    disk_plug();
+    int rtn = defragFiles(budget);
+    if (disk_unplug() != 0)
+        rtn = -1;
+    journalOp(-1);
+    journalUnlock();
+    statEnd(OP_DEFRAG, t, rtn, (long long)rtn * BLOCK_SIZE);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_DEFRAG, .arg = budget};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int defragFiles(int budget)
+{
+    static int blocks[DISK_BLOCKS_MAX];
+    int moved = 0;
+
+    if (budget <= 0)
+    { return -1; }
+
+    /* one sweep at most, picking up where the last call stopped */
+    for (int scanned = 0; scanned < MAX_FILE && moved < budget; scanned++)
+    {
+        char file_index = (char)defrag_next;
+        defrag_next = (defrag_next + 1) % MAX_FILE;
+        if (dir_pointer[file_index].used == False)
+        {
+            continue;
+        }
+        int n = fileBlocks(file_index, blocks);
+        if (n > 1 && countExtents(blocks, n) > 1 && relocateFile(file_index, 0) == 0)
+        {
+            moved += n;
+        }
+    }
+    return moved;
+}
+
+int fs_copy_range(int src_fd, off_t src_off, int dst_fd, off_t dst_off, size_t len)
+{
+    unsigned long long t = statStart();
+    journalLock();
+    disk_plug();
+    int rtn = copyRange(src_fd, src_off, dst_fd, dst_off, len);
+    if (disk_unplug() != 0)
+        rtn = -1;
+    journalOp(fileOf(dst_fd));
+    journalUnlock();
+    statEnd(OP_COPY_RANGE, t, rtn, rtn);
+    if (trace_enabled)
+    {
+        trace_record r = {.op = OP_COPY_RANGE, .arg = src_fd, .arg2 = dst_fd, .off = src_off, .off2 = dst_off, .len = len};
+        traceCall(&r, t, rtn, NULL, NULL);
+    }
+    return rtn;
+}
+
+int copyRange(int src_fd, off_t src_off, int dst_fd, off_t dst_off, size_t len)
+{
+    if (src_fd < 0 || src_fd >= MAX_FILE_DESCRIPTOR || !META[src_fd].used ||
+        dst_fd < 0 || dst_fd >= MAX_FILE_DESCRIPTOR || !META[dst_fd].used)
+    { return -1; }
+
+    char src_index = META[src_fd].file;
+    char dst_index = META[dst_fd].file;
+    file_info *src = &dir_pointer[src_index];
+    file_info *dst = &dir_pointer[dst_index];
+
+    if (src_off < 0 || dst_off < 0 || src_off > src->size || dst_off > dst->size)
+    { return -1; }
+    if ((off_t)len > src->size - src_off)
+    {
+        len = src->size - src_off;
+    }
+    if (src_index == dst_index && src_off < dst_off + (off_t)len && dst_off < src_off + (off_t)len)
+    { return -1; } // overlapping ranges of one file
+
+    /* mapped files on block boundaries share the whole blocks */
+    int copied = 0;
+    if ((src->flags & FI_MAPPED) && (dst->flags & FI_MAPPED) &&
+        src_off % BLOCK_SIZE == 0 && dst_off % BLOCK_SIZE == 0)
+    {
+        copied = shareRange(src_index, (int)src_off, dst_index, (int)dst_off, (int)len);
+        if (copied == -1)
+        { return -1; }
+    }
+
+    /* the rest moves in passes of whole destination blocks, which land in
+       place; only the partial blocks at either edge bounce through a block */
+    char edge[BLOCK_SIZE];
+    char *chunk = NULL;
+    while (copied < (int)len)
+    {
+        int pos = (int)dst_off + copied;
+        int n = (int)len - copied;
+        char *buf = edge;
+        if (pos % BLOCK_SIZE != 0 || n < BLOCK_SIZE)
+        {
+            if (n > BLOCK_SIZE - pos % BLOCK_SIZE)
+            {
+                n = BLOCK_SIZE - pos % BLOCK_SIZE;
+            }
+        }
+        else
+        {
+            n = (n < COPY_CHUNK ? n : COPY_CHUNK) / BLOCK_SIZE * BLOCK_SIZE;
+            if (chunk == NULL && (chunk = malloc(COPY_CHUNK)) == NULL)
+            {
+                break;
+            }
+            buf = chunk;
+        }
+        if (rangeRead(src_fd, (int)src_off + copied, buf, n) != n ||
+            rangeWrite(dst_fd, pos, buf, n) != n)
+        {
+            break;
+        }
+        copied += n;
+    }
+    free(chunk);
+    return (copied > 0 || len == 0) ? copied : -1;
+}
+
+/* Helper Function */
+
+/* file a descriptor is open on, -1 if it is not open */
+int fileOf(int fildes)
+{
+    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTOR || !META[fildes].used)
+    {
+        return -1;
+    }
+    return META[fildes].file;
+}
+
+/* where a read or write that moved the descriptor by moved bytes started */
+long long fileOffset(int fildes, int moved)
+{
+    if (fildes < 0 || fildes >= MAX_FILE_DESCRIPTOR || !META[fildes].used)
+    {
+        return 0;
+    }
+    return META[fildes].offset - (moved > 0 ? moved : 0);
+}
+
+int readBlock(int block, char *buf)
+{
+    if (journaled(block))
+    {
+        journalRead(block, buf);
+        return 0;
+    }
+
+    cached_block *cb = cacheLookup(block);
+    if (cb != NULL)
+    {
+        memcpy(buf, cb->data, BLOCK_SIZE);
+        return 0; // verified when it was loaded
+    }
+
+    if (block_read(block, buf) == -1)
+    {
+        return -1;
+    }
+    if (crc_enabled && CRCS[block] != 0 && crc32c(0, buf, BLOCK_SIZE) != CRCS[block])
+    {
+        crc_errors++;
+        if (repairBlock(block, buf) == -1)
+            return -1; // silent corruption
+    }
+    cacheInsert(block, buf);
+    return 0;
+}
+
+/* find a copy of a block that matches its checksum and write it back to all */
+int repairBlock(int block, char *buf)
+{
+    int copies = disk_copies();
+
+    for (int copy = 0; copies > 1 && copy < copies; copy++)
+    {
+        if (blocks_read_copy(copy, block, 1, buf) == 0 && crc32c(0, buf, BLOCK_SIZE) == CRCS[block])
+        {
+            block_write(block, buf);
+            crc_repairs++;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int writeBlock(int block, char *buf)
+{
+    if (journaled(block))
+    {
+        journalWrite(block, buf); // reaches the disk through the log
+        if (cacheLookup(block) != NULL)
+            cacheInsert(block, buf); // read once the log lets go of it
+        return 0;
+    }
+
+    /* in place, it waits for the commit of its checksum */
+    int kept = journalOrder(block, buf);
+    if (kept == -1 || (kept == 0 && block_write(block, buf) == -1))
+    {
+        return -1;
+    }
+    if (kept == 0)
+    {
+        CRCS[block] = crc_enabled ? crc32c(0, buf, BLOCK_SIZE) : 0;
+    }
+    cacheInsert(block, buf);
+    return 0;
+}
+
+/* an index, cluster, snapshot or fingerprint block, which the map it
+   belongs to has to find as it was committed */
+int writeMeta(int block, char *buf)
+{
+    int held = journalHold(block, buf);
+
+    if (held == 0)
+        return writeBlock(block, buf);
+    if (held == 1 && cacheLookup(block) != NULL)
+        cacheInsert(block, buf);
+    return held == 1 ? 0 : -1;
+}
+
+int readRun(int start, int count, char *buf)
+{
+    if (blocks_read(start, count, buf) == -1)
+    {
+        return -1;
+    }
+
+    /* bulk transfers are verified but kept out of the cache */
+    for (int i = 0; i < count; i++)
+    {
+        char *data = buf + i * BLOCK_SIZE;
+        int block = start + i;
+        if (journaled(block))
+        {
+            journalRead(block, data); // home is behind the log
+            continue;
+        }
+        if (cacheLookup(block) == NULL && crc_enabled && CRCS[block] != 0 &&
+            crc32c(0, data, BLOCK_SIZE) != CRCS[block])
+        {
+            crc_errors++;
+            if (repairBlock(block, data) == -1)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int writeRun(int start, int count, char *buf)
+{
+    int kept[count];
+    int i, j;
+
+    /* the blocks the journal keeps until a commit stay out of the transfer */
+    for (i = 0; i < count; i++)
+    {
+        char *data = buf + i * BLOCK_SIZE;
+        if (journaled(start + i))
+        {
+            journalWrite(start + i, data);
+            kept[i] = 1;
+        }
+        else if ((kept[i] = journalOrder(start + i, data)) == -1)
+        {
+            return -1;
+        }
+    }
+    for (i = 0; i < count; i = j)
+    {
+        for (j = i + 1; j < count && kept[j] == kept[i]; j++)
+            ;
+        if (!kept[i] && blocks_write(start + i, j - i, buf + i * BLOCK_SIZE) == -1)
+        {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        char *data = buf + i * BLOCK_SIZE;
+        cached_block *cb = cacheLookup(start + i);
+        if (!kept[i])
+        {
+            CRCS[start + i] = crc_enabled ? crc32c(0, data, BLOCK_SIZE) : 0;
+        }
+        if (cb != NULL)
+        {
+            memcpy(cb->data, data, BLOCK_SIZE); // stays write-through
+        }
+    }
+    return 0;
+}
+
+int readBlocks(int *blocks, int count, char *buf)
+{
+    int i, j;
+
+    /* one transfer for every run of consecutive blocks */
+    for (i = 0; i < count; i = j)
+    {
+        for (j = i + 1; j < count && blocks[j] == blocks[j - 1] + 1; j++)
+            ;
+        if (readRun(blocks[i], j - i, buf + i * BLOCK_SIZE) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int writeBlocks(int *blocks, int count, char *buf)
+{
+    int i, j;
+
+    for (i = 0; i < count; i = j)
+    {
+        for (j = i + 1; j < count && blocks[j] == blocks[j - 1] + 1; j++)
+            ;
+        if (writeRun(blocks[i], j - i, buf + i * BLOCK_SIZE) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+cached_block *cacheLookup(int block)
+{
+    cached_block *set = BCACHE[block % BCACHE_SETS];
+    for (int i = 0; i < BCACHE_WAYS; i++)
+    {
+        if (set[i].block == block)
+        {
+            set[i].used = ++bcache_clock;
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+void cacheInsert(int block, char *buf)
+{
+    cached_block *set = BCACHE[block % BCACHE_SETS];
+    cached_block *cb = cacheLookup(block);
+
+    if (cb == NULL)
+    {
+        /* the least recently used way of the set makes room */
+        cb = &set[0];
+        for (int i = 1; i < BCACHE_WAYS; i++)
+        {
+            if (set[i].used < cb->used)
+            {
+                cb = &set[i];
+            }
+        }
+        cb->block = block;
+        cb->used = ++bcache_clock;
+    }
+    memcpy(cb->data, buf, BLOCK_SIZE);
+}
+
+void dropCache(void)
+{
+    for (int i = 0; i < BCACHE_SETS; i++)
+    {
+        for (int j = 0; j < BCACHE_WAYS; j++)
+        {
+            BCACHE[i][j].block = -1;
+            BCACHE[i][j].used = 0;
+        }
+    }
+}
+
+unsigned int superSum(super_block *sb)
+{
+    super_block copy = *sb;
+    copy.sb_sum = 0;
+    return crc32c(0, (char *)&copy, sizeof(super_block));
+}
+
+char findFile(char *name)
+{
+    return dirIndexFind(name); // the name index of the summary
+}
+
+int findUnallocatedMetaInfo(char file_index)
+{
+    int i = 0;
+    for (i = 0; i < MAX_FILE_DESCRIPTOR; i++)
+    {
+        if (META[i].used == False)
+        {
+            META[i].used = True;
+            META[i].file = file_index;
+            META[i].offset = 0;
+            return i; // file descriptor number will return
+        }
+    }
+    return -1;
+}
+
+int findFreeBlock(char file_index)
+{
+    unsigned long long t = statStart();
+    int rtn = scanFreeBlock(file_index);
+    statEnd(OP_MAP_SCAN, t, rtn, 0);
+    return rtn;
+}
+
+int scanFreeBlock(char file_index)
+{
+    char map[MAP_BLOCKS * BLOCK_SIZE];
+    int i, last = -1;
+
+    /* chain order is block order, so a new block has to come after the last one */
+    loadMap(map);
+    for (i = DISK_BLOCKS - 1; i >= 0 && last == -1; i--)
+    {
+        if (map[i] == file_index + 1)
+        {
+            last = i;
+        }
+    }
+    for (i = summaryNextFree(last + 1); i < DISK_BLOCKS; i = summaryNextFree(i + 1))
+    {
+        if (map[i] == '\0')
+        {
+            setBlockTag(i, (char)(file_index + 1));
+            return i;
+        }
+    }
+    return -1; // growChain makes room, before a write has walked the chain
+}
+
+int allocBlock(char tag)
+{
+    unsigned long long t = statStart();
+    int rtn = scanAllocBlock(tag);
+    statEnd(OP_MAP_SCAN, t, rtn, 0);
+    return rtn;
+}
+
+int scanAllocBlock(char tag)
+{
+    char buf[BLOCK_SIZE];
+
+    /* the groups before the first one with a free block are skipped */
+    int i = summaryNextFree(0);
+    while (i < DISK_BLOCKS)
+    {
+        int map_index = SBP->data_index + i / BLOCK_SIZE;
+        readBlock(map_index, buf);
+        for (; i < DISK_BLOCKS && SBP->data_index + i / BLOCK_SIZE == map_index; i++)
+        {
+            if (buf[i % BLOCK_SIZE] == '\0')
+            {
+                buf[i % BLOCK_SIZE] = tag;
+                writeBlock(map_index, buf);
+                return i; // block number determine
+            }
+        }
+    }
+    return -1;
+}
+
+void setBlockTag(int block, char tag)
+{
+    char buf[BLOCK_SIZE];
+    memset(buf, 0, BLOCK_SIZE);
+    int map_index = SBP->data_index + block / BLOCK_SIZE;
+
+    readBlock(map_index, buf);
+    buf[block % BLOCK_SIZE] = tag;
+    writeBlock(map_index, buf);
+}
+
+int findNextBlock(int current, char file_index)
+{
+    char buf[BLOCK_SIZE];
+    int i;
+
+    statCount(OP_CHAIN_STEP); // once per block of a walk, too often to time
+
+    for (i = current + 1; i < DISK_BLOCKS; i++)
+    {
+        if (i == current + 1 || i % BLOCK_SIZE == 0)
+            readBlock(SBP->data_index + i / BLOCK_SIZE, buf); // on into the next map block
+        if (buf[i % BLOCK_SIZE] == (file_index + 1))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int fragsFor(int size)
+{
+    return (size + FRAG_SIZE - 1) / FRAG_SIZE;
+}
+
+int findFreeFrags(char file_index, int need, int *tail, int *frag)
+{
+    int tails[MAX_FILE];
+    int slots[MAX_FILE][FRAGS_PER_BLOCK];
+    int n = 0;
+    int i, j, k;
+
+    /* fragment slots taken in every tail block, apart from our own */
+    memset(slots, 0, sizeof(slots));
+    for (i = 0; i < MAX_FILE; i++)
+    {
+        file_info *file = &dir_pointer[i];
+        if (file->used == False || file->tail == -1)
+        {
+            continue;
+        }
+        for (j = 0; j < n && tails[j] != file->tail; j++)
+            ;
+        if (j == n)
+        {
+            tails[n++] = file->tail;
+        }
+        if (i == file_index)
+        {
+            continue;
+        }
+        for (k = 0; k < fragsFor(file->size); k++)
+        {
+            slots[j][file->frag + k] = 1;
+        }
+    }
+
+    /* best fit: the fullest tail block that still has a long enough run */
+    int best = -1, best_free = FRAGS_PER_BLOCK + 1, best_frag = 0;
+    for (j = 0; j < n; j++)
+    {
+        int free_slots = 0, run = 0, run_start = -1;
+        for (k = 0; k < FRAGS_PER_BLOCK; k++)
+        {
+            if (slots[j][k])
+            {
+                run = 0;
+                continue;
+            }
+            free_slots++;
+            if (++run == need && run_start == -1)
+            {
+                run_start = k - need + 1;
+            }
+        }
+        if (run_start != -1 && free_slots < best_free)
+        {
+            best = j;
+            best_free = free_slots;
+            best_frag = run_start;
+        }
+    }
+
+    if (best != -1)
+    {
+        *tail = tails[best];
+        *frag = best_frag;
+        return 0;
+    }
+
+    /* no room left, start a new tail block */
+    *tail = allocBlock(MAP_TAIL);
+    *frag = 0;
+    return *tail < 0 ? -1 : 0;
+}
+
+void releaseTail(int tail)
+{
+    for (int i = 0; i < MAX_FILE; i++)
+    {
+        if (dir_pointer[i].used == True && dir_pointer[i].tail == tail)
+        {
+            return; // still shared by another file
+        }
+    }
+    setBlockTag(tail, '\0');
+}
+
+int unpackFile(char file_index)
+{
+    file_info *file = &dir_pointer[file_index];
+    char tail_block[BLOCK_SIZE];
+    char block[BLOCK_SIZE];
+    memset(tail_block, 0, BLOCK_SIZE);
+    memset(block, 0, BLOCK_SIZE);
+
+    int block_index = findFreeBlock(file_index);
+    if (block_index < 0)
+    {
+        return -1;
+    }
+
+    /* move the fragments into a whole block of the file's own */
+    readBlock(file->tail, tail_block);
+    memcpy(block, tail_block + file->frag * FRAG_SIZE, file->size);
+    writeBlock(block_index, block);
+
+    int tail = file->tail;
+    file->head = block_index;
+    file->num_blocks = 1;
+    file->tail = -1;
+    releaseTail(tail);
+    return 0;
+}
+
+int packWrite(int fildes, char *src, int nbyte)
+{
+    char block[BLOCK_SIZE];
+    memset(block, 0, BLOCK_SIZE);
+    char file_index = META[fildes].file;
+    file_info *file = &dir_pointer[file_index];
+    int offset = META[fildes].offset;
+    int need = fragsFor(offset + nbyte);
+
+    if (file->tail == -1 || need > fragsFor(file->size))
+    {
+        /* the file grows out of its fragments, move it to a longer run */
+        char old[BLOCK_SIZE];
+        memset(old, 0, BLOCK_SIZE);
+        int old_tail = file->tail;
+        int tail, frag;
+
+        if (old_tail != -1)
+        {
+            readBlock(old_tail, old);
+        }
+        if (findFreeFrags(file_index, need, &tail, &frag) == -1)
+        {
+            return -1;
+        }
+        readBlock(tail, block);
+        if (old_tail != -1)
+        {
+            memcpy(block + frag * FRAG_SIZE, old + file->frag * FRAG_SIZE, file->size);
+        }
+        file->tail = tail;
+        file->frag = frag;
+        if (old_tail != -1 && old_tail != tail)
+        {
+            releaseTail(old_tail);
+        }
+    }
+    else
+    {
+        readBlock(file->tail, block);
+    }
+
+    memcpy(block + file->frag * FRAG_SIZE + offset, src, nbyte);
+    writeBlock(file->tail, block);
+
+    META[fildes].offset += nbyte;
+    if (file->size < META[fildes].offset)
+    {
+        file->size = META[fildes].offset;
+    }
+    return nbyte;
+}
+
+int blocksFor(int size)
+{
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+void loadMap(char *map)
+{
+    for (int i = 0; i < MAP_BLOCKS; i++)
+        readBlock(SBP->data_index + i, map + i * BLOCK_SIZE);
+}
+
+void storeMap(char *map)
+{
+    for (int i = 0; i < MAP_BLOCKS; i++)
+        writeBlock(SBP->data_index + i, map + i * BLOCK_SIZE);
+}
+
+int allocRun(char tag, int n)
+{
+    unsigned long long t = statStart();
+    int rtn = scanAllocRun(tag, n);
+    statEnd(OP_MAP_SCAN, t, rtn, 0);
+    return rtn;
+}
+
+int scanAllocRun(char tag, int n)
+{
+    char map[MAP_BLOCKS * BLOCK_SIZE];
+    int i, run = 0;
+
+    loadMap(map);
+    for (i = 0; i < DISK_BLOCKS; i++)
+    {
+        if (run == 0 && (i = summaryNextFree(i)) == DISK_BLOCKS)
+        {
+            break; // a run starts in a group with a free block
+        }
+        run = (map[i] == '\0') ? run + 1 : 0;
+        if (run == n)
+        {
+            int start = i - n + 1;
+            memset(map + start, tag, n);
+            storeMap(map);
+            return start; // first block of the run
+        }
+    }
+    return -1;
+}
+
+void freeRun(int start, int n)
+{
+    char map[MAP_BLOCKS * BLOCK_SIZE];
+
+    loadMap(map);
+    memset(map + start, 0, n);
+    storeMap(map);
+}
+
+cluster_cache *loadCluster(char file_index, cluster_entry *entry, int cluster)
+{
+    static char run[CLUSTER_SIZE_MAX];
+    int i, victim = 0;
+
+    for (i = 0; i < CLUSTER_CACHE; i++)
+    {
+        cluster_cache *cc = &CCACHE[i];
+        if (cc->valid && cc->file == file_index && cc->cluster == cluster)
+        {
+            cc->used = ++cache_clock;
+            return cc;
+        }
+        if (CCACHE[victim].valid && (!cc->valid || cc->used < CCACHE[victim].used))
+        {
+            victim = i;
+        }
+    }
+
+    /* miss, decompress into the least recently used slot */
+    cluster_cache *cc = &CCACHE[victim];
+    cc->valid = False;
+    memset(cc->data, 0, CLUSTER_SIZE);
+    if (entry->block != -1)
+    {
+        int len = entry->clen & ~COMP_RAW;
+        for (i = 0; i < blocksFor(len); i++)
+        {
+            if (readBlock(entry->block + i, run + i * BLOCK_SIZE) == -1)
+            {
+                return NULL;
+            }
+        }
+        if (entry->clen & COMP_RAW)
+        {
+            memcpy(cc->data, run, len);
+        }
+        else if (lz_decompress(run, len, cc->data, CLUSTER_SIZE) < 0)
+        {
+            return NULL;
+        }
+    }
+    cc->valid = True;
+    cc->file = file_index;
+    cc->cluster = cluster;
+    cc->used = ++cache_clock;
+    return cc;
+}
+
+int storeCluster(char file_index, cluster_entry *entry, char *data, int rawlen)
+{
+    static char out[LZ_BOUND(CLUSTER_SIZE_MAX)];
+    file_info *file = &dir_pointer[file_index];
+    char *payload = out;
+    int i;
+
+    /* only keep the compressed form if it saves something */
+    int clen = lz_compress(data, rawlen, out, rawlen - 1);
+    if (clen < 0)
+    {
+        payload = data;
+        clen = rawlen | COMP_RAW;
+    }
+
+    int len = clen & ~COMP_RAW;
+    int old = (entry->block == -1) ? 0 : blocksFor(entry->clen & ~COMP_RAW);
+    int nblk = blocksFor(len);
+
+    if (nblk != old)
+    {
+        /* the run changes length, give it back and take one that fits */
+        if (old > 0)
+        {
+            freeRun(entry->block, old);
+        }
+        file->num_blocks -= old;
+        entry->block = allocRun((char)(file_index + 1), nblk);
+        if (entry->block == -1)
+        {
+            entry->clen = 0;
+            return -1;
+        }
+        file->num_blocks += nblk;
+    }
+    entry->clen = clen;
+
+    for (i = 0; i < nblk; i++)
+    {
+        char block[BLOCK_SIZE];
+        memset(block, 0, BLOCK_SIZE);
+        int n = (len - i * BLOCK_SIZE < BLOCK_SIZE) ? len - i * BLOCK_SIZE : BLOCK_SIZE;
+        memcpy(block, payload + i * BLOCK_SIZE, n);
+        writeBlock(entry->block + i, block);
+    }
+    return 0;
+}
+
+void dropClusters(char file_index)
+{
+    for (int i = 0; i < CLUSTER_CACHE; i++)
+    {
+        if (file_index == -1 || CCACHE[i].file == file_index)
+        {
+            CCACHE[i].valid = False;
+        }
+    }
+}
+
+int compRead(int fildes, char *dst, int nbyte)
+{
+    cluster_entry index[CLUSTERS_PER_FILE];
+    char file_index = META[fildes].file;
+    file_info *file = &dir_pointer[file_index];
+    int offset = META[fildes].offset;
+    int r_found = 0;
+
+    readBlock(file->head, (char *)index);
+    while (r_found < nbyte)
+    {
+        int cluster = (offset + r_found) / CLUSTER_SIZE;
+        int at = (offset + r_found) % CLUSTER_SIZE;
+        int n = CLUSTER_SIZE - at;
+        if (n > nbyte - r_found)
+        {
+            n = nbyte - r_found;
+        }
+
+        cluster_cache *cc = loadCluster(file_index, &index[cluster], cluster);
+        if (cc == NULL)
+        {
+            return -1; // corrupt cluster
+        }
+        memcpy(dst + r_found, cc->data + at, n);
+        r_found += n;
+    }
+
+    META[fildes].offset += r_found;
+    return r_found;
+}
+
+int compWrite(int fildes, char *src, int nbyte)
+{
+    cluster_entry index[CLUSTERS_PER_FILE];
+    char file_index = META[fildes].file;
+    file_info *file = &dir_pointer[file_index];
+    int offset = META[fildes].offset;
+    int w_found = 0;
+    int i;
+
+    if ((long long)offset + nbyte > (long long)CLUSTERS_PER_FILE * CLUSTER_SIZE)
+    {
+        return -1;
+    }
+
+    if (file->head == -1)
+    {
+        /* first write, set up the cluster index */
+        int head = findFreeBlock(file_index);
+        if (head < 0)
+        {
+            return -1;
+        }
+        file->head = head;
+        file->num_blocks = 1;
+        for (i = 0; i < CLUSTERS_PER_FILE; i++)
+        {
+            index[i].block = -1;
+            index[i].clen = 0;
+        }
+    }
+    else
+    {
+        readBlock(file->head, (char *)index);
+    }
+
+    while (w_found < nbyte)
+    {
+        int pos = offset + w_found;
+        int cluster = pos / CLUSTER_SIZE;
+        int at = pos % CLUSTER_SIZE;
+        int n = CLUSTER_SIZE - at;
+        if (n > nbyte - w_found)
+        {
+            n = nbyte - w_found;
+        }
+
+        /* raw length of the cluster once this write lands */
+        int rawlen = file->size - cluster * CLUSTER_SIZE;
+        if (rawlen > CLUSTER_SIZE)
+        {
+            rawlen = CLUSTER_SIZE;
+        }
+        if (rawlen < at + n)
+        {
+            rawlen = at + n;
+        }
+
+        cluster_cache *cc = loadCluster(file_index, &index[cluster], cluster);
+        if (cc == NULL)
+        {
+            break;
+        }
+        memcpy(cc->data + at, src + w_found, n);
+        if (storeCluster(file_index, &index[cluster], cc->data, rawlen) == -1)
+        {
+            cc->valid = False;
+            break;
+        }
+        w_found += n;
+    }
+    writeMeta(file->head, (char *)index);
+
+    META[fildes].offset += w_found;
+    if (file->size < META[fildes].offset)
+    {
+        file->size = META[fildes].offset;
+    }
+    return (w_found > 0) ? w_found : -1;
+}
+
+int compTruncate(char file_index, int length)
+{
+    cluster_entry index[CLUSTERS_PER_FILE];
+    char map[MAP_BLOCKS * BLOCK_SIZE];
+    file_info *file = &dir_pointer[file_index];
+    int keep = (length + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    int i;
+
+    if (file->head == -1)
+    {
+        return 0;
+    }
+    readBlock(file->head, (char *)index);
+
+    /* the last cluster kept shrinks to the new length */
+    if (length % CLUSTER_SIZE != 0)
+    {
+        cluster_cache *cc = loadCluster(file_index, &index[keep - 1], keep - 1);
+        if (cc == NULL || storeCluster(file_index, &index[keep - 1], cc->data, length % CLUSTER_SIZE) == -1)
+        {
+            return -1;
+        }
+    }
+    dropClusters(file_index);
+
+    /* the ones after it are dropped */
+    loadMap(map);
+    for (i = keep; i < CLUSTERS_PER_FILE; i++)
+    {
+        if (index[i].block != -1)
+        {
+            int nblk = blocksFor(index[i].clen & ~COMP_RAW);
+            memset(map + index[i].block, 0, nblk);
+            file->num_blocks -= nblk;
+            index[i].block = -1;
+            index[i].clen = 0;
+        }
+    }
+
+    if (keep == 0)
+    {
+        map[file->head] = '\0';
+        file->head = -1;
+        file->num_blocks = 0;
+    }
+    else
+    {
+        writeMeta(file->head, (char *)index);
+    }
+    storeMap(map);
+    return 0;
+}
+
+void readIndex(int head, int *index, int first, int last)
+{
+    for (int i = first / INDEX_PER_BLOCK; i <= last / INDEX_PER_BLOCK; i++)
+    {
+        readBlock(head + i, (char *)(index + i * INDEX_PER_BLOCK));
+    }
+}
+
+void writeIndex(int head, int *index, int first, int last)
+{
+    for (int i = first / INDEX_PER_BLOCK; i <= last / INDEX_PER_BLOCK; i++)
+    {
+        writeMeta(head + i, (char *)(index + i * INDEX_PER_BLOCK));
+    }
+}
+
+void dropRef(int block)
+{
+    if (--REFS[block] == 0)
+    {
+        setBlockTag(block, '\0');
+    }
+}
+
+int putBlock(file_info *file, int old, char *data)
+{
+    unsigned long long hash = 0;
+
+    if (file->flags & FI_DEDUP)
+    {
+        hash = hash64(data, BLOCK_SIZE, 0);
+        int dup = findDuplicate(hash, data);
+        if (dup != -1)
+        {
+            /* identical block already on disk, share it */
+            DSTATS.dedup_hits++;
+            if (dup != old)
+            {
+                REFS[dup]++;
+                if (old != -1)
+                {
+                    dropRef(old);
+                }
+            }
+            return dup;
+        }
+    }
+
+    /* copy on write, a block somebody else references is never changed in place */
+    int block = old;
+    if (old == -1 || REFS[old] > 1)
+    {
+        block = allocBlock(MAP_SHARED);
+        if (block == -1)
+        {
+            return -1;
+        }
+        REFS[block] = 1;
+        if (old != -1)
+        {
+            REFS[old]--;
+        }
+    }
+    writeBlock(block, data);
+
+    if (file->flags & FI_DEDUP)
+    {
+        addFingerprint(hash, block);
+    }
+    return block;
+}
+
+static int bloomBit(unsigned long long hash, int probe)
+{
+    return (int)((hash >> (probe * 16)) & (BLOOM_BITS - 1));
+}
+
+int findDuplicate(unsigned long long hash, char *data)
+{
+    fp_entry bucket[FP_PER_BLOCK];
+    char block[BLOCK_SIZE];
+    int i;
+
+    if (!bloom_ready)
+    {
+        loadFingerprints();
+    }
+
+    /* the filter keeps unique blocks away from the on-disk index */
+    for (i = 0; i < 3; i++)
+    {
+        int bit = bloomBit(hash, i);
+        if (!(BLOOM[bit / 8] & (1 << (bit % 8))))
+        {
+            DSTATS.filter_skips++;
+            return -1;
+        }
+    }
+
+    DSTATS.index_lookups++;
+    readBlock(SBP->fp_index + (int)(hash % FP_BLOCKS), (char *)bucket);
+    for (i = 0; i < FP_PER_BLOCK; i++)
+    {
+        int b = bucket[i].block;
+        if (b == 0 || bucket[i].hash != hash || REFS[b] == 0 || REFS[b] == REF_MAX)
+        {
+            continue;
+        }
+        /* entries go stale when a private block is rewritten, so compare */
+        readBlock(b, block);
+        if (memcmp(block, data, BLOCK_SIZE) == 0)
+        {
+            return b;
+        }
+    }
+    return -1;
+}
+
+void addFingerprint(unsigned long long hash, int block)
+{
+    fp_entry bucket[FP_PER_BLOCK];
+    int bucket_index = SBP->fp_index + (int)(hash % FP_BLOCKS);
+    int i, slot = -1;
+
+    readBlock(bucket_index, (char *)bucket);
+    for (i = 0; i < FP_PER_BLOCK; i++)
+    {
+        int b = bucket[i].block;
+        if (b == block)
+        {
+            slot = i;
+            break;
+        }
+        if (slot == -1 && (b == 0 || REFS[b] == 0))
+        {
+            slot = i; // empty, or the block has been freed since
+        }
+    }
+    if (slot == -1)
+    {
+        return; // bucket full, the block just stays unique
+    }
+
+    bucket[slot].hash = hash;
+    bucket[slot].block = block;
+    writeMeta(bucket_index, (char *)bucket);
+
+    for (i = 0; i < 3; i++)
+    {
+        int bit = bloomBit(hash, i);
+        BLOOM[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+void loadFingerprints(void)
+{
+    fp_entry bucket[FP_PER_BLOCK];
+
+    memset(BLOOM, 0, sizeof(BLOOM));
+    for (int i = 0; i < FP_BLOCKS; i++)
+    {
+        readBlock(SBP->fp_index + i, (char *)bucket);
+        for (int j = 0; j < FP_PER_BLOCK; j++)
+        {
+            if (bucket[j].block == 0 || REFS[bucket[j].block] == 0)
+            {
+                continue;
+            }
+            for (int k = 0; k < 3; k++)
+            {
+                int bit = bloomBit(bucket[j].hash, k);
+                BLOOM[bit / 8] |= 1 << (bit % 8);
+            }
+        }
+    }
+    bloom_ready = True;
+}
+
+int mapRead(int fildes, char *dst, int nbyte)
+{
+    static int index[MAP_INDEX_ENTRIES_MAX];
+    char block[BLOCK_SIZE];
+    file_info *file = &dir_pointer[META[fildes].file];
+    int offset = META[fildes].offset;
+    int r_found = 0;
+
+    readIndex(file->head, index, offset / BLOCK_SIZE, (offset + nbyte - 1) / BLOCK_SIZE);
+    while (r_found < nbyte)
+    {
+        int pos = offset + r_found;
+        int at = pos % BLOCK_SIZE;
+        int n = BLOCK_SIZE - at;
+        if (n > nbyte - r_found)
+        {
+            n = nbyte - r_found;
+        }
+
+        if (readBlock(index[pos / BLOCK_SIZE], block) == -1)
+        {
+            return -1;
+        }
+        memcpy(dst + r_found, block + at, n);
+        r_found += n;
+    }
+
+    META[fildes].offset += r_found;
+    return r_found;
+}
+
+int mapWrite(int fildes, char *src, int nbyte)
+{
+    static int index[MAP_INDEX_ENTRIES_MAX];
+    char block[BLOCK_SIZE];
+    char file_index = META[fildes].file;
+    file_info *file = &dir_pointer[file_index];
+    int offset = META[fildes].offset;
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + nbyte - 1) / BLOCK_SIZE;
+    int w_found = 0;
+
+    if ((long long)offset + nbyte > (long long)MAP_INDEX_ENTRIES * BLOCK_SIZE)
+    {
+        return -1;
+    }
+
+    if (file->head == -1 && newIndex(file_index) == -1)
+    {
+        return -1;
+    }
+    readIndex(file->head, index, first, last);
+
+    while (w_found < nbyte)
+    {
+        int pos = offset + w_found;
+        int lb = pos / BLOCK_SIZE;
+        int at = pos % BLOCK_SIZE;
+        int n = BLOCK_SIZE - at;
+        if (n > nbyte - w_found)
+        {
+            n = nbyte - w_found;
+        }
+
+        /* partial block, merge with what is there */
+        memset(block, 0, BLOCK_SIZE);
+        if (n < BLOCK_SIZE && index[lb] != -1)
+        {
+            readBlock(index[lb], block);
+        }
+        memcpy(block + at, src + w_found, n);
+
+        int b = putBlock(file, index[lb], block);
+        if (b == -1)
+        {
+            break;
+        }
+        if (index[lb] == -1)
+        {
+            file->num_blocks++;
+        }
+        index[lb] = b;
+        w_found += n;
+    }
+    writeIndex(file->head, index, first, last);
+
+    META[fildes].offset += w_found;
+    if (file->size < META[fildes].offset)
+    {
+        file->size = META[fildes].offset;
+    }
+    return (w_found > 0) ? w_found : -1;
+}
+
+int newIndex(char file_index)
+{
+    static int index[MAP_INDEX_ENTRIES_MAX];
+    file_info *file = &dir_pointer[file_index];
+
+    /* first write, set up an empty index */
+    int head = allocRun((char)(file_index + 1), MAP_INDEX_BLOCKS);
+    if (head < 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < MAP_INDEX_ENTRIES; i++)
+    {
+        index[i] = -1;
+    }
+    writeIndex(head, index, 0, MAP_INDEX_ENTRIES - 1);
+    file->head = head;
+    file->num_blocks = MAP_INDEX_BLOCKS;
+    return 0;
+}
+
+int mapTruncate(char file_index, int length)
+{
+    static int index[MAP_INDEX_ENTRIES_MAX];
+    file_info *file = &dir_pointer[file_index];
+    int keep = blocksFor(length);
+
+    if (file->head == -1)
+    {
+        return 0;
+    }
+
+    readIndex(file->head, index, 0, MAP_INDEX_ENTRIES - 1);
+    for (int i = keep; i < MAP_INDEX_ENTRIES; i++)
+    {
+        if (index[i] != -1)
+        {
+            dropRef(index[i]);
+            index[i] = -1;
+            file->num_blocks--;
+        }
+    }
+
+    if (keep == 0)
+    {
+        freeRun(file->head, MAP_INDEX_BLOCKS);
+        file->head = -1;
+        file->num_blocks = 0;
+    }
+    else
+    {
+        writeIndex(file->head, index, 0, MAP_INDEX_ENTRIES - 1);
+    }
+    return 0;
+}
+
+int shareBlock(int block)
+{
+    char data[BLOCK_SIZE];
+
+    if (REFS[block] < REF_MAX)
+    {
+        REFS[block]++;
+        return block;
+    }
+
+    /* the count is saturated, the new reference gets its own copy */
+    int copy = allocBlock(MAP_SHARED);
+    if (copy == -1)
+    {
+        return -1;
+    }
+    readBlock(block, data);
+    writeBlock(copy, data);
+    REFS[copy] = 1;
+    return copy;
+}
+
+int mapFile(char file_index)
+{
+    static int index[MAP_INDEX_ENTRIES_MAX];
+    char map[MAP_BLOCKS * BLOCK_SIZE];
+    file_info *file = &dir_pointer[file_index];
+    int block_index = file->head;
+    int i, n = 0;
+
+    if (file->num_blocks > MAP_INDEX_ENTRIES)
+    {
+        return -1;
+    }
+
+    /* the chain in file order becomes the index */
+    while (block_index != -1 && n < file->num_blocks)
+    {
+        index[n++] = block_index;
+        block_index = findNextBlock(block_index, file_index);
+    }
+    for (i = n; i < MAP_INDEX_ENTRIES; i++)
+    {
+        index[i] = -1;
+    }
+
+    int head = allocRun(MAP_SHARED, MAP_INDEX_BLOCKS);
+    if (head == -1)
+    {
+        return -1;
+    }
+
+    /* the data blocks get a reference count, the index run the file's tag */
+    loadMap(map);
+    for (i = 0; i < n; i++)
+    {
+        map[index[i]] = MAP_SHARED;
+        REFS[index[i]] = 1;
+    }
+    memset(map + head, file_index + 1, MAP_INDEX_BLOCKS);
+    storeMap(map);
+    writeIndex(head, index, 0, MAP_INDEX_ENTRIES - 1);
+
+    file->head = head;
+    file->num_blocks = n + MAP_INDEX_BLOCKS;
+    file->flags |= FI_MAPPED;
+    return 0;
+}
+
+int copyIndex(int head, char tag)
+{
+    static int index[MAP_INDEX_ENTRIES_MAX];
+    int i, j;
+
+    int copy = allocRun(tag, MAP_INDEX_BLOCKS);
+    if (copy == -1)
+    {
+        return -1;
+    }
+
+    readIndex(head, index, 0, MAP_INDEX_ENTRIES - 1);
+    for (i = 0; i < MAP_INDEX_ENTRIES; i++)
+    {
+        if (index[i] != -1 && (index[i] = shareBlock(index[i])) == -1)
+        {
+            /* give back the references taken so far */
+            for (j = 0; j < i; j++)
+            {
+                if (index[j] != -1)
+                {
+                    dropRef(index[j]);
+                }
+            }
+            freeRun(copy, MAP_INDEX_BLOCKS);
+            return -1;
+        }
+    }
+    writeIndex(copy, index, 0, MAP_INDEX_ENTRIES - 1);
+    return copy;
+}
+
+void freeIndex(int head)
+{
+    static int index[MAP_INDEX_ENTRIES_MAX];
+
+    readIndex(head, index, 0, MAP_INDEX_ENTRIES - 1);
+    for (int i = 0; i < MAP_INDEX_ENTRIES; i++)
+    {
+        if (index[i] != -1)
+        {
+            dropRef(index[i]);
+        }
+    }
+    freeRun(head, MAP_INDEX_BLOCKS);
+}
+
+int copyClusters(int head, char tag)
+{
+    cluster_entry index[CLUSTERS_PER_FILE];
+    char block[BLOCK_SIZE];
+    int i, j;
+
+    int copy = allocBlock(tag);
+    if (copy == -1)
+    {
+        return -1;
+    }
+
+    readBlock(head, (char *)index);
+    for (i = 0; i < CLUSTERS_PER_FILE; i++)
+    {
+        if (index[i].block == -1)
+        {
+            continue;
+        }
+        int nblk = blocksFor(index[i].clen & ~COMP_RAW);
+        int run = allocRun(tag, nblk);
+        if (run == -1)
+        {
+            /* the runs copied so far are listed, the rest are not ours */
+            for (j = i; j < CLUSTERS_PER_FILE; j++)
+            {
+                index[j].block = -1;
+            }
+            writeMeta(copy, (char *)index);
+            freeClusters(copy);
+            return -1;
+        }
+        for (j = 0; j < nblk; j++)
+        {
+            readBlock(index[i].block + j, block);
+            writeBlock(run + j, block);
+        }
+        index[i].block = run;
+    }
+    writeMeta(copy, (char *)index);
+    return copy;
+}
+
+void freeClusters(int head)
+{
+    cluster_entry index[CLUSTERS_PER_FILE];
+
+    readBlock(head, (char *)index);
+    for (int i = 0; i < CLUSTERS_PER_FILE; i++)
+    {
+        if (index[i].block != -1)
+        {
+            freeRun(index[i].block, blocksFor(index[i].clen & ~COMP_RAW));
+        }
+    }
+    setBlockTag(head, '\0');
+}
+
+int copyFrags(int src_tail, int src_frag, char file_index)
+{
+    file_info *file = &dir_pointer[file_index];
+    char old[BLOCK_SIZE];
+    char block[BLOCK_SIZE];
+    memset(old, 0, BLOCK_SIZE);
+    memset(block, 0, BLOCK_SIZE);
+    int tail, frag;
+
+    /* the source is read first, the new fragments may land in the same block */
+    readBlock(src_tail, old);
+    if (findFreeFrags(file_index, fragsFor(file->size), &tail, &frag) == -1)
+    {
+        return -1;
+    }
+    readBlock(tail, block);
+    memcpy(block + frag * FRAG_SIZE, old + src_frag * FRAG_SIZE, file->size);
+    writeBlock(tail, block);
+
+    file->tail = tail;
+    file->frag = frag;
+    return 0;
+}
+
+void freeSnapshot(snapshot *snap)
+{
+    int i, j;
+
+    for (i = 0; i < MAX_FILE; i++)
+    {
+        file_info *copy = &snap->dir[i];
+        if (!copy->used)
+        {
+            continue;
+        }
+        if (copy->head != -1)
+        {
+            if (copy->flags & FI_COMPRESS)
+            {
+                freeClusters(copy->head);
+            }
+            else
+            {
+                freeIndex(copy->head);
+            }
+        }
+        else if (copy->tail != -1)
+        {
+            /* a tail copy is shared by the files packed together */
+            for (j = 0; j < i && !(snap->dir[j].used && snap->dir[j].tail == copy->tail); j++)
+                ;
+            if (j == i)
+            {
+                setBlockTag(copy->tail, '\0');
+            }
+        }
+    }
+}
+
+int chainBlocks(char file_index, int first, int count, int *blocks, boolean grow)
+{
+    unsigned long long t = statStart();
+    int rtn = scanChain(file_index, first, count, blocks, grow);
+    statEnd(OP_CHAIN_WALK, t, rtn, 0);
+    return rtn;
+}
+
+int scanChain(char file_index, int first, int count, int *blocks, boolean grow)
+{
+    char map[MAP_BLOCKS * BLOCK_SIZE];
+    file_info *file = &dir_pointer[file_index];
+    int b, lb = -1;
+
+    /* the chain is the file's blocks in ascending order from its head */
+    loadMap(map);
+    for (b = file->head; b != -1 && b < DISK_BLOCKS && lb < first + count - 1; b++)
+    {
+        if (map[b] == file_index + 1 && ++lb >= first)
+        {
+            blocks[lb - first] = b;
+        }
+    }
+
+    /* blocks past the end are allocated when writing */
+    for (lb++; lb < first + count; lb++)
+    {
+        if (!grow || (b = findFreeBlock(file_index)) < 0)
+        {
+            return -1;
+        }
+        if (file->head == -1)
+        {
+            file->head = b;
+        }
+        file->num_blocks++;
+        if (lb >= first)
+        {
+            blocks[lb - first] = b;
+        }
+    }
+    return 0;
+}
+
+int chainRead(char file_index, int off, char *dst, int n)
+{
+    static char run[COPY_CHUNK_MAX + BLOCK_SIZE_MAX];
+    int blocks[COPY_BLOCKS + 1];
+    int first = off / BLOCK_SIZE;
+    int count = (off + n - 1) / BLOCK_SIZE - first + 1;
+
+    if (count > COPY_BLOCKS + 1 || chainBlocks(file_index, first, count, blocks, False) == -1)
+    {
+        return -1;
+    }
+
+    /* whole blocks land in place, anything else is staged */
+    if (off % BLOCK_SIZE == 0 && n % BLOCK_SIZE == 0)
+    {
+        return readBlocks(blocks, count, dst) == -1 ? -1 : n;
+    }
+    if (readBlocks(blocks, count, run) == -1)
+    {
+        return -1;
+    }
+    memcpy(dst, run + off % BLOCK_SIZE, n);
+    return n;
+}
+
+int chainWrite(char file_index, int off, char *src, int n)
+{
+    static char run[COPY_CHUNK_MAX + BLOCK_SIZE_MAX];
+    int blocks[COPY_BLOCKS + 1];
+    file_info *file = &dir_pointer[file_index];
+    int first = off / BLOCK_SIZE;
+    int count = (off + n - 1) / BLOCK_SIZE - first + 1;
+    int at = off % BLOCK_SIZE;
+    int end = (off + n) % BLOCK_SIZE;
+
+    if (count > COPY_BLOCKS + 1 || growChain(file_index, first + count - file->num_blocks) == -1 ||
+        chainBlocks(file_index, first, count, blocks, True) == -1)
+    {
+        return -1;
+    }
+
+    if (at == 0 && end == 0)
+    {
+        if (writeBlocks(blocks, count, src) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        /* only the edge blocks keep bytes from outside the range */
+        memset(run + (count - 1) * BLOCK_SIZE, 0, BLOCK_SIZE);
+        if (at != 0)
+        {
+            readBlock(blocks[0], run);
+        }
+        if (end != 0 && off + n < file->size && (count > 1 || at == 0))
+        {
+            readBlock(blocks[count - 1], run + (count - 1) * BLOCK_SIZE);
+        }
+        memcpy(run + at, src, n);
+        if (writeBlocks(blocks, count, run) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if (file->size < off + n)
+    {
+        file->size = off + n;
+    }
+    return n;
+}
+
+/* fs_read/fs_write of chain files in COPY_CHUNK passes from the descriptor's offset */
+int chainSpan(int fildes, char *buf, int nbyte, boolean write)
+{
+    char file_index = META[fildes].file;
+    int done = 0;
+
+    while (done < nbyte)
+    {
+        int off = META[fildes].offset;
+        int n = COPY_CHUNK - off % BLOCK_SIZE;
+        if (n > nbyte - done)
+        {
+            n = nbyte - done;
+        }
+        if ((write ? chainWrite(file_index, off, buf + done, n) : chainRead(file_index, off, buf + done, n)) != n)
+        {
+            return -1;
+        }
+        META[fildes].offset += n;
+        done += n;
+    }
+    return done;
+}
+
+int rangeRead(int fildes, int off, char *dst, int n)
+{
+    file_info *file = &dir_pointer[META[fildes].file];
+    int saved = META[fildes].offset;
+    int rtn;
+
+    if ((file->flags & (FI_COMPRESS | FI_MAPPED)) || file->tail != -1)
+    {
+        /* these layouts already copy whole spans */
+        META[fildes].offset = off;
+        rtn = readFile(fildes, dst, n);
+        META[fildes].offset = saved;
+        return rtn;
+    }
+    return chainRead(META[fildes].file, off, dst, n);
+}
+
+int rangeWrite(int fildes, int off, char *src, int n)
+{
+    char file_index = META[fildes].file;
+    file_info *file = &dir_pointer[file_index];
+    int saved = META[fildes].offset;
+    int rtn;
+
+    if ((file->flags & (FI_COMPRESS | FI_MAPPED)) || (file->head == -1 && off + n <= PACK_MAX))
+    {
+        META[fildes].offset = off;
+        rtn = writeFile(fildes, src, n);
+        META[fildes].offset = saved;
+        return rtn;
+    }
+    if (file->tail != -1 && unpackFile(file_index) == -1)
+    {
+        return -1;
+    }
+    return chainWrite(file_index, off, src, n);
+}
+
+int shareRange(char src_index, int src_off, char dst_index, int dst_off, int len)
+{
+    static int src_map[MAP_INDEX_ENTRIES_MAX];
+    static int dst_map[MAP_INDEX_ENTRIES_MAX];
+    file_info *src = &dir_pointer[src_index];
+    file_info *dst = &dir_pointer[dst_index];
+    int s = src_off / BLOCK_SIZE;
+    int d = dst_off / BLOCK_SIZE;
+    int nblk = len / BLOCK_SIZE;
+    int i;
+
+    if (nblk == 0 || (dst_off + len) / BLOCK_SIZE > MAP_INDEX_ENTRIES)
+    {
+        return 0; // nothing whole to share, or the staged path reports the limit
+    }
+    if (dst->head == -1 && newIndex(dst_index) == -1)
+    {
+        return -1;
+    }
+
+    readIndex(src->head, src_map, s, s + nblk - 1);
+    readIndex(dst->head, dst_map, d, d + nblk - 1);
+    for (i = 0; i < nblk; i++)
+    {
+        int b = shareBlock(src_map[s + i]);
+        if (b == -1)
+        {
+            break;
+        }
+        if (dst_map[d + i] != -1)
+        {
+            dropRef(dst_map[d + i]);
+        }
+        else
+        {
+            dst->num_blocks++;
+        }
+        dst_map[d + i] = b;
+    }
+    writeIndex(dst->head, dst_map, d, d + nblk - 1);
+
+    if (dst->size < dst_off + i * BLOCK_SIZE)
+    {
+        dst->size = dst_off + i * BLOCK_SIZE;
+    }
+    return i * BLOCK_SIZE;
+}
+
+int fileBlocks(char file_index, int *blocks)
+{
+    static int index[MAP_INDEX_ENTRIES_MAX];
+    file_info *file = &dir_pointer[file_index];
+    int i, n = 0;
+
+    if (file->head == -1 || (file->flags & FI_COMPRESS))
+    {
+        return 0; // packed files and compressed clusters are not moved
+    }
+    if (file->flags & FI_MAPPED)
+    {
+        readIndex(file->head, index, 0, MAP_INDEX_ENTRIES - 1);
+        for (i = 0; i < MAP_INDEX_ENTRIES; i++)
+        {
+            if (index[i] != -1)
+            {
+                blocks[n++] = index[i];
+            }
+        }
+        return n;
+    }
+    n = file->num_blocks;
+    return chainBlocks(file_index, 0, n, blocks, False) == -1 ? -1 : n;
+}
+
+int countExtents(int *blocks, int n)
+{
+    int extents = (n > 0) ? 1 : 0;
+    for (int i = 1; i < n; i++)
+    {
+        if (blocks[i] != blocks[i - 1] + 1)
+        {
+            extents++;
+        }
+    }
+    return extents;
+}
+
+int relocateFile(char file_index, int extra)
+{
+    static int blocks[DISK_BLOCKS_MAX];
+    static char buf[COPY_CHUNK_MAX];
+    char map[MAP_BLOCKS * BLOCK_SIZE];
+    file_info *file = &dir_pointer[file_index];
+    int i, n = fileBlocks(file_index, blocks);
+
+    if (n <= 0)
+    {
+        return -1;
+    }
+    for (i = 0; (file->flags & FI_MAPPED) && i < n; i++)
+    {
+        if (REFS[blocks[i]] != 1)
+        {
+            return -1; // shared blocks are listed in other indexes too
+        }
+    }
+
+    /* copy into a free run first, nothing points at it yet */
+    int run = allocRun(MAP_RESERVED, n + extra);
+    if (run == -1)
+    {
+        return -1;
+    }
+    for (i = 0; i < n; i += COPY_BLOCKS)
+    {
+        int k = (n - i < COPY_BLOCKS) ? n - i : COPY_BLOCKS;
+        if (readBlocks(blocks + i, k, buf) == -1 || writeRun(run + i, k, buf) == -1)
+        {
+            freeRun(run, n + extra);
+            return -1;
+        }
+    }
+
+    /* then switch the whole file over in one map update */
+    loadMap(map);
+    for (i = 0; i < n; i++)
+    {
+        map[blocks[i]] = '\0';
+    }
+    memset(map + run + n, 0, extra);
+    if (file->flags & FI_MAPPED)
+    {
+        static int index[MAP_INDEX_ENTRIES_MAX];
+        memset(map + run, MAP_SHARED, n);
+        readIndex(file->head, index, 0, MAP_INDEX_ENTRIES - 1);
+        for (i = 0; i < n; i++)
+        {
+            REFS[blocks[i]] = 0;
+            REFS[run + i] = 1;
+        }
+        for (i = 0, n = 0; i < MAP_INDEX_ENTRIES; i++)
+        {
+            if (index[i] != -1)
+            {
+                index[i] = run + n++;
+            }
+        }
+        writeIndex(file->head, index, 0, MAP_INDEX_ENTRIES - 1);
+    }
+    else
+    {
+        memset(map + run, file_index + 1, n);
+        file->head = run;
+    }
+    storeMap(map);
+    return 0;
+}
+
+/* the chain gets its new blocks before a write walks it, so nothing moves
+   under the block numbers the write holds: free blocks behind the last
+   one, else the whole file moves to a run with room, else it is packed
+   down into the free blocks in front of its end, which leaves them behind */
+int growChain(char file_index, int extra)
+{
+    if (extra <= 0)
+    {
+        return 0;
+    }
+    unsigned long long t = statStart();
+    int rtn = extendChain(file_index, extra);
+    statEnd(OP_MAP_SCAN, t, rtn, 0);
+    return rtn;
+}
+
+int extendChain(char file_index, int extra)
+{
+    char map[MAP_BLOCKS * BLOCK_SIZE];
+    file_info *file = &dir_pointer[file_index];
+    boolean relocated = False;
+    int i, last, found;
+
+    while (extra > 0)
+    {
+        loadMap(map);
+        for (last = DISK_BLOCKS - 1; last >= 0 && map[last] != file_index + 1; last--)
+            ;
+        for (i = summaryNextFree(last + 1), found = 0; i < DISK_BLOCKS && found < extra; i = summaryNextFree(i + 1))
+        {
+            found += map[i] == '\0';
+        }
+        if (found == extra)
+        {
+            for (i = last + 1; extra > 0; i++)
+            {
+                if (map[i] != '\0')
+                {
+                    continue;
+                }
+                map[i] = file_index + 1;
+                file->head = (file->head == -1) ? i : file->head;
+                file->num_blocks++;
+                extra--;
+            }
+            storeMap(map);
+            return 0;
+        }
+        if (last == -1 || !summaryReady() || SUMMARY.free_blocks < extra)
+        {
+            return -1; // no free block in front of it either
+        }
+        if (!relocated && relocateFile(file_index, extra) == 0)
+        {
+            relocated = True; // the run has room behind it, taken on the next pass
+            continue;
+        }
+        if (packChain(file_index) == -1)
+        {
+            return -1;
+        }
+        relocated = True;
+    }
+    return 0;
+}
+
+/* the data of the chain moves down into the free blocks in front of its
+   last block, in file order; a move only goes to a block that is free in
+   the committed map, and each batch of them is committed before the blocks
+   it left are reused, so a crash finds the file whole in one place */
+int packChain(char file_index)
+{
+    static int blocks[DISK_BLOCKS_MAX];
+    static int home[DISK_BLOCKS_MAX];
+    static int src[DISK_BLOCKS_MAX];
+    static int dst[DISK_BLOCKS_MAX];
+    static char buf[COPY_CHUNK_MAX];
+    char map[MAP_BLOCKS * BLOCK_SIZE];
+    file_info *file = &dir_pointer[file_index];
+    int i, j, k, moves, n = fileBlocks(file_index, blocks);
+
+    if (n <= 0)
+    {
+        return -1;
+    }
+
+    /* block j of the file ends up on the j-th of its blocks and the free
+       blocks in front of its end, taken in block order */
+    loadMap(map);
+    for (i = 0, j = 0, k = 0; k < n; i++)
+    {
+        if (i == blocks[j])
+        {
+            home[k++] = i;
+            j++;
+        }
+        else if (map[i] == '\0')
+        {
+            home[k++] = i;
+        }
+    }
+    if (home[n - 1] == blocks[n - 1])
+    {
+        return -1; // nothing free in front of its end
+    }
+
+    for (;;)
+    {
+        for (j = 0, moves = 0; j < n; j++)
+        {
+            if (blocks[j] != home[j] && map[home[j]] == '\0')
+            {
+                src[moves] = blocks[j];
+                dst[moves++] = home[j];
+            }
+        }
+        if (moves == 0)
+        {
+            return 0;
+        }
+        for (i = 0; i < moves; i += COPY_BLOCKS)
+        {
+            k = (moves - i < COPY_BLOCKS) ? moves - i : COPY_BLOCKS;
+            if (readBlocks(src + i, k, buf) == -1 || writeBlocks(dst + i, k, buf) == -1)
+            {
+                return -1;
+            }
+        }
+        for (j = 0, i = 0; i < moves; j++)
+        {
+            if (blocks[j] == src[i])
+            {
+                map[dst[i]] = file_index + 1;
+                map[src[i++]] = '\0';
+                blocks[j] = home[j];
+            }
+        }
+        file->head = blocks[0];
+        storeMap(map);
+        if (journalCommit() == -1)
+        {
+            return -1;
+        }
+    }
+}
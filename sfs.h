@@ -0,0 +1,262 @@
+#ifndef _SFS_H_
+#define _SFS_H_
+
+#include "libsfs.h"
+
+/* allocation map tags besides the per-file owner tags (file_index + 1) */
+#define MAP_RESERVED (MAX_FILE + 1) /* super block, directory and the map itself */
+#define MAP_TAIL (MAX_FILE + 2)     /* block shared by tail fragments of small files */
+#define MAP_SHARED (MAX_FILE + 3)   /* reference counted data block of mapped files */
+#define MAP_SNAP (MAX_FILE + 4)     /* index, cluster or tail copy held by a snapshot */
+
+/* allocation map: one tag byte per disk block */
+#define MAP_BLOCKS ((DISK_BLOCKS + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define MAP_BYTES_MAX (DISK_BLOCKS_MAX + BLOCK_SIZE_MAX) /* MAP_BLOCKS * BLOCK_SIZE at any geometry */
+
+/* tail packing: files of up to PACK_MAX bytes live in fragments of a shared block */
+#define FRAG_SIZE (BLOCK_SIZE / 8)
+#define FRAGS_PER_BLOCK (BLOCK_SIZE / FRAG_SIZE)
+#define PACK_MAX (BLOCK_SIZE / 2)
+
+/* file_info flags */
+#define FI_COMPRESS 1 /* data is stored as compressed clusters */
+#define FI_MAPPED 2   /* head is a block index, data blocks are reference counted */
+#define FI_DEDUP 4    /* written blocks are looked up in the fingerprint index */
+
+/* mapped files: the head run of MAP_INDEX_BLOCKS lists the data block of every
+   logical block, MAP_SHARED blocks carry a reference count in REFS */
+#define MAP_INDEX_BLOCKS 4
+#define INDEX_PER_BLOCK (BLOCK_SIZE / (int)sizeof(int))
+#define MAP_INDEX_ENTRIES (MAP_INDEX_BLOCKS * INDEX_PER_BLOCK)
+#define MAP_INDEX_ENTRIES_MAX (MAP_INDEX_BLOCKS * BLOCK_SIZE_MAX / (int)sizeof(int))
+#define REF_BLOCKS ((DISK_BLOCKS + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define REF_MAX 255
+
+/* dedup: on-disk fingerprint buckets, fronted by an in-memory bloom filter */
+#define FP_BLOCKS 32
+#define FP_PER_BLOCK (BLOCK_SIZE / (int)sizeof(fp_entry))
+#define BLOOM_BITS (1 << 16)
+
+/* checksums: one CRC32C per block at crc_index, 0 while a block has none */
+#define CRC_BLOCKS ((DISK_BLOCKS * (int)sizeof(unsigned int) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define CRC_BYTES_MAX (DISK_BLOCKS_MAX * (int)sizeof(unsigned int) + BLOCK_SIZE_MAX)
+
+/* fs_copy_range, and reads and writes of chain files that span more than one
+   block, move at most this many bytes per pass as runs of consecutive blocks */
+#define COPY_BLOCKS 32
+#define COPY_CHUNK (COPY_BLOCKS * BLOCK_SIZE)
+#define COPY_CHUNK_MAX (COPY_BLOCKS * BLOCK_SIZE_MAX)
+
+/* snapshots: one block per snapshot holds a copy of the directory */
+#define SNAP_MAX 4
+
+/* metadata journal (journal.h), the blocks after the snapshots */
+#define JOURNAL_BLOCKS 128
+
+/* block cache, a hit was verified when the block came in from disk */
+#define BCACHE_SETS 64
+#define BCACHE_WAYS 4
+
+/* compression: every CLUSTER_SIZE bytes of a file compress into a run of blocks */
+#define CLUSTER_SIZE (8 * BLOCK_SIZE)
+#define CLUSTER_SIZE_MAX (8 * BLOCK_SIZE_MAX)
+#define CLUSTER_CACHE 8     /* decompressed clusters kept in memory */
+#define COMP_RAW 0x40000000 /* cluster did not compress and is stored as is */
+
+typedef struct
+{
+    int block_size; /* geometry the image was made with (disk.h) */
+    int blocks;
+    int dir_index;
+    int dir_len;
+    int data_index;
+    int ref_index; /* reference counts of MAP_SHARED blocks */
+    int fp_index;  /* dedup fingerprint buckets */
+    int crc_index; /* block checksums */
+    int snap_index; /* snapshot directories */
+    int journal_index; /* metadata log */
+    unsigned int journal_seq; /* first transaction the log may replay */
+    unsigned int crc_sum; /* checksum of the checksum blocks */
+    unsigned int sb_sum;  /* checksum of this struct, taken with sb_sum = 0 */
+} super_block;
+
+/* file information */
+typedef struct
+{
+    boolean used;
+    char name[MAX_FILENAME_LEN];
+    int size;
+    int head;
+    int num_blocks;
+    int fd_count;
+    int tail; /* shared tail block, -1 if the file is not packed */
+    int frag; /* first fragment slot used inside the tail block */
+    int flags;
+} file_info;
+
+/* file descriptor */
+typedef struct
+{
+    boolean used;
+    char file;
+    int offset;
+} file_descriptor;
+
+/* cluster index entry, the head block of a compressed file is an array of them */
+typedef struct
+{
+    int block; /* first block of the run, -1 if nothing is stored yet */
+    int clen;  /* bytes stored in the run, COMP_RAW if kept uncompressed */
+} cluster_entry;
+
+#define CLUSTERS_PER_FILE (BLOCK_SIZE / (int)sizeof(cluster_entry))
+
+/* decompressed cluster */
+typedef struct
+{
+    boolean valid;
+    char file;
+    int cluster;
+    unsigned int used; /* lru stamp */
+    char data[CLUSTER_SIZE_MAX];
+} cluster_cache;
+
+/* block cache entry */
+typedef struct
+{
+    int block; /* -1 if unused */
+    unsigned int used;
+    char data[BLOCK_SIZE_MAX];
+} cached_block;
+
+/* fingerprint bucket slot, block 0 marks it empty */
+typedef struct
+{
+    unsigned long long hash;
+    int block;
+    int pad;
+} fp_entry;
+
+/* snapshot, the directory as it was with heads and tails pointing at MAP_SNAP copies */
+typedef struct
+{
+    boolean used;
+    file_info dir[MAX_FILE];
+} snapshot;
+
+/* state of the mounted file system (sfs.c), shared with the tests and tools */
+extern super_block *SBP;
+extern file_info *dir_pointer;
+extern file_descriptor META[MAX_FILE_DESCRIPTOR];
+extern unsigned char REFS[MAP_BYTES_MAX];
+extern unsigned int CRCS[CRC_BYTES_MAX / sizeof(unsigned int)];
+extern boolean crc_enabled; // benchmarks switch it off to measure the cost
+extern int crc_errors;
+extern int crc_repairs;
+
+/* untimed bodies of the public calls, which time and count them (stats.h) */
+int makeFs(char *disk_name, int block_size, int blocks);
+int mountFs(char *disk_name);
+int umountFs(char *disk_name);
+int openFile(char *name);
+int closeFile(int fildes);
+int createFile(char *name);
+int deleteFile(char *name);
+int readFile(int fildes, void *buf, size_t nbyte);
+int writeFile(int fildes, void *buf, size_t nbyte);
+int fileSize(int fildes);
+int seekFile(int fildes, off_t offset);
+int truncateFile(int fildes, off_t length);
+int cloneFile(char *src_name, char *dst_name);
+int takeSnapshot(void);
+int rollbackSnapshot(int id);
+int defragFiles(int budget);
+int copyRange(int src_fd, off_t src_off, int dst_fd, off_t dst_off, size_t len);
+int setCompression(int fildes, boolean on);
+int setDedup(int fildes, boolean on);
+int deleteSnapshot(int id);
+int syncFs(void);
+int syncFile(int fildes);
+int fileOf(int fildes);
+long long fileOffset(int fildes, int moved);
+
+int readBlock(int block, char *buf);
+int repairBlock(int block, char *buf);
+int writeBlock(int block, char *buf);
+int writeMeta(int block, char *buf);
+int readRun(int start, int count, char *buf);
+int writeRun(int start, int count, char *buf);
+int readBlocks(int *blocks, int count, char *buf);
+int writeBlocks(int *blocks, int count, char *buf);
+cached_block *cacheLookup(int block);
+void cacheInsert(int block, char *buf);
+void dropCache(void);
+unsigned int superSum(super_block *sb);
+
+char findFile(char *name);
+int findUnallocatedMetaInfo(char file_index);
+int findFreeBlock(char file_index);
+int findNextBlock(int current, char file_index);
+int scanFreeBlock(char file_index);
+
+int allocBlock(char tag);
+int scanAllocBlock(char tag);
+void setBlockTag(int block, char tag);
+int fragsFor(int size);
+int findFreeFrags(char file_index, int need, int *tail, int *frag);
+void releaseTail(int tail);
+int unpackFile(char file_index);
+int packWrite(int fildes, char *src, int nbyte);
+
+int blocksFor(int size);
+void loadMap(char *map);
+void storeMap(char *map);
+int allocRun(char tag, int n);
+int scanAllocRun(char tag, int n);
+void freeRun(int start, int n);
+cluster_cache *loadCluster(char file_index, cluster_entry *entry, int cluster);
+int storeCluster(char file_index, cluster_entry *entry, char *data, int rawlen);
+void dropClusters(char file_index);
+int compRead(int fildes, char *dst, int nbyte);
+int compWrite(int fildes, char *src, int nbyte);
+int compTruncate(char file_index, int length);
+
+void readIndex(int head, int *index, int first, int last);
+void writeIndex(int head, int *index, int first, int last);
+void dropRef(int block);
+int putBlock(file_info *file, int old, char *data);
+int findDuplicate(unsigned long long hash, char *data);
+void addFingerprint(unsigned long long hash, int block);
+void loadFingerprints(void);
+int mapRead(int fildes, char *dst, int nbyte);
+int mapWrite(int fildes, char *src, int nbyte);
+int mapTruncate(char file_index, int length);
+int newIndex(char file_index);
+
+int shareBlock(int block);
+int mapFile(char file_index);
+int copyIndex(int head, char tag);
+void freeIndex(int head);
+int copyClusters(int head, char tag);
+void freeClusters(int head);
+int copyFrags(int src_tail, int src_frag, char file_index);
+void freeSnapshot(snapshot *snap);
+
+int chainBlocks(char file_index, int first, int count, int *blocks, boolean grow);
+int scanChain(char file_index, int first, int count, int *blocks, boolean grow);
+int chainRead(char file_index, int off, char *dst, int n);
+int chainWrite(char file_index, int off, char *src, int n);
+int chainSpan(int fildes, char *buf, int nbyte, boolean write);
+int rangeRead(int fildes, int off, char *dst, int n);
+int rangeWrite(int fildes, int off, char *src, int n);
+int shareRange(char src_index, int src_off, char dst_index, int dst_off, int len);
+
+int fileBlocks(char file_index, int *blocks);
+int countExtents(int *blocks, int n);
+int relocateFile(char file_index, int extra);
+int growChain(char file_index, int extra);
+int extendChain(char file_index, int extra);
+int packChain(char file_index);
+
+
+#endif
@@ -0,0 +1,62 @@
+/**
+ *
+ * sfs_defrag.c: defragment an image in throttled passes
+ *
+ * usage: sfs_defrag <disk> [blocks per second]
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "libsfs.h"
+
+#define DEFRAG_BATCH 64 // blocks moved between pauses
+
+static void report(const char *label)
+{
+    frag_stats stats;
+
+    fs_frag_stats(&stats);
+    printf("%-7s files %4d  fragmented %4d  blocks %5d  extents %5d  free runs %4d  largest free %5d\n",
+           label, stats.files, stats.fragmented_files, stats.blocks, stats.extents,
+           stats.free_extents, stats.largest_free);
+}
+
+int main(int argc, char **argv)
+{
+    int rate = (argc > 2) ? atoi(argv[2]) : 0; // 0 runs unthrottled
+    int moved, total = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <disk> [blocks per second]\n", argv[0]);
+        return 1;
+    }
+    if (mount_fs(argv[1]) == -1)
+    {
+        fprintf(stderr, "%s: cannot mount %s\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    report("before");
+    while ((moved = fs_defrag(DEFRAG_BATCH)) > 0)
+    {
+        total += moved;
+        if (rate > 0)
+        {
+            /* sleep off what this batch used of the rate */
+            double pause = (double)moved / rate;
+            struct timespec ts = {(time_t)pause, (long)((pause - (time_t)pause) * 1e9)};
+            nanosleep(&ts, NULL);
+        }
+    }
+    report("after");
+    printf("%d blocks moved\n", total);
+
+    umount_fs(argv[1]);
+    return 0;
+}
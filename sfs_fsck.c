@@ -0,0 +1,64 @@
+/**
+ *
+ * sfs_fsck.c: verify an image, exits 0 if it is consistent, 1 if problems
+ * were found and 2 if it cannot be read
+ *
+ * usage: sfs_fsck [-j workers] <disk>
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "libsfs.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    fsck_report r;
+    int workers = 0; // one per cpu
+    int arg = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-j") == 0)
+    {
+        workers = atoi(argv[2]);
+        arg = 3;
+    }
+    if (arg >= argc)
+    {
+        fprintf(stderr, "usage: %s [-j workers] <disk>\n", argv[0]);
+        return 2;
+    }
+
+    double t0 = now();
+    int rtn = fsck_image(argv[arg], workers, 1, &r);
+    double t = now() - t0;
+    if (rtn == -1)
+    {
+        fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[arg]);
+        return 2;
+    }
+
+    printf("%s: %d files, %d snapshots, %d/%d blocks of %d bytes in use, checked in %.3f s\n",
+           argv[arg], r.files, r.snapshots, r.blocks_used, r.blocks, r.block_size, t);
+    if (r.journal_pending)
+        printf("%d journal transactions to replay at the next mount\n", r.journal_pending);
+    if (rtn == 0)
+    {
+        printf("clean\n");
+        return 0;
+    }
+    printf("%d problems: %d block counts, %d owned twice, %d orphans, %d lost, "
+           "%d reference counts, %d checksums, %d summaries\n",
+           r.errors, r.count_mismatch, r.double_owned, r.orphans, r.lost,
+           r.ref_mismatch, r.bad_checksums, r.bad_summary);
+    return 1;
+}
@@ -0,0 +1,78 @@
+/**
+ *
+ * sfs_replay.c: re-run a recorded trace against a fresh image
+ *
+ * usage: sfs_replay [-p] [-s stats.json] <trace> <disk>
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "libsfs.h"
+
+int main(int argc, char **argv)
+{
+    static op_stats stats[OP_COUNT];
+    replay_report r;
+    const char *json = NULL;
+    int paced = 0, arg = 1, rtn;
+
+    while (arg < argc && argv[arg][0] == '-')
+    {
+        if (strcmp(argv[arg], "-p") == 0)
+        {
+            paced = 1; // keep the recorded gaps between calls
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-s") == 0 && arg + 1 < argc)
+        {
+            json = argv[arg + 1];
+            arg += 2;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (argc - arg != 2)
+    {
+        fprintf(stderr, "usage: %s [-p] [-s stats.json] <trace> <disk>\n", argv[0]);
+        return 2;
+    }
+
+    if ((rtn = trace_replay(argv[arg], argv[arg + 1], paced, &r)) == -1)
+    {
+        fprintf(stderr, "%s: cannot read trace %s\n", argv[0], argv[arg]);
+        return 2;
+    }
+    printf("%d calls replayed in %.3f s (recorded over %.3f s), %d skipped, %d returned differently\n",
+           r.ops, r.seconds, r.recorded, r.skipped, r.mismatches);
+
+    fs_stats(stats);
+    printf("%-20s %8s %10s %10s %10s\n", "call", "calls", "p50 us", "p99 us", "max us");
+    for (int op = 0; op < OP_CHAIN_STEP; op++)
+    {
+        if (stats[op].calls)
+        {
+            printf("%-20s %8llu %10.1f %10.1f %10.1f\n", fs_stats_name(op), stats[op].calls,
+                   stats[op].p50_ns / 1e3, stats[op].p99_ns / 1e3, stats[op].max_ns / 1e3);
+        }
+    }
+
+    if (json != NULL)
+    {
+        FILE *f = fopen(json, "w");
+        if (f == NULL)
+        {
+            perror(json);
+            return 2;
+        }
+        fs_stats_json(f);
+        fclose(f);
+    }
+    return rtn;
+}
@@ -0,0 +1,179 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk.h"
+#include "slowdisk.h"
+#include "stats.h"
+
+/***************************************************************************/
+/* Every transfer waits for a queue slot, then for its share of the        */
+/* bandwidth: transfers line up behind each other on busy_until, which is  */
+/* when the device finishes the bytes already handed to it. The latency    */
+/* and jitter come on top. The inner backend does the actual I/O.          */
+/***************************************************************************/
+
+#define SLOW_SPIN_NS 60000 /* waits shorter than this spin, nanosleep overshoots */
+
+static slow_config slow;
+static const disk_backend *inner;
+static pthread_mutex_t slow_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slow_slot = PTHREAD_COND_INITIALIZER;
+static int in_flight;
+static unsigned long long busy_until;
+
+static unsigned long long slow_jitter(void)
+{
+    double u = rand_r(&slow.seed) / ((double)RAND_MAX + 1);
+
+    switch (slow.jitter)
+    {
+    case SLOW_JITTER_UNIFORM:
+        return (unsigned long long)(u * slow.jitter_us * 1000);
+    case SLOW_JITTER_EXPONENTIAL:
+        return (unsigned long long)(-log(1 - u) * slow.jitter_us * 1000);
+    default:
+        return 0;
+    }
+}
+
+/* take a queue slot and work out when the transfer of count blocks is done */
+static unsigned long long slow_begin(int count)
+{
+    unsigned long long now, done;
+
+    pthread_mutex_lock(&slow_lock);
+    while (slow.queue_depth > 0 && in_flight >= slow.queue_depth)
+        pthread_cond_wait(&slow_slot, &slow_lock);
+    in_flight++;
+
+    now = done = statClock();
+    if (slow.bandwidth_mb > 0)
+    {
+        if (busy_until < now)
+            busy_until = now;
+        busy_until += (unsigned long long)count * BLOCK_SIZE * 1000 / slow.bandwidth_mb;
+        done = busy_until;
+    }
+    done += (unsigned long long)slow.latency_us * 1000 + slow_jitter();
+    pthread_mutex_unlock(&slow_lock);
+    return done;
+}
+
+static void slow_end(unsigned long long done)
+{
+    unsigned long long now;
+
+    while ((now = statClock()) < done)
+    {
+        if (done - now > SLOW_SPIN_NS)
+        {
+            unsigned long long left = done - now - SLOW_SPIN_NS / 2;
+            struct timespec ts = {left / 1000000000ULL, left % 1000000000ULL};
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    pthread_mutex_lock(&slow_lock);
+    in_flight--;
+    pthread_cond_signal(&slow_slot);
+    pthread_mutex_unlock(&slow_lock);
+}
+
+static int slow_make(char *name)
+{
+    const disk_backend *backend = disk_backend_for(&name);
+    return backend->make(name);
+}
+
+static int slow_open(char *name)
+{
+    const disk_backend *backend = disk_backend_for(&name);
+    int rtn = backend->open(name);
+
+    if (rtn >= 0)
+        inner = backend;
+    return rtn;
+}
+
+static int slow_read(int block, char *buf)
+{
+    unsigned long long done = slow_begin(1);
+    int rtn = inner->read(block, buf);
+    slow_end(done);
+    return rtn;
+}
+
+static int slow_write(int block, char *buf)
+{
+    unsigned long long done = slow_begin(1);
+    int rtn = inner->write(block, buf);
+    slow_end(done);
+    return rtn;
+}
+
+static int slow_readv(int block, int count, char *buf)
+{
+    unsigned long long done = slow_begin(count);
+    int rtn = inner->readv(block, count, buf);
+    slow_end(done);
+    return rtn;
+}
+
+static int slow_writev(int block, int count, char *buf)
+{
+    unsigned long long done = slow_begin(count);
+    int rtn = inner->writev(block, count, buf);
+    slow_end(done);
+    return rtn;
+}
+
+static int slow_flush(void)
+{
+    unsigned long long done = slow_begin(0);
+    int rtn = inner->flush();
+    slow_end(done);
+    return rtn;
+}
+
+static int slow_close(void)
+{
+    int rtn = inner->close();
+    inner = NULL;
+    return rtn;
+}
+
+static int slow_copies(void)
+{
+    return inner->copies ? inner->copies() : 1;
+}
+
+static int slow_read_copy(int copy, int block, int count, char *buf)
+{
+    if (!inner->read_copy)
+        return copy == 0 ? slow_readv(block, count, buf) : -1;
+    unsigned long long done = slow_begin(count);
+    int rtn = inner->read_copy(copy, block, count, buf);
+    slow_end(done);
+    return rtn;
+}
+
+const disk_backend disk_slow = {.name = "slow", .make = slow_make, .open = slow_open, .read = slow_read,
+                                .write = slow_write, .readv = slow_readv, .writev = slow_writev,
+                                .flush = slow_flush, .close = slow_close, .copies = slow_copies,
+                                .read_copy = slow_read_copy};
+
+int disk_slow_config(const slow_config *config)
+{
+    if (!config || config->latency_us < 0 || config->jitter_us < 0 || config->bandwidth_mb < 0 ||
+        config->queue_depth < 0 || config->jitter < SLOW_JITTER_NONE || config->jitter > SLOW_JITTER_EXPONENTIAL)
+        return -1;
+
+    pthread_mutex_lock(&slow_lock);
+    slow = *config;
+    busy_until = 0;
+    pthread_mutex_unlock(&slow_lock);
+    return disk_register("slow:", &disk_slow);
+}
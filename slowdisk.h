@@ -0,0 +1,29 @@
+#ifndef _SLOWDISK_H_
+#define _SLOWDISK_H_
+
+#include "disk.h"
+
+/***************************************************************************/
+/* a backend that delays the I/O of another one, "slow:<disk name>"        */
+/***************************************************************************/
+#define SLOW_JITTER_NONE 0
+#define SLOW_JITTER_UNIFORM 1     /* 0 to jitter_us on top of latency_us   */
+#define SLOW_JITTER_EXPONENTIAL 2 /* mean jitter_us, with a long tail      */
+
+typedef struct
+{
+    int latency_us;   /* added to every transfer and flush                */
+    int jitter_us;    /* spread of the added latency                      */
+    int jitter;       /* SLOW_JITTER_*                                     */
+    int bandwidth_mb; /* MB/s the device moves, 0 for no cap              */
+    int queue_depth;  /* transfers in flight at once, 0 for no limit      */
+    unsigned int seed;/* of the jitter, so runs can be repeated           */
+} slow_config;
+
+extern const disk_backend disk_slow;
+
+int disk_slow_config(const slow_config *config);
+/* set the delays and register the "slow:" prefix, 0 on success           */
+/***************************************************************************/
+
+#endif
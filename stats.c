@@ -0,0 +1,276 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "trace.h"
+
+/***************************************************************************/
+/* Every thread counts into a block of its own, so a call costs two clock  */
+/* reads and a few plain increments. Readers sum the blocks of all threads */
+/* that ever made a call; counts of threads that have exited are kept.     */
+/***************************************************************************/
+
+typedef struct
+{
+    unsigned long long calls;
+    unsigned long long errors;
+    unsigned long long bytes;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long hist[STAT_BUCKETS];
+} op_counter;
+
+typedef struct stat_block
+{
+    struct stat_block *next;
+    op_counter ops[OP_COUNT];
+} stat_block;
+
+static const char *op_names[OP_COUNT] = {
+    "make_fs", "mount_fs", "umount_fs",
+    "fs_open", "fs_close", "fs_create", "fs_delete",
+    "fs_read", "fs_write", "fs_get_filesize", "fs_lseek", "fs_truncate",
+    "fs_copy_range", "fs_clone", "fs_snapshot", "fs_rollback", "fs_defrag",
+    "fs_snapshot_delete", "fs_set_compression", "fs_set_dedup", "fs_sync", "fs_fsync",
+    "chain_step", "chain_walk", "map_scan", "journal_commit", "summary_build",
+    "block_read", "block_write", "blocks_read", "blocks_write"};
+
+int stats_enabled = 1;
+static __thread stat_block *stat_local;
+static stat_block *stat_blocks;
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static stat_block *statLocal(void)
+{
+    if (stat_local == NULL)
+    {
+        stat_local = calloc(1, sizeof(stat_block));
+        if (stat_local == NULL)
+        {
+            return NULL;
+        }
+        pthread_mutex_lock(&stat_lock);
+        stat_local->next = stat_blocks;
+        stat_blocks = stat_local;
+        pthread_mutex_unlock(&stat_lock);
+    }
+    return stat_local;
+}
+
+static int statBucket(unsigned long long ns)
+{
+    if (ns >= (1ULL << STAT_MAX_BITS))
+    {
+        ns = (1ULL << STAT_MAX_BITS) - 1;
+    }
+    if (ns < STAT_SUB)
+    {
+        return (int)ns;
+    }
+    int shift = 63 - __builtin_clzll(ns) - STAT_SUB_BITS;
+    return (shift + 1) * STAT_SUB + (int)((ns >> shift) & (STAT_SUB - 1));
+}
+
+/* lowest and highest latency a bucket stands for */
+static unsigned long long statLow(int bucket)
+{
+    if (bucket < STAT_SUB)
+    {
+        return bucket;
+    }
+    int shift = bucket / STAT_SUB - 1;
+    return (unsigned long long)(STAT_SUB + bucket % STAT_SUB) << shift;
+}
+
+static unsigned long long statHigh(int bucket)
+{
+    return (bucket < STAT_SUB) ? (unsigned long long)bucket : statLow(bucket) + (1ULL << (bucket / STAT_SUB - 1)) - 1;
+}
+
+unsigned long long statClock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long statStart(void)
+{
+    return (stats_enabled || trace_enabled) ? statClock() : 0;
+}
+
+void statEnd(int op, unsigned long long start, int rtn, long long bytes)
+{
+    stat_block *local;
+    unsigned long long ns;
+
+    if (start == 0 || !stats_enabled || (local = statLocal()) == NULL)
+    {
+        return;
+    }
+    ns = statClock() - start;
+
+    op_counter *c = &local->ops[op];
+    c->calls++;
+    if (rtn == -1)
+    {
+        c->errors++;
+    }
+    else if (bytes > 0)
+    {
+        c->bytes += bytes;
+    }
+    c->total_ns += ns;
+    if (ns > c->max_ns)
+    {
+        c->max_ns = ns;
+    }
+    c->hist[statBucket(ns)]++;
+}
+
+void statCount(int op)
+{
+    stat_block *local;
+
+    if (stats_enabled && (local = statLocal()) != NULL)
+    {
+        local->ops[op].calls++;
+    }
+}
+
+/* the counters of every thread summed into one */
+static void statSum(int op, op_counter *sum)
+{
+    memset(sum, 0, sizeof(op_counter));
+    pthread_mutex_lock(&stat_lock);
+    for (stat_block *b = stat_blocks; b != NULL; b = b->next)
+    {
+        op_counter *c = &b->ops[op];
+        sum->calls += c->calls;
+        sum->errors += c->errors;
+        sum->bytes += c->bytes;
+        sum->total_ns += c->total_ns;
+        if (c->max_ns > sum->max_ns)
+        {
+            sum->max_ns = c->max_ns;
+        }
+        for (int i = 0; i < STAT_BUCKETS; i++)
+        {
+            sum->hist[i] += c->hist[i];
+        }
+    }
+    pthread_mutex_unlock(&stat_lock);
+}
+
+static unsigned long long statPercentile(op_counter *c, double q)
+{
+    unsigned long long timed = 0, seen = 0;
+
+    for (int i = 0; i < STAT_BUCKETS; i++)
+    {
+        timed += c->hist[i];
+    }
+    if (timed == 0)
+    {
+        return 0;
+    }
+
+    unsigned long long rank = (unsigned long long)(q * timed);
+    for (int i = 0; i < STAT_BUCKETS; i++)
+    {
+        seen += c->hist[i];
+        if (seen > rank || seen == timed)
+        {
+            unsigned long long high = statHigh(i);
+            return (high < c->max_ns) ? high : c->max_ns;
+        }
+    }
+    return 0;
+}
+
+static void statFill(op_counter *c, op_stats *s)
+{
+    s->calls = c->calls;
+    s->errors = c->errors;
+    s->bytes = c->bytes;
+    s->total_ns = c->total_ns;
+    s->max_ns = c->max_ns;
+    s->p50_ns = statPercentile(c, 0.5);
+    s->p99_ns = statPercentile(c, 0.99);
+    s->p999_ns = statPercentile(c, 0.999);
+}
+
+int fs_stats(op_stats *stats)
+{
+    static op_counter sum;
+
+    if (stats == NULL)
+    {
+        return -1;
+    }
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        statSum(op, &sum);
+        statFill(&sum, &stats[op]);
+    }
+    return 0;
+}
+
+int fs_stats_json(FILE *out)
+{
+    static op_counter sum;
+    op_stats s;
+    int first = 1;
+
+    if (out == NULL)
+    {
+        return -1;
+    }
+    fprintf(out, "{\n  \"ops\": [");
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        statSum(op, &sum);
+        if (sum.calls == 0)
+        {
+            continue;
+        }
+        statFill(&sum, &s);
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"calls\": %llu, \"errors\": %llu, \"bytes\": %llu, "
+                     "\"total_ns\": %llu, \"max_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+                     "\"p999_ns\": %llu,\n     \"histogram\": [",
+                first ? "" : ",", op_names[op], s.calls, s.errors, s.bytes, s.total_ns, s.max_ns,
+                s.p50_ns, s.p99_ns, s.p999_ns);
+        int sep = 0;
+        for (int i = 0; i < STAT_BUCKETS; i++)
+        {
+            if (sum.hist[i])
+            {
+                fprintf(out, "%s[%llu, %llu]", sep ? ", " : "", statLow(i), sum.hist[i]);
+                sep = 1;
+            }
+        }
+        fprintf(out, "]}");
+        first = 0;
+    }
+    fprintf(out, "\n  ]\n}\n");
+    return 0;
+}
+
+void fs_stats_reset(void)
+{
+    pthread_mutex_lock(&stat_lock);
+    for (stat_block *b = stat_blocks; b != NULL; b = b->next)
+    {
+        memset(b->ops, 0, sizeof(b->ops));
+    }
+    pthread_mutex_unlock(&stat_lock);
+}
+
+const char *fs_stats_name(int op)
+{
+    return (op >= 0 && op < OP_COUNT) ? op_names[op] : NULL;
+}
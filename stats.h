@@ -0,0 +1,58 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+
+/***************************************************************************/
+/* per operation call counts, bytes and latency histograms                 */
+/***************************************************************************/
+enum
+{
+    OP_MAKE_FS, OP_MOUNT, OP_UMOUNT,
+    OP_OPEN, OP_CLOSE, OP_CREATE, OP_DELETE,
+    OP_READ, OP_WRITE, OP_FILESIZE, OP_LSEEK, OP_TRUNCATE,
+    OP_COPY_RANGE, OP_CLONE, OP_SNAPSHOT, OP_ROLLBACK, OP_DEFRAG,
+    OP_SNAPSHOT_DELETE, OP_SET_COMPRESSION, OP_SET_DEDUP, OP_SYNC, OP_FSYNC,
+    OP_CHAIN_STEP, /* findNextBlock calls, counted but not timed          */
+    OP_CHAIN_WALK, /* block lists built by walking a chain                */
+    OP_MAP_SCAN,   /* searches of the allocation map for free blocks      */
+    OP_JOURNAL_COMMIT, /* metadata transactions written to the log        */
+    OP_SUMMARY_BUILD,  /* summaries rebuilt from the map and directory    */
+    OP_BLOCK_READ, OP_BLOCK_WRITE, OP_BLOCKS_READ, OP_BLOCKS_WRITE,
+    OP_COUNT
+};
+
+/* log-linear buckets: exact below STAT_SUB ns, then STAT_SUB per power of 2 */
+#define STAT_SUB_BITS 4
+#define STAT_SUB (1 << STAT_SUB_BITS)
+#define STAT_MAX_BITS 40 /* latencies are clamped to 2^40 ns (18 minutes)  */
+#define STAT_BUCKETS ((STAT_MAX_BITS - STAT_SUB_BITS + 1) * STAT_SUB)
+
+typedef struct
+{
+    unsigned long long calls;
+    unsigned long long errors; /* calls that returned -1                  */
+    unsigned long long bytes;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long p50_ns; /* percentiles, upper edge of their bucket */
+    unsigned long long p99_ns;
+    unsigned long long p999_ns;
+} op_stats;
+
+extern int stats_enabled; /* 0 stops the clock reads and the counting      */
+
+unsigned long long statClock(void); /* CLOCK_MONOTONIC in ns              */
+unsigned long long statStart(void);  /* statClock, or 0 if nothing uses it */
+void statEnd(int op, unsigned long long start, int rtn, long long bytes);
+void statCount(int op); /* a call too cheap to put two clock reads around */
+
+int fs_stats(op_stats *stats);
+/* fill OP_COUNT entries, summed over every thread that made calls        */
+int fs_stats_json(FILE *out);
+/* the same plus the non-empty histogram buckets, as JSON                 */
+void fs_stats_reset(void);
+const char *fs_stats_name(int op);
+/***************************************************************************/
+
+#endif
@@ -0,0 +1,266 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "stripedisk.h"
+
+/***************************************************************************/
+/* Disk block b lives in stripe unit b / unit, and unit s is on member     */
+/* s % members at unit s / members of that member. A transfer that spans   */
+/* several members is split per member; the calling thread serves the      */
+/* first member and a worker thread per member serves the others, so the   */
+/* members move their share of a large run at the same time.               */
+/***************************************************************************/
+
+typedef struct
+{
+    int fd;
+    pthread_t worker;
+    int state;   /* STRIPE_IDLE, STRIPE_POSTED or STRIPE_DONE            */
+    int write;   /* the posted job writes                                 */
+    int block;   /* first disk block of the posted run                    */
+    int count;
+    char *buf;
+    int rtn;
+} stripe_member;
+
+#define STRIPE_IDLE 0
+#define STRIPE_POSTED 1
+#define STRIPE_DONE 2
+
+static stripe_member members[STRIPE_MAX];
+static int nmembers, unit, stopping;
+static pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stripe_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t stripe_done = PTHREAD_COND_INITIALIZER;
+
+/* split "[unit:]a,b,c" into members, 0 if the name is usable */
+static int stripe_parse(char *name, char paths[STRIPE_MAX][256], int *n, int *u)
+{
+    char *colon = strchr(name, ':');
+    char *p = name;
+
+    *u = STRIPE_UNIT;
+    if (colon && colon > name && strspn(name, "0123456789") == (size_t)(colon - name))
+    {
+        *u = atoi(name);
+        p = colon + 1;
+    }
+    if (*u < 1 || *u > DISK_BLOCKS_MAX)
+        return -1;
+
+    for (*n = 0; *p; (*n)++)
+    {
+        size_t len = strcspn(p, ",");
+        if (*n == STRIPE_MAX || len == 0 || len >= 256)
+            return -1;
+        memcpy(paths[*n], p, len);
+        paths[*n][len] = '\0';
+        p += len + (p[len] == ',');
+    }
+    return *n > 0 ? 0 : -1;
+}
+
+static int member_blocks(int n, int u)
+{
+    int stripes = (DISK_BLOCKS + u - 1) / u;
+    return (stripes + n - 1) / n * u;
+}
+
+/* the part of a run on member m: every unit of it, in disk order */
+static int member_io(int m, int write, int block, int count, char *buf)
+{
+    for (int b = block; b < block + count;)
+    {
+        int s = b / unit, in = b % unit;
+        int n = unit - in;
+        if (n > block + count - b)
+            n = block + count - b;
+        if (s % nmembers == m)
+        {
+            off_t at = ((off_t)(s / nmembers) * unit + in) * BLOCK_SIZE;
+            char *p = buf + (size_t)(b - block) * BLOCK_SIZE;
+            ssize_t done = write ? pwrite(members[m].fd, p, (size_t)n * BLOCK_SIZE, at)
+                                 : pread(members[m].fd, p, (size_t)n * BLOCK_SIZE, at);
+            if (done < (ssize_t)n * BLOCK_SIZE)
+                return -1;
+        }
+        b += n;
+    }
+    return 0;
+}
+
+static void *stripe_worker(void *arg)
+{
+    stripe_member *me = arg;
+    int m = me - members;
+
+    pthread_mutex_lock(&stripe_lock);
+    for (;;)
+    {
+        while (me->state != STRIPE_POSTED && !stopping)
+            pthread_cond_wait(&stripe_work, &stripe_lock);
+        if (stopping)
+            break;
+        pthread_mutex_unlock(&stripe_lock);
+
+        int rtn = member_io(m, me->write, me->block, me->count, me->buf);
+
+        pthread_mutex_lock(&stripe_lock);
+        me->rtn = rtn;
+        me->state = STRIPE_DONE;
+        pthread_cond_broadcast(&stripe_done);
+    }
+    pthread_mutex_unlock(&stripe_lock);
+    return NULL;
+}
+
+static int stripe_io(int write, int block, int count, char *buf)
+{
+    int first = block / unit % nmembers;
+    int spans = (block + count - 1) / unit - block / unit + 1;
+    int rtn = 0;
+
+    if (spans == 1)
+        return member_io(first, write, block, count, buf);
+
+    /* the other members go to their workers, the first one is served here */
+    int used = spans < nmembers ? spans : nmembers;
+    pthread_mutex_lock(&stripe_lock);
+    for (int i = 1; i < used; i++)
+    {
+        stripe_member *m = &members[(first + i) % nmembers];
+        m->write = write;
+        m->block = block;
+        m->count = count;
+        m->buf = buf;
+        m->state = STRIPE_POSTED;
+    }
+    pthread_cond_broadcast(&stripe_work);
+    pthread_mutex_unlock(&stripe_lock);
+
+    rtn = member_io(first, write, block, count, buf);
+
+    pthread_mutex_lock(&stripe_lock);
+    for (int i = 1; i < used; i++)
+    {
+        stripe_member *m = &members[(first + i) % nmembers];
+        while (m->state != STRIPE_DONE)
+            pthread_cond_wait(&stripe_done, &stripe_lock);
+        m->state = STRIPE_IDLE;
+        if (m->rtn == -1)
+            rtn = -1;
+    }
+    pthread_mutex_unlock(&stripe_lock);
+    return rtn;
+}
+
+static int stripe_make(char *name)
+{
+    char paths[STRIPE_MAX][256];
+    int n, u;
+
+    if (stripe_parse(name, paths, &n, &u) == -1)
+        return -1;
+
+    for (int m = 0; m < n; m++)
+    {
+        if (disk_make_image(paths[m], (long long)member_blocks(n, u) * BLOCK_SIZE) == -1)
+        {
+            perror("make_disk: cannot create stripe member");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int stripe_close(void);
+
+static int stripe_open(char *name)
+{
+    char paths[STRIPE_MAX][256];
+    int n, u;
+
+    if (stripe_parse(name, paths, &n, &u) == -1)
+        return -1;
+
+    nmembers = 0;
+    unit = u;
+    stopping = 0;
+    for (int m = 0; m < n; m++)
+    {
+        members[m].state = STRIPE_IDLE;
+        if ((members[m].fd = open(paths[m], O_RDWR)) < 0)
+        {
+            perror("open_disk: cannot open stripe member");
+            stripe_close();
+            return -1;
+        }
+        nmembers++;
+        if (lseek(members[m].fd, 0, SEEK_END) < (off_t)member_blocks(n, u) * BLOCK_SIZE ||
+            pthread_create(&members[m].worker, NULL, stripe_worker, &members[m]) != 0)
+        {
+            close(members[m].fd);
+            nmembers--;
+            stripe_close();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int stripe_read(int block, char *buf)
+{
+    return stripe_io(0, block, 1, buf);
+}
+
+static int stripe_write(int block, char *buf)
+{
+    return stripe_io(1, block, 1, buf);
+}
+
+static int stripe_readv(int block, int count, char *buf)
+{
+    return stripe_io(0, block, count, buf);
+}
+
+static int stripe_writev(int block, int count, char *buf)
+{
+    return stripe_io(1, block, count, buf);
+}
+
+static int stripe_flush(void)
+{
+    int rtn = 0;
+
+    for (int m = 0; m < nmembers; m++)
+    {
+        if (fdatasync(members[m].fd) == -1)
+            rtn = -1;
+    }
+    return rtn;
+}
+
+static int stripe_close(void)
+{
+    pthread_mutex_lock(&stripe_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&stripe_work);
+    pthread_mutex_unlock(&stripe_lock);
+
+    for (int m = 0; m < nmembers; m++)
+    {
+        pthread_join(members[m].worker, NULL);
+        close(members[m].fd);
+    }
+    nmembers = 0;
+    return 0;
+}
+
+const disk_backend disk_stripe = {.name = "stripe", .make = stripe_make, .open = stripe_open,
+                                  .read = stripe_read, .write = stripe_write, .readv = stripe_readv,
+                                  .writev = stripe_writev, .flush = stripe_flush, .close = stripe_close};
@@ -0,0 +1,15 @@
+#ifndef _STRIPEDISK_H_
+#define _STRIPEDISK_H_
+
+#include "disk.h"
+
+/***************************************************************************/
+/* RAID-0 over image files, "stripe:[<unit>:]<file>,<file>,..."            */
+/***************************************************************************/
+#define STRIPE_MAX 8   /* member files of a set                            */
+#define STRIPE_UNIT 16 /* blocks per stripe unit when the name gives none  */
+
+extern const disk_backend disk_stripe;
+/***************************************************************************/
+
+#endif
@@ -0,0 +1,210 @@
+#include <string.h>
+
+#include "crc32c.h"
+#include "hash.h"
+#include "journal.h"
+#include "stats.h"
+#include "summary.h"
+
+/***************************************************************************/
+/* The free-space groups follow every map block written through the       */
+/* journal (summaryMap), so a group is recounted only when its 64 tags    */
+/* changed. The name index chains the directory slots of a bucket, and is  */
+/* kept in step by create, delete and rollback. A checkpoint stores both   */
+/* with its journal_seq; a mount that finds another seq, a bad sum or      */
+/* replays the log marks them stale, and the first caller rebuilds them.   */
+/***************************************************************************/
+
+fs_summary SUMMARY;
+static boolean ready;
+static int largest = -1; /* longest free run, -1 until the groups are walked */
+
+static unsigned int summarySum(fs_summary *sum)
+{
+    unsigned int saved = sum->sum;
+    sum->sum = 0;
+    unsigned int crc = crc32c(0, (char *)sum, SUMMARY_BYTES);
+    sum->sum = saved;
+    return crc;
+}
+
+static int bucketOf(const char *name)
+{
+    return (int)(hash64(name, strnlen(name, MAX_FILENAME_LEN), 0) % DIR_HASH);
+}
+
+static int groupSize(int g)
+{
+    return DISK_BLOCKS - g * SUM_GROUP < SUM_GROUP ? DISK_BLOCKS - g * SUM_GROUP : SUM_GROUP;
+}
+
+/* tags are the map entries of group g */
+static void countGroup(int g, const unsigned char *tags)
+{
+    sum_group *grp = &SUMMARY.groups[g];
+    int n = groupSize(g), run = 0;
+
+    memset(grp, 0, sizeof(sum_group));
+    for (int i = 0; i < n; i++)
+    {
+        run = tags[i] == 0 ? run + 1 : 0;
+        grp->free += tags[i] == 0;
+        if (run > grp->longest)
+            grp->longest = run;
+        if (run == i + 1)
+            grp->head = run;
+    }
+    grp->tail = run;
+}
+
+static void indexSlot(int slot, const char *name)
+{
+    int b = bucketOf(name);
+    SUMMARY.dir_next[slot] = SUMMARY.dir_hash[b];
+    SUMMARY.dir_hash[b] = (signed char)slot;
+}
+
+void summaryBuild(const unsigned char *map, const file_info *dir)
+{
+    SUMMARY.magic = SUMMARY_MAGIC;
+    SUMMARY.free_blocks = 0;
+    for (int g = 0; g < SUM_GROUPS; g++)
+    {
+        countGroup(g, map + g * SUM_GROUP);
+        SUMMARY.free_blocks += SUMMARY.groups[g].free;
+    }
+
+    memset(SUMMARY.dir_hash, -1, sizeof(SUMMARY.dir_hash));
+    memset(SUMMARY.dir_next, -1, sizeof(SUMMARY.dir_next));
+    for (int i = MAX_FILE - 1; i >= 0; i--)
+    {
+        if (dir[i].used)
+            indexSlot(i, dir[i].name);
+    }
+    largest = -1;
+    ready = True;
+}
+
+void summaryLoad(char *sb_block)
+{
+    memcpy(&SUMMARY, sb_block + SUMMARY_OFFSET, SUMMARY_BYTES);
+    ready = SUMMARY.magic == SUMMARY_MAGIC && SUMMARY.seq == SBP->journal_seq && SUMMARY.sum == summarySum(&SUMMARY);
+    largest = -1;
+}
+
+void summaryStore(char *sb_block, unsigned int seq, boolean current)
+{
+    fs_summary *out = (fs_summary *)(sb_block + SUMMARY_OFFSET);
+
+    memset(out, 0, SUMMARY_BYTES); // no summary, the next mount builds one
+    if (!ready || !current)
+        return;
+    memcpy(out, &SUMMARY, SUMMARY_BYTES);
+    out->seq = seq;
+    out->sum = summarySum(out);
+}
+
+void summaryDrop(void)
+{
+    ready = False;
+}
+
+boolean summaryReady(void)
+{
+    if (!ready && SBP != NULL && dir_pointer != NULL)
+    {
+        unsigned long long t = statStart();
+        summaryBuild(MAP, dir_pointer);
+        statEnd(OP_SUMMARY_BUILD, t, 0, 0);
+    }
+    return ready;
+}
+
+void summaryMap(int first, const unsigned char *tags, int n)
+{
+    if (!ready)
+        return;
+
+    /* only the groups whose tags change are counted again; the last map
+       block goes on past DISK_BLOCKS, and those entries belong to no group */
+    for (int from = 0; from < n && first + from < DISK_BLOCKS; from += SUM_GROUP)
+    {
+        int g = (first + from) / SUM_GROUP;
+        int len = n - from < groupSize(g) ? n - from : groupSize(g);
+        if (len <= 0 || memcmp(MAP + first + from, tags + from, len) == 0)
+            continue;
+
+        SUMMARY.free_blocks -= SUMMARY.groups[g].free;
+        countGroup(g, tags + from);
+        SUMMARY.free_blocks += SUMMARY.groups[g].free;
+        largest = -1;
+    }
+}
+
+int summaryLargestFree(void)
+{
+    int best = 0, run = 0;
+
+    if (!summaryReady())
+        return -1;
+    if (largest != -1)
+        return largest; // no map change since it was found
+    for (int g = 0; g < SUM_GROUPS; g++)
+    {
+        sum_group *grp = &SUMMARY.groups[g];
+        if (grp->free == groupSize(g))
+        {
+            run += grp->free; // the run goes on into the next group
+            continue;
+        }
+        if (run + grp->head > best)
+            best = run + grp->head;
+        if (grp->longest > best)
+            best = grp->longest;
+        run = grp->tail;
+    }
+    largest = run > best ? run : best;
+    return largest;
+}
+
+int summaryNextFree(int from)
+{
+    if (!summaryReady())
+        return from;
+    for (int g = from / SUM_GROUP; g < SUM_GROUPS; g++)
+    {
+        if (SUMMARY.groups[g].free > 0)
+            return g * SUM_GROUP > from ? g * SUM_GROUP : from;
+    }
+    return DISK_BLOCKS;
+}
+
+char dirIndexFind(char *name)
+{
+    if (!summaryReady())
+        return -1;
+    for (int i = SUMMARY.dir_hash[bucketOf(name)]; i != -1; i = SUMMARY.dir_next[i])
+    {
+        if (dir_pointer[i].used && strcmp(dir_pointer[i].name, name) == 0)
+            return (char)i;
+    }
+    return -1;
+}
+
+void dirIndexAdd(int slot)
+{
+    if (ready)
+        indexSlot(slot, dir_pointer[slot].name);
+}
+
+void dirIndexDrop(int slot)
+{
+    if (!ready)
+        return;
+    signed char *link = &SUMMARY.dir_hash[bucketOf(dir_pointer[slot].name)];
+    while (*link != -1 && *link != slot)
+        link = &SUMMARY.dir_next[(int)*link];
+    if (*link == slot)
+        *link = SUMMARY.dir_next[slot];
+    SUMMARY.dir_next[slot] = -1;
+}
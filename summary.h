@@ -0,0 +1,69 @@
+#ifndef _SUMMARY_H_
+#define _SUMMARY_H_
+
+#include <stddef.h>
+
+#include "sfs.h"
+
+/***************************************************************************/
+/* summaries of the allocation map and the directory, kept up to date in   */
+/* memory and stored in block 0 behind the super block at a checkpoint     */
+/***************************************************************************/
+#define SUMMARY_MAGIC 0x594d5553 /* "SUMY" */
+#define SUMMARY_OFFSET 1024      /* bytes into block 0                     */
+#define SUM_GROUP 64             /* blocks per free-space group            */
+#define SUM_GROUPS ((DISK_BLOCKS + SUM_GROUP - 1) / SUM_GROUP)
+#define SUM_GROUPS_MAX (DISK_BLOCKS_MAX / SUM_GROUP)
+#define DIR_HASH 128             /* buckets of the directory name index    */
+
+/* free blocks of a group, its longest free run and the free runs it starts
+   and ends with, so runs that cross groups can be found from these alone */
+typedef struct
+{
+    unsigned char free;
+    unsigned char longest;
+    unsigned char head;
+    unsigned char tail;
+} sum_group;
+
+typedef struct
+{
+    unsigned int magic;
+    unsigned int seq;                /* journal_seq of the checkpoint      */
+    int free_blocks;
+    signed char dir_hash[DIR_HASH];  /* first slot of each bucket, or -1   */
+    signed char dir_next[MAX_FILE];  /* next slot in the same bucket       */
+    unsigned int sum;                /* taken with sum = 0 over SUMMARY_BYTES */
+    sum_group groups[SUM_GROUPS_MAX]; /* SUM_GROUPS of them are stored     */
+} fs_summary;
+
+#define SUMMARY_BYTES (offsetof(fs_summary, groups) + SUM_GROUPS * sizeof(sum_group))
+
+extern fs_summary SUMMARY;
+
+void summaryLoad(char *sb_block);
+/* take the stored summary if it describes the mounted checkpoint, else it
+   is built from MAP and the directory the first time it is needed         */
+void summaryStore(char *sb_block, unsigned int seq, boolean current);
+/* store it for the checkpoint seq, or store none unless current: the map
+   and directory in memory are the ones going home                         */
+void summaryBuild(const unsigned char *map, const file_info *dir);
+void summaryDrop(void);
+boolean summaryReady(void);
+/* build it now if it is missing; False only while nothing is mounted      */
+
+void summaryMap(int first, const unsigned char *tags, int n);
+/* MAP entries [first, first + n) are about to become tags; first is a
+   multiple of SUM_GROUP                                                   */
+int summaryLargestFree(void);
+/* longest run of free blocks, walked from the groups after a map change  */
+int summaryNextFree(int from);
+/* from if its group has a free block, else the first block of the next
+   group that has one; DISK_BLOCKS if none does                            */
+
+char dirIndexFind(char *name);
+void dirIndexAdd(int slot);  /* slot has just been given its name          */
+void dirIndexDrop(int slot); /* slot is about to lose its name             */
+/***************************************************************************/
+
+#endif
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "trace.h"
+#include "sfs.h"
+
+/***************************************************************************/
+/* The wrappers of sfs.c hand every call to traceCall while a trace is     */
+/* open. A record is a fixed trace_record and the names of the call, so a  */
+/* trace holds no file data; the replay writes a fixed pattern instead.    */
+/***************************************************************************/
+
+int trace_enabled = 0;
+static FILE *trace_file;
+static unsigned long long trace_epoch;
+
+int fs_trace_start(char *path)
+{
+    trace_header h;
+
+    if (path == NULL || trace_enabled)
+    {
+        return -1;
+    }
+    if ((trace_file = fopen(path, "wb")) == NULL)
+    {
+        perror("fs_trace_start: cannot open trace");
+        return -1;
+    }
+    setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    h.version = TRACE_VERSION;
+    h.record_size = sizeof(trace_record);
+    if (fwrite(&h, sizeof(h), 1, trace_file) != 1)
+    {
+        fclose(trace_file);
+        return -1;
+    }
+    trace_epoch = statClock();
+    trace_enabled = 1;
+    return 0;
+}
+
+int fs_trace_stop(void)
+{
+    if (!trace_enabled)
+    {
+        return -1;
+    }
+    trace_enabled = 0;
+    return fclose(trace_file) == 0 ? 0 : -1;
+}
+
+/* start the trace named by TRACE_ENV, once per process */
+void traceAuto(void)
+{
+    static int tried;
+    char *path;
+
+    if (tried || trace_enabled)
+    {
+        return;
+    }
+    tried = 1;
+    if ((path = getenv(TRACE_ENV)) != NULL && *path)
+    {
+        fs_trace_start(path);
+    }
+}
+
+void traceCall(trace_record *r, unsigned long long start, int rtn, char *name, char *name2)
+{
+    unsigned long long now = statClock();
+
+    if (start == 0 || start < trace_epoch)
+    {
+        start = now;
+    }
+    r->start_ns = start - trace_epoch;
+    r->dur_ns = now - start;
+    r->rtn = rtn;
+    r->name_len[0] = name ? (unsigned char)strnlen(name, 255) : 0;
+    r->name_len[1] = name2 ? (unsigned char)strnlen(name2, 255) : 0;
+
+    flockfile(trace_file); // the record and its names stay together
+    fwrite(r, sizeof(trace_record), 1, trace_file);
+    fwrite(name ? name : "", 1, r->name_len[0], trace_file);
+    fwrite(name2 ? name2 : "", 1, r->name_len[1], trace_file);
+    funlockfile(trace_file);
+}
+
+/* descriptor of the replay for a recorded one, -1 if it never got one */
+static int replayFd(int *fds, int fd)
+{
+    return (fd >= 0 && fd < MAX_FILE_DESCRIPTOR) ? fds[fd] : -1;
+}
+
+static int usesFd(int op)
+{
+    return op == OP_CLOSE || op == OP_READ || op == OP_WRITE || op == OP_FILESIZE || op == OP_LSEEK ||
+           op == OP_TRUNCATE || op == OP_COPY_RANGE || op == OP_SET_COMPRESSION || op == OP_SET_DEDUP ||
+           op == OP_FSYNC;
+}
+
+static void replayWait(unsigned long long t0, unsigned long long at)
+{
+    unsigned long long now = statClock();
+    struct timespec ts;
+
+    if (now - t0 < at)
+    {
+        at -= now - t0;
+        ts.tv_sec = at / 1000000000ULL;
+        ts.tv_nsec = at % 1000000000ULL;
+        nanosleep(&ts, NULL);
+    }
+}
+
+int trace_replay(char *trace, char *disk, int paced, replay_report *report)
+{
+    static int fds[MAX_FILE_DESCRIPTOR];
+    int snaps[SNAP_MAX];
+    char names[2][256];
+    char *data = NULL;
+    long long cap = 0;
+    trace_header h;
+    trace_record r;
+    FILE *in;
+    int made = 0, mounted = 0, first = 1, rtn, fd, fd2;
+    unsigned long long t0 = 0, base = 0, end = 0;
+
+    if (trace == NULL || disk == NULL || report == NULL || (in = fopen(trace, "rb")) == NULL)
+    {
+        return -1;
+    }
+    if (fread(&h, sizeof(h), 1, in) != 1 || memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) ||
+        h.version != TRACE_VERSION || h.record_size != sizeof(trace_record))
+    {
+        fclose(in);
+        return -1;
+    }
+    memset(report, 0, sizeof(replay_report));
+    memset(fds, -1, sizeof(fds));
+    memset(snaps, -1, sizeof(snaps));
+
+    while (fread(&r, sizeof(r), 1, in) == 1)
+    {
+        if (fread(names[0], 1, r.name_len[0], in) != r.name_len[0] ||
+            fread(names[1], 1, r.name_len[1], in) != r.name_len[1] || r.op >= OP_CHAIN_STEP)
+        {
+            break; // cut short, the calls before it still count
+        }
+        names[0][r.name_len[0]] = names[1][r.name_len[1]] = '\0';
+
+        if (first)
+        {
+            t0 = statClock();
+            base = r.start_ns;
+            first = 0;
+        }
+        if (paced)
+        {
+            replayWait(t0, r.start_ns - base);
+        }
+        end = r.start_ns + r.dur_ns;
+
+        /* a trace that starts on a mounted image gets an empty one */
+        if (!mounted && r.op != OP_MAKE_FS && r.op != OP_MOUNT)
+        {
+            if (make_fs(disk) != 0 || mount_fs(disk) != 0)
+            {
+                break;
+            }
+            made = mounted = 1;
+        }
+        else if (!made && r.op == OP_MOUNT && make_fs(disk) == 0)
+        {
+            made = 1;
+        }
+
+        fd = replayFd(fds, r.arg);
+        fd2 = replayFd(fds, r.arg2);
+        if (usesFd(r.op) && r.rtn != -1 && (fd == -1 || (r.op == OP_COPY_RANGE && fd2 == -1)))
+        {
+            report->skipped++; // opened before the trace started
+            continue;
+        }
+        if ((r.op == OP_READ || r.op == OP_WRITE) && r.len > cap)
+        {
+            free(data);
+            cap = r.len;
+            if ((data = malloc(cap)) == NULL)
+            {
+                break;
+            }
+            for (long long i = 0; i < cap; i++)
+            {
+                data[i] = 'a' + i % 26;
+            }
+        }
+
+        switch (r.op)
+        {
+        case OP_MAKE_FS:
+            rtn = r.arg ? make_fs_geometry(disk, r.arg, r.arg2) : make_fs(disk);
+            made = (rtn == 0) ? 1 : made;
+            break;
+        case OP_MOUNT:
+            rtn = mount_fs(disk);
+            mounted = (rtn == 0) ? 1 : mounted;
+            break;
+        case OP_UMOUNT:
+            rtn = umount_fs(disk);
+            if (rtn == 0)
+            {
+                mounted = 0;
+                memset(fds, -1, sizeof(fds));
+            }
+            break;
+        case OP_OPEN:
+            rtn = fs_open(names[0]);
+            if (rtn >= 0 && r.rtn >= 0 && r.rtn < MAX_FILE_DESCRIPTOR)
+            {
+                fds[r.rtn] = rtn;
+            }
+            break;
+        case OP_CLOSE:
+            rtn = fs_close(fd);
+            if (rtn == 0)
+            {
+                fds[r.arg] = -1;
+            }
+            break;
+        case OP_CREATE:
+            rtn = fs_create(names[0]);
+            break;
+        case OP_DELETE:
+            rtn = fs_delete(names[0]);
+            break;
+        case OP_READ:
+            rtn = fs_read(fd, data, r.len);
+            break;
+        case OP_WRITE:
+            rtn = fs_write(fd, data, r.len);
+            break;
+        case OP_FILESIZE:
+            rtn = fs_get_filesize(fd);
+            break;
+        case OP_LSEEK:
+            rtn = fs_lseek(fd, r.off);
+            break;
+        case OP_TRUNCATE:
+            rtn = fs_truncate(fd, r.len);
+            break;
+        case OP_COPY_RANGE:
+            rtn = fs_copy_range(fd, r.off, fd2, r.off2, r.len);
+            break;
+        case OP_CLONE:
+            rtn = fs_clone(names[0], names[1]);
+            break;
+        case OP_SNAPSHOT:
+            rtn = fs_snapshot();
+            if (rtn >= 0 && r.rtn >= 0 && r.rtn < SNAP_MAX)
+            {
+                snaps[r.rtn] = rtn;
+            }
+            break;
+        case OP_ROLLBACK:
+            rtn = fs_rollback((r.arg >= 0 && r.arg < SNAP_MAX) ? snaps[r.arg] : -1);
+            if (rtn == 0)
+            {
+                memset(fds, -1, sizeof(fds));
+            }
+            break;
+        case OP_SNAPSHOT_DELETE:
+            rtn = fs_snapshot_delete((r.arg >= 0 && r.arg < SNAP_MAX) ? snaps[r.arg] : -1);
+            break;
+        case OP_DEFRAG:
+            rtn = fs_defrag(r.arg);
+            break;
+        case OP_SET_COMPRESSION:
+            rtn = fs_set_compression(fd, r.len);
+            break;
+        case OP_SYNC:
+            rtn = fs_sync();
+            break;
+        case OP_FSYNC:
+            rtn = fs_fsync(fd);
+            break;
+        default: /* OP_SET_DEDUP */
+            rtn = fs_set_dedup(fd, r.len);
+            break;
+        }
+
+        report->ops++;
+        /* descriptors and snapshot ids may be numbered differently */
+        if ((r.op == OP_OPEN || r.op == OP_SNAPSHOT) ? (rtn >= 0) != (r.rtn >= 0) : rtn != r.rtn)
+        {
+            report->mismatches++;
+        }
+    }
+
+    if (mounted)
+    {
+        umount_fs(disk);
+    }
+    report->seconds = first ? 0 : (statClock() - t0) / 1e9;
+    report->recorded = (end - base) / 1e9;
+    free(data);
+    fclose(in);
+    return report->mismatches ? 1 : 0;
+}
@@ -0,0 +1,60 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/***************************************************************************/
+/* binary trace of the fs_* calls, and its replay against a fresh image    */
+/***************************************************************************/
+#define TRACE_MAGIC "SFSTRACE"
+#define TRACE_VERSION 1
+#define TRACE_ENV "SFS_TRACE" /* make_fs/mount_fs start a trace to this path */
+#define TRACE_BUFFER (1 << 16) /* stdio buffer of the trace file             */
+
+typedef struct
+{
+    char magic[8];    /* TRACE_MAGIC, not terminated                       */
+    int version;      /* TRACE_VERSION                                     */
+    int record_size;  /* sizeof(trace_record) of the writer                */
+} trace_header;
+
+/* one call; name_len[0] + name_len[1] bytes of names follow the record   */
+typedef struct
+{
+    unsigned long long start_ns; /* since the trace was started            */
+    unsigned long long dur_ns;
+    unsigned char op;            /* OP_* of stats.h                        */
+    unsigned char name_len[2];   /* file or disk names of the call         */
+    unsigned char pad;
+    int arg;       /* descriptor, snapshot id, defrag budget, flag or the
+                      block size of make_fs                               */
+    int arg2;      /* destination descriptor of fs_copy_range, or the
+                      block count of make_fs                              */
+    int rtn;       /* what the call returned                              */
+    long long off; /* file offset the call started at, or 0               */
+    long long off2;/* destination offset of fs_copy_range                 */
+    long long len; /* bytes asked for, or the new length of fs_truncate   */
+} trace_record;
+
+typedef struct
+{
+    int ops;           /* records replayed                                 */
+    int skipped;       /* records naming a descriptor the replay never got */
+    int mismatches;    /* calls whose result differs from the recorded one */
+    double seconds;    /* time the replay took                             */
+    double recorded;   /* time the recorded calls spanned                  */
+} replay_report;
+
+extern int trace_enabled; /* a trace file is open                          */
+
+int fs_trace_start(char *path);
+/* record every following call to path, 0 on success                      */
+int fs_trace_stop(void);
+void traceAuto(void);
+void traceCall(trace_record *r, unsigned long long start, int rtn, char *name, char *name2);
+
+int trace_replay(char *trace, char *disk, int paced, replay_report *report);
+/* run trace against a new image on disk, at the recorded pacing if paced;
+   0 if every call returned what it returned when recorded, 1 if some did
+   not, -1 if the trace cannot be read                                    */
+/***************************************************************************/
+
+#endif
@@ -0,0 +1,393 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk.h"
+#include "stats.h"
+#include "writeback.h"
+
+/***************************************************************************/
+/* A dirty block owns a slot of the pool; slot_of maps block numbers to    */
+/* slots, and a two-level bitmap marks the dirty ones, so the flusher      */
+/* visits them sorted without looking at the clean blocks. It copies a run */
+/* of adjacent dirty blocks out under the lock, writes it without the lock */
+/* and then frees the slots nobody wrote to meanwhile (gen). A run that    */
+/* fails stays dirty and is tried again, and the next drain reports it.    */
+/* Reads look at the pool first, so they see the newest data. Writers wait */
+/* when the pool is full, which holds them to device speed.                */
+/***************************************************************************/
+
+int writeback_on;
+
+static writeback_config wb;
+static char *pool;
+static int *gen;            /* writes to each slot                         */
+static int *free_slots;     /* stack of unused slots                       */
+static int nfree, pool_blocks, ndirty, draining, stopping;
+static int inflight;        /* the flusher writes a run without the lock   */
+static size_t pool_bytes;   /* dirty_max_kb, pool_blocks at the geometry  */
+static int failed; /* a transfer failed since the last drain reported it  */
+static int slot_of[DISK_BLOCKS_MAX]; /* -1 when the block is clean          */
+static unsigned long long dirty_map[DISK_BLOCKS_MAX / 64];  /* bit a block */
+static unsigned long long dirty_sum[DISK_BLOCKS_MAX / 4096]; /* bit a word  */
+static unsigned long long oldest; /* clock when the pool last went dirty    */
+static writeback_stats stats;
+static char run[WB_RUN_MAX * BLOCK_SIZE_MAX];
+static pthread_t flusher;
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wb_room = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_free = PTHREAD_COND_INITIALIZER;
+static int foreground; /* caller transfers waiting for io_lock             */
+
+/* the caller's transfers go first: the flusher does not start a run while
+   one of them waits for the backend                                       */
+void wb_io_lock(void)
+{
+    __atomic_add_fetch(&foreground, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&io_lock);
+    __atomic_sub_fetch(&foreground, 1, __ATOMIC_RELAXED);
+}
+
+void wb_io_unlock(void)
+{
+    if (__atomic_load_n(&foreground, __ATOMIC_RELAXED) == 0)
+        pthread_cond_signal(&io_free);
+    pthread_mutex_unlock(&io_lock);
+}
+
+/* returns the times the flusher stood back */
+static int wb_io_lock_background(void)
+{
+    int waits = 0;
+
+    pthread_mutex_lock(&io_lock);
+    while (__atomic_load_n(&foreground, __ATOMIC_RELAXED) > 0)
+    {
+        waits++;
+        pthread_cond_wait(&io_free, &io_lock);
+    }
+    return waits;
+}
+
+static int wb_due(void)
+{
+    return ndirty > 0 && (draining || stopping || (long long)ndirty * BLOCK_SIZE >= wb.dirty_kb * 1024LL ||
+                          statClock() - oldest >= (unsigned long long)wb.expire_ms * 1000000);
+}
+
+static void wb_mark(int block)
+{
+    dirty_map[block / 64] |= 1ULL << (block % 64);
+    dirty_sum[block / 4096] |= 1ULL << (block / 64 % 64);
+}
+
+static void wb_clear(int block)
+{
+    if ((dirty_map[block / 64] &= ~(1ULL << (block % 64))) == 0)
+        dirty_sum[block / 4096] &= ~(1ULL << (block / 64 % 64));
+}
+
+/* first dirty block at or after b, DISK_BLOCKS if there is none */
+static int wb_next(int b)
+{
+    int w = b / 64;
+    unsigned long long bits;
+
+    if (b >= DISK_BLOCKS)
+        return DISK_BLOCKS;
+    if ((bits = dirty_map[w] & (~0ULL << (b % 64))) != 0)
+        return w * 64 + __builtin_ctzll(bits);
+
+    /* the summary skips 64 clean words at a time */
+    w++;
+    for (int s = w / 64; s < DISK_BLOCKS_MAX / 4096; s++)
+    {
+        bits = dirty_sum[s];
+        if (s == w / 64)
+            bits &= ~0ULL << (w % 64);
+        if (bits != 0)
+        {
+            w = s * 64 + __builtin_ctzll(bits);
+            return w * 64 + __builtin_ctzll(dirty_map[w]);
+        }
+    }
+    return DISK_BLOCKS;
+}
+
+/* write out every dirty block, called and returning with wb_lock held;
+   it stops at a run the backend fails and returns -1, the blocks of that
+   run and the ones after it stay dirty                                    */
+static int wb_pass(void)
+{
+    const disk_backend *backend = disk_open_backend();
+    int gens[WB_RUN_MAX];
+
+    for (int b = wb_next(0); b < DISK_BLOCKS; b = wb_next(b))
+    {
+        int n = 0;
+        while (n < WB_RUN_MAX && b + n < DISK_BLOCKS && slot_of[b + n] != -1)
+        {
+            memcpy(run + (size_t)n * BLOCK_SIZE, pool + (size_t)slot_of[b + n] * BLOCK_SIZE, BLOCK_SIZE);
+            gens[n] = gen[slot_of[b + n]];
+            n++;
+        }
+        inflight = 1;
+        pthread_mutex_unlock(&wb_lock);
+
+        int waits = wb_io_lock_background();
+        int rtn = backend ? (n == 1 ? backend->write(b, run) : backend->writev(b, n, run)) : -1;
+        pthread_mutex_unlock(&io_lock);
+
+        pthread_mutex_lock(&wb_lock);
+        inflight = 0;
+        stats.deferred += waits;
+        if (rtn != 0)
+        {
+            failed = 1;
+            stats.failed++;
+            pthread_cond_broadcast(&wb_room);
+            return -1;
+        }
+        for (int k = 0; k < n; k++)
+        {
+            int slot = slot_of[b + k];
+            if (gen[slot] != gens[k])
+                continue; // written again while it was on its way
+            slot_of[b + k] = -1;
+            wb_clear(b + k);
+            free_slots[nfree++] = slot;
+            ndirty--;
+        }
+        stats.flushed += n;
+        stats.runs++;
+        pthread_cond_broadcast(&wb_room);
+        b += n;
+    }
+    oldest = statClock();
+    return 0;
+}
+
+static void *wb_flusher(void *arg)
+{
+    int retry = 0; // the last pass failed, the next one waits an interval
+
+    (void)arg;
+    pthread_mutex_lock(&wb_lock);
+    while (!stopping || ndirty > 0)
+    {
+        if (retry && stopping)
+            break; // nobody is left to retry them for, wb_stop drops them
+        if (retry || !wb_due())
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += (long)wb.interval_ms * 1000000;
+            ts.tv_sec += ts.tv_nsec / 1000000000;
+            ts.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&wb_work, &wb_lock, &ts);
+            retry = 0;
+            continue;
+        }
+        retry = wb_pass() != 0;
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return NULL;
+}
+
+int wb_write(int block, int count, char *buf)
+{
+    unsigned long long failures;
+
+    pthread_mutex_lock(&wb_lock);
+    failures = stats.failed;
+    for (int i = 0; i < count; i++)
+    {
+        int slot = slot_of[block + i];
+        if (slot == -1)
+        {
+            while (nfree == 0)
+            {
+                /* the device fails the writes that would make room */
+                if (stats.failed != failures)
+                {
+                    pthread_mutex_unlock(&wb_lock);
+                    return -1;
+                }
+                stats.throttled++;
+                pthread_cond_signal(&wb_work);
+                pthread_cond_wait(&wb_room, &wb_lock);
+            }
+            slot = slot_of[block + i] = free_slots[--nfree];
+            wb_mark(block + i);
+            if (ndirty++ == 0)
+                oldest = statClock();
+        }
+        memcpy(pool + (size_t)slot * BLOCK_SIZE, buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+        gen[slot]++;
+    }
+    stats.absorbed += count;
+    if ((long long)ndirty * BLOCK_SIZE >= wb.dirty_kb * 1024LL)
+        pthread_cond_signal(&wb_work);
+    pthread_mutex_unlock(&wb_lock);
+    return 0;
+}
+
+int wb_read(int block, int count, char *buf)
+{
+    const disk_backend *backend = disk_open_backend();
+    int dirty = 0, rtn = 0;
+
+    pthread_mutex_lock(&wb_lock);
+    for (int i = 0; i < count; i++)
+        dirty += slot_of[block + i] != -1;
+
+    /* a clean range stays clean until this thread writes to it */
+    if (dirty == 0)
+        pthread_mutex_unlock(&wb_lock);
+
+    if (dirty < count)
+    {
+        wb_io_lock();
+        rtn = count == 1 ? backend->read(block, buf) : backend->readv(block, count, buf);
+        wb_io_unlock();
+    }
+    if (dirty == 0)
+        return rtn;
+
+    for (int i = 0; i < count && rtn == 0; i++)
+    {
+        if (slot_of[block + i] != -1)
+            memcpy(buf + (size_t)i * BLOCK_SIZE, pool + (size_t)slot_of[block + i] * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return rtn;
+}
+
+int wb_drain(void)
+{
+    int rtn;
+
+    if (!writeback_on)
+        return 0;
+
+    pthread_mutex_lock(&wb_lock);
+    unsigned long long failures = stats.failed;
+    draining++;
+    while (ndirty > 0 && stats.failed == failures)
+    {
+        pthread_cond_signal(&wb_work);
+        pthread_cond_wait(&wb_room, &wb_lock);
+    }
+    draining--;
+    rtn = failed ? -1 : 0;
+    failed = 0;
+    pthread_mutex_unlock(&wb_lock);
+    return rtn;
+}
+
+void wb_forget(void)
+{
+    if (!writeback_on)
+        return;
+
+    pthread_mutex_lock(&wb_lock);
+    while (inflight)
+        pthread_cond_wait(&wb_room, &wb_lock);
+    for (int b = wb_next(0); b < DISK_BLOCKS; b = wb_next(b))
+    {
+        free_slots[nfree++] = slot_of[b];
+        slot_of[b] = -1;
+        wb_clear(b);
+        ndirty--;
+    }
+    pthread_cond_broadcast(&wb_room);
+    pthread_mutex_unlock(&wb_lock);
+}
+
+/* -1 if dirty blocks the device failed had to be dropped */
+static int wb_stop(void)
+{
+    pthread_mutex_lock(&wb_lock);
+    stopping = 1;
+    pthread_cond_signal(&wb_work);
+    pthread_mutex_unlock(&wb_lock);
+    pthread_join(flusher, NULL);
+
+    writeback_on = 0;
+    free(pool);
+    free(gen);
+    free(free_slots);
+    pool = NULL;
+    return ndirty > 0 || failed ? -1 : 0;
+}
+
+int disk_writeback(const writeback_config *config)
+{
+    if (config && (config->dirty_kb <= 0 || config->dirty_max_kb < config->dirty_kb ||
+                   config->dirty_max_kb * 1024LL < BLOCK_SIZE || config->expire_ms < 0 || config->interval_ms <= 0))
+        return -1;
+
+    int rtn = writeback_on ? wb_stop() : 0; // the dirty blocks go out under the old settings
+    if (!config)
+        return rtn;
+
+    wb = *config;
+    pool_bytes = (size_t)wb.dirty_max_kb * 1024;
+    pool = malloc(pool_bytes);
+    gen = calloc(pool_bytes / BLOCK_SIZE_MIN, sizeof(int)); // slots at any geometry
+    free_slots = malloc(pool_bytes / BLOCK_SIZE_MIN * sizeof(int));
+    if (!pool || !gen || !free_slots)
+    {
+        free(pool);
+        free(gen);
+        free(free_slots);
+        pool = NULL;
+        return -1;
+    }
+    wb_geometry();
+    for (int b = 0; b < DISK_BLOCKS_MAX; b++)
+        slot_of[b] = -1;
+    memset(dirty_map, 0, sizeof(dirty_map));
+    memset(dirty_sum, 0, sizeof(dirty_sum));
+    ndirty = draining = stopping = inflight = failed = 0;
+
+    if (pthread_create(&flusher, NULL, wb_flusher, NULL) != 0)
+    {
+        free(pool);
+        free(gen);
+        free(free_slots);
+        pool = NULL;
+        return -1;
+    }
+    writeback_on = 1;
+    return rtn;
+}
+
+int wb_geometry(void)
+{
+    if (!pool)
+        return 0;
+
+    /* no disk is open, so nothing is dirty: the slots are cut anew */
+    pthread_mutex_lock(&wb_lock);
+    pool_blocks = (int)(pool_bytes / BLOCK_SIZE);
+    for (nfree = 0; nfree < pool_blocks; nfree++)
+        free_slots[nfree] = pool_blocks - 1 - nfree;
+    pthread_mutex_unlock(&wb_lock);
+    return pool_blocks > 0 ? 0 : -1;
+}
+
+int disk_writeback_stats(writeback_stats *out)
+{
+    if (!out)
+        return -1;
+    pthread_mutex_lock(&wb_lock);
+    *out = stats;
+    out->dirty_blocks = ndirty;
+    pthread_mutex_unlock(&wb_lock);
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef _WRITEBACK_H_
+#define _WRITEBACK_H_
+
+#include "disk.h"
+
+/***************************************************************************/
+/* write-behind: block writes land in memory and a flusher thread drains   */
+/* them to the open disk in block order, adjacent blocks in one transfer   */
+/***************************************************************************/
+#define WB_RUN_MAX 64 /* blocks the flusher merges into one transfer       */
+
+typedef struct
+{
+    int dirty_kb;     /* the flusher starts once this much is dirty        */
+    int dirty_max_kb; /* writers wait while this much is dirty (throttle)  */
+    int expire_ms;    /* or once the oldest dirty block is this old        */
+    int interval_ms;  /* how often the flusher looks                       */
+} writeback_config;
+
+typedef struct
+{
+    int dirty_blocks;                /* waiting in memory now              */
+    unsigned long long absorbed;     /* block writes that went to memory   */
+    unsigned long long flushed;      /* blocks the flusher wrote           */
+    unsigned long long runs;         /* transfers it wrote them in         */
+    unsigned long long throttled;    /* times a writer waited for room     */
+    unsigned long long deferred;     /* times a run waited for a read      */
+    unsigned long long failed;       /* runs the device failed, kept dirty */
+} writeback_stats;
+
+int disk_writeback(const writeback_config *config);
+/* turn write-behind on with these thresholds, or off with NULL once the
+   dirty blocks are written; 0 on success, -1 if the device failed some of
+   them and they were dropped                                              */
+int disk_writeback_stats(writeback_stats *stats);
+
+/* disk.c hands the transfers of the open disk over while it is on */
+extern int writeback_on;
+int wb_write(int block, int count, char *buf);
+int wb_read(int block, int count, char *buf);
+int wb_drain(void);      /* every dirty block is on the disk when it returns
+                            0; -1 once for a transfer that failed since the
+                            last drain, its blocks stay dirty for a retry  */
+void wb_forget(void);    /* drop the dirty blocks of a disk that closes     */
+int wb_geometry(void);   /* the block size changed while no disk was open;
+                            -1 if the pool cannot hold one block now        */
+void wb_io_lock(void);   /* backend calls of the flusher and the caller take */
+void wb_io_unlock(void); /* turns, backends expect one caller at a time; the
+                            caller's go ahead of the flusher's              */
+/***************************************************************************/
+
+#endif